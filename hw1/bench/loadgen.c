@@ -0,0 +1,180 @@
+#include "phonebook_device.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define DEFAULT_USERS 100000
+
+static void report(const char *name, const size_t n, const double seconds) {
+    printf("[loadgen] %-6s %9zu ops in %8.3f s, %12.0f ops/s\n", name, n, seconds, n / seconds);
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = DEFAULT_USERS;
+    if (argc == 2) {
+        char *end;
+        errno = 0;
+        long next = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || errno == ERANGE || next <= 0) {
+            fprintf(stderr, "Usage: %s [N_USERS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        n = next;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [N_USERS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t *order = malloc(n * sizeof(size_t));
+    if (!order) {
+        fprintf(stderr, "[loadgen] Failed to allocate memory for the lookup order\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (size_t i = 0; i < n; ++i)
+        order[i] = i;
+    for (size_t i = n - 1; i > 0; --i) {
+        const size_t j = rand() % (i + 1);
+        const size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    int fd = open_session();
+    if (fd < 0) {
+        free(order);
+        return EXIT_FAILURE;
+    }
+
+    char command[COMMAND_SIZE];
+    char response[RESPONSE_SIZE];
+
+    double start = now();
+    for (size_t i = 0; i < n; ++i) {
+        format_add(command, "Surname", i);
+        if (run_command(fd, command, response, sizeof(response)))
+            goto fail;
+    }
+    report("add", n, now() - start);
+
+    start = now();
+    size_t missing = 0;
+    for (size_t i = 0; i < n; ++i) {
+        char surname[COMMAND_SIZE];
+        snprintf(surname, sizeof(surname), " Surname%zu ", order[i]);
+        snprintf(command, COMMAND_SIZE, "f Surname%zu\n", order[i]);
+        if (run_command(fd, command, response, sizeof(response)))
+            goto fail;
+        if (!strstr(response, surname))
+            ++missing;
+    }
+    report("find", n, now() - start);
+
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        char surname[COMMAND_SIZE];
+        snprintf(surname, sizeof(surname), " Surname%zu ", order[i]);
+        snprintf(command, COMMAND_SIZE, "p +7%09zu\n", order[i]);
+        if (run_command(fd, command, response, sizeof(response)))
+            goto fail;
+        if (!strstr(response, surname))
+            ++missing;
+    }
+    report("pfind", n, now() - start);
+
+    start = now();
+    const long dumped = count_dump();
+    if (dumped < 0)
+        goto fail;
+    report("dump", dumped, now() - start);
+    if ((size_t)dumped != n)
+        fprintf(stderr, "[loadgen] The dump has %ld users instead of %zu\n", dumped, n);
+
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(command, COMMAND_SIZE, "d Surname%zu\n", order[i]);
+        if (run_command(fd, command, response, sizeof(response)))
+            goto fail;
+    }
+    report("delete", n, now() - start);
+
+    // The same users once more, but all the commands of a phase go in a single write
+    char *commands = malloc(n * COMMAND_SIZE);
+    if (!commands) {
+        fprintf(stderr, "[loadgen] Failed to allocate memory for the batch\n");
+        goto fail;
+    }
+
+    start = now();
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        format_add(commands + len, "Surname", i);
+        len += strlen(commands + len);
+    }
+    long failed = run_batch(fd, commands, len, n);
+    report("badd", n, now() - start);
+
+    start = now();
+    len = 0;
+    for (size_t i = 0; failed == 0 && i < n; ++i)
+        len += snprintf(commands + len, COMMAND_SIZE, "d Surname%zu\n", order[i]);
+    if (failed == 0)
+        failed = run_batch(fd, commands, len, n);
+    report("bdel", n, now() - start);
+
+    free(commands);
+    if (failed) {
+        fprintf(stderr, "[loadgen] The batched commands failed\n");
+        goto fail;
+    }
+
+    // And once more through the binary interface, without any formatting or parsing in the module
+    struct phonebook_user user;
+
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        fill_user(&user, "Surname", i);
+        if (ioctl(fd, PHONEBOOK_IOC_ADD, &user)) {
+            fprintf(stderr, "[loadgen] Failed to add a user: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+    report("iadd", n, now() - start);
+
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        char name[PHONEBOOK_FIELD_SIZE];
+        snprintf(name, sizeof(name), "Name%zu", order[i]);
+        snprintf(user.surname, sizeof(user.surname), "Surname%zu", order[i]);
+        if (ioctl(fd, PHONEBOOK_IOC_FIND, &user) || strcmp(user.name, name) != 0)
+            ++missing;
+    }
+    report("ifind", n, now() - start);
+
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        struct phonebook_surname key;
+        snprintf(key.surname, sizeof(key.surname), "Surname%zu", order[i]);
+        if (ioctl(fd, PHONEBOOK_IOC_DELETE, &key)) {
+            fprintf(stderr, "[loadgen] Failed to delete a user: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+    report("idel", n, now() - start);
+
+    if (missing)
+        fprintf(stderr, "[loadgen] %zu lookups returned a wrong answer\n", missing);
+
+    close(fd);
+    free(order);
+    return missing ? EXIT_FAILURE : EXIT_SUCCESS;
+
+fail:
+    close(fd);
+    free(order);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,154 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "phonebook_device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// A file opened for both reading and writing gets its own command and response buffers
+int open_session(void) {
+    int fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0)
+        fprintf(stderr, "[bench] Failed to open %s: %s\n", DEVICE_PATH, strerror(errno));
+    return fd;
+}
+
+// The module executes every command once its newline arrives, reading until EOF gets all the queued responses
+int run_command(const int fd, const char *command, char *response, const size_t size) {
+    const size_t len = strlen(command);
+    if (write(fd, command, len) != (ssize_t)len) {
+        fprintf(stderr, "[bench] Failed to write the command\n");
+        return 1;
+    }
+
+    size_t done = 0;
+    ssize_t got = 0;
+    while (done + 1 < size && (got = read(fd, response + done, size - 1 - done)) > 0)
+        done += got;
+    response[done] = '\0';
+
+    if (got < 0) {
+        fprintf(stderr, "[bench] Failed to read the response\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Reads the queued responses into responses + *done, until there are none left
+static int read_responses(const int fd, char *responses, const size_t size, size_t *done) {
+    ssize_t got = 0;
+    while (*done + 1 < size && (got = read(fd, responses + *done, size - 1 - *done)) > 0)
+        *done += got;
+
+    if (got < 0) {
+        fprintf(stderr, "[bench] Failed to read the responses\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+* Every command leaves exactly one line of response, "error" for the failed ones.
+* A session holds a limited amount of responses, so they are read whenever the module stops taking the commands.
+*/
+long run_batch(const int fd, const char *commands, const size_t len, const size_t n_commands) {
+    const size_t size = n_commands * RESPONSE_SIZE + 1;
+    char *responses = malloc(size);
+    if (!responses) {
+        fprintf(stderr, "[bench] Failed to allocate memory for the responses\n");
+        return -1;
+    }
+
+    size_t done = 0;
+    for (size_t written = 0; written < len;) {
+        const ssize_t put = write(fd, commands + written, len - written);
+        if (put == 0 || (put < 0 && errno != EAGAIN)) {
+            fprintf(stderr, "[bench] Failed to write the commands\n");
+            free(responses);
+            return -1;
+        }
+        if (put > 0)
+            written += put;
+
+        if (written < len && read_responses(fd, responses, size, &done)) {
+            free(responses);
+            return -1;
+        }
+    }
+
+    if (read_responses(fd, responses, size, &done)) {
+        free(responses);
+        return -1;
+    }
+    responses[done] = '\0';
+
+    long failed = 0;
+    size_t lines = 0;
+    for (char *line = responses; *line; ++lines) {
+        char *end = strchr(line, '\n');
+        if (!end)
+            break;
+        if (strncmp(line, "error\n", end - line + 1) == 0)
+            ++failed;
+        line = end + 1;
+    }
+    free(responses);
+
+    if (lines != n_commands) {
+        fprintf(stderr, "[bench] Expected %zu responses, got %zu\n", n_commands, lines);
+        return -1;
+    }
+    return failed;
+}
+
+long count_dump(void) {
+    int fd = open(DUMP_PATH, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[bench] Failed to open %s: %s\n", DUMP_PATH, strerror(errno));
+        return -1;
+    }
+
+    static char buffer[1 << 16];
+    long lines = 0;
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; (p = memchr(p, '\n', buffer + got - p)); ++p)
+            ++lines;
+    }
+    close(fd);
+
+    if (got < 0) {
+        fprintf(stderr, "[bench] Failed to read %s\n", DUMP_PATH);
+        return -1;
+    }
+    return lines;
+}
+
+void format_add(char *command, const char *prefix, const size_t i) {
+    snprintf(
+        command,
+        COMMAND_SIZE,
+        "a Name%zu %s%zu +7%09zu user%zu@example.com %zu\n",
+        i, prefix, i, i, i, 18 + i % 60
+    );
+}
+
+void fill_user(struct phonebook_user *user, const char *prefix, const size_t i) {
+    snprintf(user->name, sizeof(user->name), "Name%zu", i);
+    snprintf(user->surname, sizeof(user->surname), "%s%zu", prefix, i);
+    snprintf(user->phone, sizeof(user->phone), "+7%09zu", i);
+    snprintf(user->email, sizeof(user->email), "user%zu@example.com", i);
+    user->age = 18 + i % 60;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
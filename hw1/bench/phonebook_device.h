@@ -0,0 +1,31 @@
+#ifndef PHONEBOOK_DEVICE_H
+#define PHONEBOOK_DEVICE_H
+
+#include "../phonebook_ioctl.h"
+
+#include <stddef.h>
+
+#define DEVICE_PATH   "/dev/phonebook_device"
+#define DUMP_PATH     "/proc/phonebook"
+#define COMMAND_SIZE  256
+#define RESPONSE_SIZE 256
+
+// Opens a private session with the module, returns -1 on error
+int open_session(void);
+// Sends a single text command and reads its response, returns 1 on error
+int run_command(const int fd, const char *command, char *response, const size_t size);
+// Sends newline-separated commands in as few writes as the module takes and reads all the responses,
+// returns the number of failed commands or -1 on error
+long run_batch(const int fd, const char *commands, const size_t len, const size_t n_commands);
+
+// Reads the whole dump of the phonebook, returns the number of records in it or -1 on error
+long count_dump(void);
+
+// Formats the command that adds the i-th generated user
+void format_add(char *command, const char *prefix, const size_t i);
+// The same user for the binary interface
+void fill_user(struct phonebook_user *user, const char *prefix, const size_t i);
+
+double now(void);
+
+#endif
@@ -0,0 +1,194 @@
+#define _DEFAULT_SOURCE
+
+#include "phonebook_device.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_USERS   10000
+#define DEFAULT_SECONDS 2
+
+struct Reader {
+    pthread_t    thread;
+    unsigned int seed;
+    size_t       ops, mismatches;
+    int          failed;
+};
+
+static atomic_int stop;
+static size_t     n_users;
+
+static void *run_reader(void *arg) {
+    struct Reader *reader = arg;
+    char command[COMMAND_SIZE], surname[COMMAND_SIZE], response[RESPONSE_SIZE];
+
+    // Every reader has its own session, so the responses never mix
+    int fd = open_session();
+    if (fd < 0) {
+        reader->failed = 1;
+        return NULL;
+    }
+
+    while (!atomic_load(&stop)) {
+        const size_t i = rand_r(&reader->seed) % n_users;
+        snprintf(command, COMMAND_SIZE, "f Surname%zu\n", i);
+        snprintf(surname, sizeof(surname), " Surname%zu ", i);
+        if (run_command(fd, command, response, sizeof(response))) {
+            reader->failed = 1;
+            break;
+        }
+
+        if (!strstr(response, surname))
+            ++reader->mismatches;
+        ++reader->ops;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Keeps adding and removing users that the readers never look for
+static void *run_writer(void *arg) {
+    size_t *ops = arg;
+    char command[COMMAND_SIZE], response[RESPONSE_SIZE];
+
+    int fd = open_session();
+    if (fd < 0)
+        return NULL;
+
+    for (size_t i = 0; !atomic_load(&stop); ++i) {
+        format_add(command, "Churn", i);
+        if (run_command(fd, command, response, sizeof(response)))
+            break;
+        snprintf(command, COMMAND_SIZE, "d Churn%zu\n", i);
+        if (run_command(fd, command, response, sizeof(response)))
+            break;
+        *ops += 2;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int run(const size_t n_threads, const double seconds, const int with_writer) {
+    struct Reader *readers = calloc(n_threads, sizeof(struct Reader));
+    if (!readers) {
+        fprintf(stderr, "[stress] Failed to allocate memory for the readers\n");
+        return 1;
+    }
+
+    pthread_t writer;
+    size_t writer_ops = 0;
+    atomic_store(&stop, 0);
+
+    const double start = now();
+    size_t started = 0;
+    for (; started < n_threads; ++started) {
+        readers[started].seed = started + 1;
+        if (pthread_create(&readers[started].thread, NULL, run_reader, readers + started))
+            break;
+    }
+    const int writer_started = with_writer && started == n_threads && !pthread_create(&writer, NULL, run_writer, &writer_ops);
+
+    usleep(seconds * 1e6);
+    atomic_store(&stop, 1);
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(readers[i].thread, NULL);
+    if (writer_started)
+        pthread_join(writer, NULL);
+    const double elapsed = now() - start;
+
+    size_t ops = 0, mismatches = 0;
+    int failed = started != n_threads || (with_writer && !writer_started);
+    for (size_t i = 0; i < started; ++i) {
+        ops += readers[i].ops;
+        mismatches += readers[i].mismatches;
+        failed |= readers[i].failed;
+    }
+    free(readers);
+
+    if (failed || mismatches) {
+        fprintf(stderr, "[stress] The run with %zu readers failed (%zu wrong answers)\n", n_threads, mismatches);
+        return 1;
+    }
+
+    printf(
+        "[stress] %3zu readers: %12.0f finds/s, %12.0f finds/s per reader",
+        n_threads, ops / elapsed, ops / elapsed / n_threads
+    );
+    if (with_writer)
+        printf(", writer %.0f ops/s", writer_ops / elapsed);
+    printf("\n");
+    return 0;
+}
+
+static int parse_size(const char *arg, size_t *value) {
+    char *end;
+    errno = 0;
+    long next = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE || next <= 0)
+        return 1;
+
+    *value = next;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int with_writer = 0;
+    if (argc > 1 && strcmp(argv[1], "-w") == 0) {
+        with_writer = 1;
+        ++argv;
+        --argc;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cpus > 0 ? cpus : 1, seconds = DEFAULT_SECONDS;
+    n_users = DEFAULT_USERS;
+    if (
+        argc > 4 ||
+        (argc > 1 && parse_size(argv[1], &max_threads)) ||
+        (argc > 2 && parse_size(argv[2], &n_users)) ||
+        (argc > 3 && parse_size(argv[3], &seconds))
+    ) {
+        fprintf(stderr, "Usage: %s [-w] [MAX_THREADS [N_USERS [SECONDS]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open_session();
+    if (fd < 0)
+        return EXIT_FAILURE;
+
+    char command[COMMAND_SIZE], response[RESPONSE_SIZE];
+    for (size_t i = 0; i < n_users; ++i) {
+        format_add(command, "Surname", i);
+        if (run_command(fd, command, response, sizeof(response)))
+            return EXIT_FAILURE;
+    }
+
+    int result = EXIT_SUCCESS;
+    // 1, 2, 4, ... readers, the last run uses exactly max_threads of them
+    for (size_t n_threads = 1; n_threads <= max_threads;) {
+        if (run(n_threads, seconds, with_writer)) {
+            result = EXIT_FAILURE;
+            break;
+        }
+        if (n_threads == max_threads)
+            break;
+        n_threads = n_threads * 2 < max_threads ? n_threads * 2 : max_threads;
+    }
+
+    for (size_t i = 0; i < n_users; ++i) {
+        snprintf(command, COMMAND_SIZE, "d Surname%zu\n", i);
+        if (run_command(fd, command, response, sizeof(response)))
+            return EXIT_FAILURE;
+    }
+
+    close(fd);
+    return result;
+}
@@ -3,66 +3,233 @@
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/rbtree.h>
+#include <linux/rhashtable.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "phonebook_ioctl.h"
+
+// A kernel with the Phonebook syscalls (hw3/) calls the module directly
+#ifdef __has_include
+#if __has_include(<linux/phonebook.h>)
+#include <linux/phonebook.h>
+#define HAVE_PHONEBOOK_SYSCALLS
+#endif
+#endif
 
 #define DEVICE_NAME "phonebook_device"
 #define CLASS_NAME  "phonebook"
+#define PROC_NAME   "phonebook"
 #define BUFFER_SIZE 256
-#define MAX_USERS   256
+#define AGE_SIZE    24 // enough for any long
+#define QUERY_PAGE  64 // users answered by a single prefix or range query
+#define RESPONSES_MAX (64 * 1024) // bytes of responses a session may hold before they are read
 
 MODULE_LICENSE("GPL");
 
+// Fixed-size record headers come from users_cache, the strings of a record are packed into one buffer
 struct User {
-    const char *name, *surname, *phone, *email, *to_split;
-    long       age;
-    int        successfully_created;
+    const char         *name, *surname, *phone, *email; // point into strings
+    char               *strings; // "name\0surname\0phone\0email\0"
+    long               age;
+    u64                id;           // the order of adding, breaks the ties in the ordered indexes
+    struct rhlist_head surname_node; // several users may share a surname
+    struct rhlist_head phone_node;   // or a phone
+    struct rhlist_head email_node;   // or an email
+    struct rb_node     surname_rb;   // ordered by (surname, id)
+    struct rb_node     age_rb;       // ordered by (age, id)
+    struct rb_node     id_rb;        // ordered by id, for the scans
+    struct rcu_head    rcu;          // removed records are freed after the readers are done
+};
+
+static u32 string_hashfn(const void *data, u32 len, u32 seed);
+static u32 surname_hashfn(const void *data, u32 len, u32 seed);
+static int surname_cmpfn(struct rhashtable_compare_arg *arg, const void *obj);
+static u32 phone_hashfn(const void *data, u32 len, u32 seed);
+static int phone_cmpfn(struct rhashtable_compare_arg *arg, const void *obj);
+static u32 email_hashfn(const void *data, u32 len, u32 seed);
+static int email_cmpfn(struct rhashtable_compare_arg *arg, const void *obj);
+
+// Keyed by the surname string, the table grows and shrinks with the number of users
+static const struct rhashtable_params surname_params = {
+    .head_offset         = offsetof(struct User, surname_node),
+    .hashfn              = string_hashfn,
+    .obj_hashfn          = surname_hashfn,
+    .obj_cmpfn           = surname_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params phone_params = {
+    .head_offset         = offsetof(struct User, phone_node),
+    .hashfn              = string_hashfn,
+    .obj_hashfn          = phone_hashfn,
+    .obj_cmpfn           = phone_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params email_params = {
+    .head_offset         = offsetof(struct User, email_node),
+    .hashfn              = string_hashfn,
+    .obj_hashfn          = email_hashfn,
+    .obj_cmpfn           = email_cmpfn,
+    .automatic_shrinking = true,
+};
+
+// Records are never changed once indexed, lookups only take the RCU read lock
+static struct kmem_cache    *users_cache = NULL;
+static struct rhltable      users_by_surname; // owns the records
+static struct rhltable      users_by_phone;
+static struct rhltable      users_by_email;
+static struct rb_root       users_by_surname_order = RB_ROOT; // for the prefix queries
+static struct rb_root       users_by_age = RB_ROOT;           // for the range queries
+static struct rb_root       users_by_id = RB_ROOT;            // for the scans
+static size_t               users_count = 0;
+static u64                  users_next_id = 1;
+static struct rw_semaphore  users_sem; // serializes adds and removes, the queries of the trees share it
+
+// Responses of the executed commands, waiting to be read in order
+struct Responses {
+    char   *data;
+    size_t size, capacity;
+    size_t offset; // how much has been read already
 };
 
-static struct User users[MAX_USERS];
-static size_t      users_count = 0;
-
-static int           major_number;
-static char          user_buffer[BUFFER_SIZE] = {0}; // messages from the user
-static int           user_msg_size;
-static int           user_buffer_needs_parsing = 0;
-static char          device_buffer[BUFFER_SIZE] = {0}; // messages to the user
-static int           device_msg_size;
-static int           device_write_opened_count = 0;
-static int           device_read_opened_count = 0;
-static struct class  *phonebook_class = NULL;
-static struct device *phonebook_device = NULL;
-static struct mutex  flush_mutex;
+// State of a single open file, so every client has its own commands and responses
+struct Session {
+    char             user_buffer[BUFFER_SIZE]; // the command being received
+    int              user_msg_size;
+    int              user_msg_too_long;
+    char             device_buffer[BUFFER_SIZE]; // the response of the command being executed
+    struct Responses responses;
+    struct mutex     lock; // in case several threads share the file
+};
+
+static int              major_number;
+static struct Responses last_responses = {0}; // for "echo ... > device; cat device"
+static struct class     *phonebook_class = NULL;
+static struct device    *phonebook_device = NULL;
+static struct mutex     last_responses_mutex;
 
 static int     dev_open(struct inode *, struct file *);
 static int     dev_flush(struct file *, fl_owner_t id);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char __user *, size_t, loff_t *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
 
 static struct file_operations fops = {
-    .open    = dev_open,
-    .flush   = dev_flush,
-    .release = dev_release,
-    .read    = dev_read,
-    .write   = dev_write,
+    .open           = dev_open,
+    .flush          = dev_flush,
+    .release        = dev_release,
+    .read           = dev_read,
+    .write          = dev_write,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl, // the structs have the same layout everywhere
 };
 
-static struct User new_user(const char *data);
-static ssize_t     find_user(const char *surname);
-static int         add_user(const struct User user);
-static int         remove_user(size_t index);
+static int   dump_open(struct inode *, struct file *);
+static void *dump_start(struct seq_file *, loff_t *);
+static void *dump_next(struct seq_file *, void *, loff_t *);
+static void  dump_stop(struct seq_file *, void *);
+static int   dump_show(struct seq_file *, void *);
+
+static const struct seq_operations dump_seq_ops = {
+    .start = dump_start,
+    .next  = dump_next,
+    .stop  = dump_stop,
+    .show  = dump_show,
+};
 
-static int parse_user_buffer(void);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops dump_ops = {
+    .proc_open    = dump_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = seq_release_private,
+};
+#else
+static const struct file_operations dump_ops = {
+    .owner   = THIS_MODULE,
+    .open    = dump_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = seq_release_private,
+};
+#endif
+
+static struct proc_dir_entry *dump_entry = NULL;
+
+#ifdef HAVE_PHONEBOOK_SYSCALLS
+static int syscall_get_user(const char *surname, struct user_data *user, char *buffer, size_t size);
+static int syscall_add_user(const struct user_data *user);
+static int syscall_del_user(const char *surname);
+static long syscall_scan_users(u64 *cursor, char *buffer, size_t size);
+
+static const struct phonebook_ops syscall_ops = {
+    .owner = THIS_MODULE,
+    .get   = syscall_get_user,
+    .add   = syscall_add_user,
+    .del   = syscall_del_user,
+    .scan  = syscall_scan_users,
+};
+#endif
+
+static struct User *new_user(const char *data);
+static struct User *alloc_user(const char *const fields[4], const size_t lengths[4], long age);
+static struct User *lookup_user(const char *surname);
+static struct User *lookup_user_by_phone(const char *phone);
+static struct User *lookup_user_by_email(const char *email);
+static int         find_user(struct User *(*lookup)(const char *), const char *key, char *buffer, size_t size);
+static int         query_by_prefix(struct Session *session);
+static int         query_by_age(struct Session *session);
+static struct User *first_after_id(u64 id);
+static int         add_user(struct User *user);
+static int         remove_user(const char *surname);
+static void        free_user(void *ptr, void *arg);
+static void        free_user_rcu(struct rcu_head *head);
+static int         init_indexes(void);
+static void        destroy_indexes(void);
+
+static int  parse_user_buffer(struct Session *session);
+static int  execute_command(struct Session *session);
+static int  append_response(struct Responses *responses, const char *data, size_t len);
+static void free_responses(struct Responses *responses);
 
 static int __init phonebook_init(void) {
+    int error;
+
     printk(KERN_INFO "Phonebook: initializing the module\n");
 
+    init_rwsem(&users_sem);
+    mutex_init(&last_responses_mutex);
+
+    users_cache = kmem_cache_create("phonebook_user", sizeof(struct User), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!users_cache) {
+        printk(KERN_ALERT "Phonebook: failed to create the user cache\n");
+        return -ENOMEM;
+    }
+
+    error = init_indexes();
+    if (error) {
+        kmem_cache_destroy(users_cache);
+        printk(KERN_ALERT "Phonebook: failed to initialize the indexes\n");
+        return error;
+    }
+
     major_number = register_chrdev(0, DEVICE_NAME, &fops);
     if (major_number < 0) {
+        destroy_indexes();
+        kmem_cache_destroy(users_cache);
         printk(KERN_ALERT "Phonebook: failed to allocate a major number\n");
         return major_number;
     }
@@ -72,6 +239,8 @@ static int __init phonebook_init(void) {
     phonebook_class = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(phonebook_class)) {
         unregister_chrdev(major_number, DEVICE_NAME);
+        destroy_indexes();
+        kmem_cache_destroy(users_cache);
         printk(KERN_ALERT "Phonebook: failed to register a device class\n");
         return PTR_ERR(phonebook_class);
     }
@@ -83,80 +252,185 @@ static int __init phonebook_init(void) {
         class_unregister(phonebook_class);
         class_destroy(phonebook_class);
         unregister_chrdev(major_number, DEVICE_NAME);
+        destroy_indexes();
+        kmem_cache_destroy(users_cache);
         printk(KERN_ALERT "Phonebook: failed to register a device\n");
         return PTR_ERR(phonebook_device);
     }
 
-    mutex_init(&flush_mutex);
+    dump_entry = proc_create(PROC_NAME, 0444, NULL, &dump_ops);
+    if (!dump_entry) {
+        device_destroy(phonebook_class, MKDEV(major_number, 0));
+        class_unregister(phonebook_class);
+        class_destroy(phonebook_class);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        destroy_indexes();
+        kmem_cache_destroy(users_cache);
+        printk(KERN_ALERT "Phonebook: failed to create /proc/%s\n", PROC_NAME);
+        return -ENOMEM;
+    }
+
+#ifdef HAVE_PHONEBOOK_SYSCALLS
+    error = phonebook_register_ops(&syscall_ops);
+    if (error) {
+        proc_remove(dump_entry);
+        device_destroy(phonebook_class, MKDEV(major_number, 0));
+        class_unregister(phonebook_class);
+        class_destroy(phonebook_class);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        destroy_indexes();
+        kmem_cache_destroy(users_cache);
+        printk(KERN_ALERT "Phonebook: failed to register the syscall operations\n");
+        return error;
+    }
+#endif
 
     printk(KERN_INFO "Phonebook: successfully initialized\n");
     return 0;
 }
 
 static void __exit phonebook_exit(void) {
-    size_t i;
-
+#ifdef HAVE_PHONEBOOK_SYSCALLS
+    phonebook_unregister_ops(&syscall_ops);
+#endif
+    proc_remove(dump_entry); // waits for the readers of the dump to leave
     device_destroy(phonebook_class, MKDEV(major_number, 0));
     class_unregister(phonebook_class);
     class_destroy(phonebook_class);
     unregister_chrdev(major_number, DEVICE_NAME);
 
-    for (i = 0; i < users_count; i++)
-        kfree(users[i].to_split);
+    rhltable_destroy(&users_by_email);
+    rhltable_destroy(&users_by_phone);
+    rhltable_free_and_destroy(&users_by_surname, free_user, NULL);
+    rcu_barrier(); // waits for the records removed earlier to be freed
+    kmem_cache_destroy(users_cache);
+
+    free_responses(&last_responses);
 
     printk(KERN_INFO "Phonebook: successfully exited\n");
 }
 
+/*
+* Every line written to the device is a command, executed as soon as its newline arrives,
+* and every command leaves one line of response (a page of lines for the queries), read back in the same order.
+* A file opened for both reading and writing is a private session: any number of commands
+* may be written to it, and their responses are read back from the same file.
+* The responses of a write-only file are left for the next read-only open, which takes them,
+* just like "echo 'f surname' > device; cat device" expects.
+* Once a session holds RESPONSES_MAX bytes of responses, it takes no more commands until they are read.
+*/
 static int dev_open(struct inode *inode, struct file *file) {
-    if (file->f_flags & O_RDWR)  // You can't open this device to both read and write
-        return -ENOSYS;
+    struct Session *session = kzalloc(sizeof(*session), GFP_KERNEL);
 
-    if (
-        ((file->f_flags & O_WRONLY) && device_write_opened_count) ||
-        ((file->f_flags & O_RDONLY) && device_read_opened_count)
-    )
-        return -EBUSY;
+    if (!session) {
+        printk(KERN_ERR "Phonebook: failed to allocate memory for the session\n");
+        return -ENOMEM;
+    }
+    mutex_init(&session->lock);
 
-    if (file->f_flags & O_WRONLY)
-        device_write_opened_count = 1;
-    else
-        device_read_opened_count = 1;
+    if ((file->f_flags & O_ACCMODE) == O_RDONLY) {
+        mutex_lock(&last_responses_mutex);
+        session->responses = last_responses;
+        last_responses = (struct Responses){0};
+        mutex_unlock(&last_responses_mutex);
+    }
 
+    file->private_data = session;
     try_module_get(THIS_MODULE);
 
     printk(KERN_INFO "Phonebook: device has been opened\n");
     return 0;
 }
 
-static int dev_flush(struct file *file, fl_owner_t id) {
-    mutex_lock(&flush_mutex);
+// Returns 1 on error
+static int append_response(struct Responses *responses, const char *data, size_t len) {
+    size_t capacity;
+    char *grown;
+
+    if (len == 0)
+        return 0;
 
-    if (user_buffer_needs_parsing) {
-        if (parse_user_buffer()) { // parse_user_buffer returns 1 on error
-            device_buffer[0] = 0;
-            device_msg_size = 0;
-            printk(KERN_INFO "Phonebook: cleared the device buffer\n");
+    if (responses->offset == responses->size)
+        responses->offset = responses->size = 0;
+
+    if (responses->size + len > responses->capacity) {
+        capacity = max((size_t)BUFFER_SIZE, responses->capacity);
+        while (capacity < responses->size - responses->offset + len)
+            capacity *= 2;
+
+        // The responses that have been read already are dropped while moving
+        grown = kvmalloc(capacity, GFP_KERNEL);
+        if (!grown) {
+            printk(KERN_ERR "Phonebook: failed to allocate memory for the responses\n");
+            return 1;
         }
-        user_buffer_needs_parsing = 0;
+        memcpy(grown, responses->data + responses->offset, responses->size - responses->offset);
+        kvfree(responses->data);
+
+        responses->data = grown;
+        responses->size -= responses->offset;
+        responses->offset = 0;
+        responses->capacity = capacity;
+    }
+
+    memcpy(responses->data + responses->size, data, len);
+    responses->size += len;
+    return 0;
+}
+
+static void free_responses(struct Responses *responses) {
+    kvfree(responses->data);
+    *responses = (struct Responses){0};
+}
+
+// Executes the received command and queues its response, returns 1 on error
+static int execute_command(struct Session *session) {
+    int failed;
+
+    if (session->user_msg_too_long) {
+        printk(KERN_ERR "Phonebook: the command is longer than %d characters, ignoring\n", BUFFER_SIZE - 1);
+        failed = 1;
+    } else if (session->user_msg_size == 0) {
+        return 0; // empty lines are not commands
     } else {
-        device_buffer[0] = 0;
-        device_msg_size = 0;
-        printk(KERN_INFO "Phonebook: cleared the device buffer\n");
+        session->user_buffer[session->user_msg_size] = 0;
+        failed = parse_user_buffer(session); // parse_user_buffer returns 1 on error
     }
 
-    user_buffer[0] = 0;
-    user_msg_size = 0;
-    printk(KERN_INFO "Phonebook: cleared the user buffer\n");
+    session->user_msg_size = 0;
+    session->user_msg_too_long = 0;
+
+    if (failed)
+        strcpy(session->device_buffer, "error\n");
+    return append_response(&session->responses, session->device_buffer, strlen(session->device_buffer));
+}
+
+static int dev_flush(struct file *file, fl_owner_t id) {
+    struct Session *session = file->private_data;
+
+    mutex_lock(&session->lock);
+
+    // The last command does not need a newline
+    execute_command(session);
+
+    // Closing a duplicate of the file or a file nothing was written to keeps the previous responses
+    if ((file->f_flags & O_ACCMODE) == O_WRONLY && session->responses.size > 0) {
+        mutex_lock(&last_responses_mutex);
+        free_responses(&last_responses);
+        last_responses = session->responses;
+        session->responses = (struct Responses){0};
+        mutex_unlock(&last_responses_mutex);
+    }
 
-    mutex_unlock(&flush_mutex);
+    mutex_unlock(&session->lock);
     return 0;
 }
 
 static int dev_release(struct inode *inode, struct file *file) {
-    if (file->f_flags & O_WRONLY)
-        device_write_opened_count = 0;
-    else
-        device_read_opened_count = 0;
+    struct Session *session = file->private_data;
+
+    free_responses(&session->responses);
+    kfree(session);
 
     module_put(THIS_MODULE);
 
@@ -166,230 +440,977 @@ static int dev_release(struct inode *inode, struct file *file) {
 
 // Data path: device -> user
 static ssize_t dev_read(struct file *file, char __user *buffer, size_t len, loff_t *offset) {
-    int error_count, copy_len;
+    struct Session *session = file->private_data;
+    struct Responses *responses = &session->responses;
+    int error_count;
+    size_t copy_len;
 
-    copy_len = min(device_msg_size - *offset, len);
-    if (copy_len <= 0)
+    mutex_lock(&session->lock);
+
+    // The last command does not need a newline
+    if (execute_command(session)) {
+        mutex_unlock(&session->lock);
+        return -ENOMEM;
+    }
+
+    copy_len = min(responses->size - responses->offset, len);
+    if (copy_len == 0) {
+        mutex_unlock(&session->lock);
         return 0;
+    }
 
-    error_count = copy_to_user(buffer, device_buffer + *offset, copy_len);
+    error_count = copy_to_user(buffer, responses->data + responses->offset, copy_len);
     if (error_count != 0) {
+        mutex_unlock(&session->lock);
         printk(KERN_ERR "Phonebook: failed to copy %d bytes to the user space\n", error_count);
         return -EFAULT;
     }
 
-    *offset += copy_len;
-    printk(KERN_INFO "Phonebook: successfully copied the message (%d chars) to user space\n", copy_len);
+    responses->offset += copy_len;
+    mutex_unlock(&session->lock);
+    printk(KERN_INFO "Phonebook: successfully copied the message (%zu chars) to user space\n", copy_len);
     return copy_len;
 }
 
-// Data path: user -> device
+// Data path: user -> device; the commands are executed line by line as they arrive
 static ssize_t dev_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
-    int error_count, copy_len;
+    struct Session *session = file->private_data;
+    char chunk[BUFFER_SIZE];
+    size_t done, chunk_len, i;
+    int error_count;
+
+    mutex_lock(&session->lock);
+
+    for (done = 0; done < len; done += chunk_len) {
+        chunk_len = min(len - done, (size_t)BUFFER_SIZE);
+        error_count = copy_from_user(chunk, buffer + done, chunk_len);
+        if (error_count != 0) {
+            mutex_unlock(&session->lock);
+            printk(KERN_ERR "Phonebook: failed to copy %d bytes from the user space\n", error_count);
+            return done ? (ssize_t)done : -EFAULT;
+        }
 
-    user_buffer_needs_parsing = 0;
+        for (i = 0; i < chunk_len; i++) {
+            if (chunk[i] == '\n' && session->responses.size - session->responses.offset >= RESPONSES_MAX) {
+                // The command waits for its newline to be written again, after the responses are read
+                mutex_unlock(&session->lock);
+                if (done + i > 0)
+                    return (ssize_t)(done + i);
+                return (file->f_flags & O_ACCMODE) == O_WRONLY ? -ENOSPC : -EAGAIN;
+            }
+
+            if (chunk[i] == '\n') {
+                if (execute_command(session)) { // execute_command returns 1 on error
+                    mutex_unlock(&session->lock);
+                    return -ENOMEM;
+                }
+            } else if (session->user_msg_size < BUFFER_SIZE - 1) {
+                session->user_buffer[session->user_msg_size++] = chunk[i];
+            } else {
+                session->user_msg_too_long = 1;
+            }
+        }
+    }
 
-    copy_len = min(BUFFER_SIZE - *offset, len);
-    if (copy_len <= 0) {
-        if (BUFFER_SIZE == *offset)
-            printk(KERN_INFO "Phonebook: no more space left in the buffer, ignoring\n");
-        else
-            printk(KERN_INFO "Phonebook: nothing more to copy from user space to device\n");
+    mutex_unlock(&session->lock);
+    printk(KERN_INFO "Phonebook: received %zu characters from the user\n", len);
+    return len;
+}
+
+// Fields of the binary interfaces have to stay representable in the text protocol
+static int valid_field(const char *field, size_t len) {
+    return len > 0 && !memchr(field, ' ', len) && !memchr(field, '\n', len);
+}
 
-        user_buffer_needs_parsing = 1;
-        return len;
+// Returns the length of a string from the binary interface, or -EINVAL if it can't be a field of the text protocol
+static int ioctl_field_len(const char *field) {
+    size_t len = strnlen(field, PHONEBOOK_FIELD_SIZE);
+
+    if (len == PHONEBOOK_FIELD_SIZE || !valid_field(field, len))
+        return -EINVAL;
+    return len;
+}
+
+// A user has to be returned as one line of the text protocol, "name surname phone email age\n" of at most BUFFER_SIZE - 1 characters
+static int user_line_fits(const size_t lengths[4], long age) {
+    size_t len = snprintf(NULL, 0, "%ld", age) + 5; // 4 spaces and the newline
+    size_t i;
+
+    for (i = 0; i < 4; i++) {
+        if (lengths[i] > BUFFER_SIZE - 1)
+            return 0;
+        len += lengths[i];
     }
+    return len <= BUFFER_SIZE - 1;
+}
 
-    error_count = copy_from_user(user_buffer + *offset, buffer, copy_len);
-    if (error_count != 0) {
-        printk(KERN_ERR "Phonebook: failed to copy %d bytes from the user space\n", error_count);
+static long ioctl_add(struct phonebook_user __user *arg) {
+    struct phonebook_user request;
+    const char *fields[4];
+    size_t lengths[4], i;
+    struct User *user;
+    int len;
+
+    if (copy_from_user(&request, arg, sizeof(request)))
         return -EFAULT;
+
+    fields[0] = request.name;
+    fields[1] = request.surname;
+    fields[2] = request.phone;
+    fields[3] = request.email;
+    for (i = 0; i < 4; i++) {
+        len = ioctl_field_len(fields[i]);
+        if (len < 0)
+            return len;
+        lengths[i] = len;
+    }
+    if (request.age != (long)request.age)
+        return -EINVAL;
+    if (!user_line_fits(lengths, request.age))
+        return -EOVERFLOW;
+
+    user = alloc_user(fields, lengths, request.age);
+    if (!user)
+        return -ENOMEM;
+
+    if (add_user(user)) { // add_user returns 1 on error
+        free_user(user, NULL);
+        return -ENOMEM;
     }
 
-    *offset += copy_len;
-    user_msg_size = max(*offset - 1, 0);
-    user_buffer[user_msg_size] = 0;
-    user_buffer[BUFFER_SIZE - 1] = 0; // guarantees that the user buffer is zero-terminated
-    user_buffer_needs_parsing = 1;
-    printk(KERN_INFO "Phonebook: received %zu characters from the user, new message size: %d\n", len, user_msg_size);
-    return copy_len;
+    return 0;
 }
 
-// Format: "name surname phone email age"
-static struct User new_user(const char *data) {
-    const size_t len = strlen(data);
-    long age;
-    char *to_split, *age_str;
+// Only the key field of the request is read, and the whole record is written back over the request
+static long ioctl_find(struct phonebook_user __user *arg, struct User *(*lookup)(const char *), size_t key_offset) {
+    struct phonebook_user record = {0};
+    char key[PHONEBOOK_FIELD_SIZE];
+    struct User *user;
+    int error = 0;
+
+    if (copy_from_user(key, (char __user *)arg + key_offset, sizeof(key)))
+        return -EFAULT;
+    if (ioctl_field_len(key) < 0)
+        return -EINVAL;
+
+    rcu_read_lock();
+    user = lookup(key);
+    if (!user)
+        error = -ENOENT;
+    else if (
+        strscpy(record.name, user->name, sizeof(record.name)) < 0 ||
+        strscpy(record.surname, user->surname, sizeof(record.surname)) < 0 ||
+        strscpy(record.phone, user->phone, sizeof(record.phone)) < 0 ||
+        strscpy(record.email, user->email, sizeof(record.email)) < 0
+    )
+        error = -EOVERFLOW; // added through the text protocol with a longer field
+    else
+        record.age = user->age;
+    rcu_read_unlock();
 
-    struct User user;
-    user.successfully_created = 0;
+    if (error)
+        return error;
 
-    to_split = (char *)kmalloc(sizeof(char) * (len + 1), GFP_KERNEL);
-    if (!to_split) {
-        printk(KERN_ERR "Phonebook: failed to allocate memory for user info parsing\n");
-        return user;
-    } else {
-        strcpy(to_split, data);
+    if (copy_to_user(arg, &record, sizeof(record)))
+        return -EFAULT;
+    return 0;
+}
+
+static long ioctl_delete(struct phonebook_surname __user *arg) {
+    struct phonebook_surname request;
+
+    if (copy_from_user(&request, arg, sizeof(request)))
+        return -EFAULT;
+    if (ioctl_field_len(request.surname) < 0)
+        return -EINVAL;
+
+    return remove_user(request.surname);
+}
+
+// Binary interface, see phonebook_ioctl.h; it only touches the shared records, so the session is not locked
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    switch (cmd) {
+    case PHONEBOOK_IOC_ADD:
+        return ioctl_add((struct phonebook_user __user *)arg);
+    case PHONEBOOK_IOC_FIND:
+        return ioctl_find((struct phonebook_user __user *)arg, lookup_user, offsetof(struct phonebook_user, surname));
+    case PHONEBOOK_IOC_FIND_BY_PHONE:
+        return ioctl_find((struct phonebook_user __user *)arg, lookup_user_by_phone, offsetof(struct phonebook_user, phone));
+    case PHONEBOOK_IOC_FIND_BY_EMAIL:
+        return ioctl_find((struct phonebook_user __user *)arg, lookup_user_by_email, offsetof(struct phonebook_user, email));
+    case PHONEBOOK_IOC_DELETE:
+        return ioctl_delete((struct phonebook_surname __user *)arg);
+    case PHONEBOOK_IOC_COUNT:
+        return put_user((__u64)READ_ONCE(users_count), (__u64 __user *)arg);
+    default:
+        return -ENOTTY;
     }
+}
 
-    user.name = strsep(&to_split, " ");
-    if (user.name == NULL) {
-        printk(KERN_ERR "Phonebook: invalid user data format (failed to parse the name)\n");
-        kfree(to_split);
-        return user;
+#ifdef HAVE_PHONEBOOK_SYSCALLS
+/*
+* The syscalls of hw3/ call these directly with records in the kernel space,
+* so they don't go through the device and the text protocol.
+*/
+static int syscall_get_user(const char *surname, struct user_data *user, char *buffer, size_t size) {
+    const char *fields[4];
+    size_t lengths[4], total = 0, i;
+    struct User *found;
+    int error = 0;
+
+    rcu_read_lock();
+    found = lookup_user(surname);
+    if (!found) {
+        error = -ENOENT;
+        goto out;
+    }
+
+    fields[0] = found->name;
+    fields[1] = found->surname;
+    fields[2] = found->phone;
+    fields[3] = found->email;
+    for (i = 0; i < 4; i++) {
+        lengths[i] = strlen(fields[i]);
+        total += lengths[i] + 1;
     }
-    user.surname = strsep(&to_split, " ");
-    if (user.surname == NULL) {
-        printk(KERN_ERR "Phonebook: invalid user data format (failed to parse the surname)\n");
-        kfree(to_split);
-        return user;
+    if (total > size) {
+        error = -EOVERFLOW;
+        goto out;
+    }
+
+    // The strings are copied out of the record while it can't be freed
+    for (i = 0; i < 4; i++) {
+        memcpy(buffer, fields[i], lengths[i] + 1);
+        fields[i] = buffer;
+        buffer += lengths[i] + 1;
     }
-    user.phone = strsep(&to_split, " ");
-    if (user.phone == NULL) {
-        printk(KERN_ERR "Phonebook: invalid user data format (failed to parse the phone number)\n");
-        kfree(to_split);
-        return user;
+
+    user->name        = (char *)fields[0];
+    user->surname     = (char *)fields[1];
+    user->phone       = (char *)fields[2];
+    user->email       = (char *)fields[3];
+    user->name_len    = lengths[0];
+    user->surname_len = lengths[1];
+    user->phone_len   = lengths[2];
+    user->email_len   = lengths[3];
+    user->age         = found->age;
+
+out:
+    rcu_read_unlock();
+    return error;
+}
+
+static int syscall_add_user(const struct user_data *user) {
+    const char *fields[4] = { user->name, user->surname, user->phone, user->email };
+    const size_t lengths[4] = { user->name_len, user->surname_len, user->phone_len, user->email_len };
+    struct User *new;
+    size_t i;
+
+    for (i = 0; i < 4; i++)
+        if (!valid_field(fields[i], lengths[i]))
+            return -EINVAL;
+    if (!user_line_fits(lengths, user->age)) // the caller's lengths aren't trusted either
+        return -EOVERFLOW;
+
+    new = alloc_user(fields, lengths, user->age);
+    if (!new)
+        return -ENOMEM;
+
+    if (add_user(new)) { // add_user returns 1 on error
+        free_user(new, NULL);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int syscall_del_user(const char *surname) {
+    return remove_user(surname);
+}
+
+// The users are packed in the order of adding, so the id of the last one packed is the cursor of the next scan
+static long syscall_scan_users(u64 *cursor, char *buffer, size_t size) {
+    const char *fields[4];
+    size_t lengths[4], record_size, used = 0, i;
+    struct user_record *record;
+    struct User *user;
+    char *string;
+
+    down_read(&users_sem);
+    for (user = first_after_id(*cursor); user; user = rb_entry_safe(rb_next(&user->id_rb), struct User, id_rb)) {
+        fields[0] = user->name;
+        fields[1] = user->surname;
+        fields[2] = user->phone;
+        fields[3] = user->email;
+
+        record_size = sizeof(*record);
+        for (i = 0; i < 4; i++) {
+            lengths[i] = strlen(fields[i]);
+            record_size += lengths[i] + 1;
+        }
+        if (ALIGN(record_size, USER_RECORD_ALIGN) > size - used)
+            break;
+
+        record = (struct user_record *)(buffer + used);
+        record->age         = user->age;
+        record->name_len    = lengths[0];
+        record->surname_len = lengths[1];
+        record->phone_len   = lengths[2];
+        record->email_len   = lengths[3];
+
+        string = record->strings;
+        for (i = 0; i < 4; i++) {
+            memcpy(string, fields[i], lengths[i] + 1);
+            string += lengths[i] + 1;
+        }
+
+        // The padding goes to the user space too
+        memset(buffer + used + record_size, 0, ALIGN(record_size, USER_RECORD_ALIGN) - record_size);
+        used += ALIGN(record_size, USER_RECORD_ALIGN);
+        *cursor = user->id;
+    }
+    up_read(&users_sem);
+
+    // Not even one user fits
+    if (user && used == 0)
+        return -EOVERFLOW;
+
+    return used;
+}
+#endif
+
+/*
+* /proc/phonebook streams every record in the format of 'f' in the order of adding, a page at a time.
+* The open file remembers the id of the last record shown, so the next read resumes right after it
+* and every record shows up exactly once; a seek to 0 starts from the beginning again.
+* Records added or removed between the reads may or may not show up.
+*/
+static int dump_open(struct inode *inode, struct file *file) {
+    u64 *last_id = __seq_open_private(file, &dump_seq_ops, sizeof(*last_id));
+
+    return last_id ? 0 : -ENOMEM;
+}
+
+// Takes users_sem until dump_stop(), so the records can't be removed while they are shown
+static void *dump_start(struct seq_file *seq, loff_t *pos) {
+    u64 *last_id = seq->private;
+
+    if (*pos == 0)
+        *last_id = 0;
+
+    down_read(&users_sem);
+    return first_after_id(*last_id);
+}
+
+// Only called once the current record has been shown completely
+static void *dump_next(struct seq_file *seq, void *v, loff_t *pos) {
+    struct User *user = v;
+    u64 *last_id = seq->private;
+
+    ++*pos;
+    *last_id = user->id;
+    return rb_entry_safe(rb_next(&user->id_rb), struct User, id_rb);
+}
+
+static void dump_stop(struct seq_file *seq, void *v) {
+    up_read(&users_sem);
+}
+
+static int dump_show(struct seq_file *seq, void *v) {
+    const struct User *user = v;
+
+    seq_printf(seq, "%s %s %s %s %ld\n", user->name, user->surname, user->phone, user->email, user->age);
+    return 0;
+}
+
+// Like strsep(), but leaves the data intact: returns the next field and its length, or NULL
+static const char *next_field(const char **data, size_t *len) {
+    const char *field = *data, *end;
+
+    if (field == NULL)
+        return NULL;
+
+    end = strchr(field, ' ');
+    if (end) {
+        *len = end - field;
+        *data = end + 1;
+    } else {
+        *len = strlen(field);
+        *data = NULL;
     }
-    user.email = strsep(&to_split, " ");
-    if (user.email == NULL) {
-        printk(KERN_ERR "Phonebook: invalid user data format (failed to parse the email adress)\n");
-        kfree(to_split);
-        return user;
+
+    return field;
+}
+
+// Format: "name surname phone email age", returns NULL on error
+static struct User *new_user(const char *data) {
+    static const char *field_names[] = { "name", "surname", "phone number", "email adress" };
+    const char *fields[4], *age_field;
+    size_t lengths[4], age_len, i;
+    char age_str[AGE_SIZE];
+    long age;
+
+    for (i = 0; i < 4; i++) {
+        fields[i] = next_field(&data, &lengths[i]);
+        if (fields[i] == NULL) {
+            printk(KERN_ERR "Phonebook: invalid user data format (failed to parse the %s)\n", field_names[i]);
+            return NULL;
+        }
     }
 
-    age_str = strsep(&to_split, " ");
-    if (age_str == NULL) {
+    age_field = next_field(&data, &age_len);
+    if (age_field == NULL) {
         printk(KERN_ERR "Phonebook: invalid user data format (failed to parse the age)\n");
-        kfree(to_split);
-        return user;
+        return NULL;
+    }
+
+    if (age_len >= AGE_SIZE) {
+        printk(KERN_ERR "Phonebook: invalid user data format (age should be a number)\n");
+        return NULL;
     }
+    memcpy(age_str, age_field, age_len);
+    age_str[age_len] = 0;
 
     if (kstrtol(age_str, 10, &age) != 0) {
         printk(KERN_ERR "Phonebook: invalid user data format (age should be a number)\n");
-        kfree(to_split);
-        return user;
+        return NULL;
     }
 
-    user.age = age;
-    user.to_split = to_split;
-    user.successfully_created = 1;
-    return user;
+    return alloc_user(fields, lengths, age);
 }
 
-static ssize_t find_user(const char *surname) {
-    size_t i;
-    for (i = 0; i < users_count; i++) {
-        if (strcmp(surname, users[i].surname) == 0)
-            return i;
+// Packs the strings of a record into one buffer, returns NULL on error
+static struct User *alloc_user(const char *const fields[4], const size_t lengths[4], long age) {
+    const char *packed_fields[4];
+    size_t total = 0, i;
+    struct User *user;
+    char *packed;
+
+    for (i = 0; i < 4; i++)
+        total += lengths[i] + 1;
+
+    user = kmem_cache_alloc(users_cache, GFP_KERNEL);
+    if (!user) {
+        printk(KERN_ERR "Phonebook: failed to allocate memory for the user\n");
+        return NULL;
+    }
+
+    packed = kmalloc(total, GFP_KERNEL);
+    if (!packed) {
+        printk(KERN_ERR "Phonebook: failed to allocate memory for the user info\n");
+        kmem_cache_free(users_cache, user);
+        return NULL;
+    }
+
+    user->strings = packed;
+    for (i = 0; i < 4; i++) {
+        memcpy(packed, fields[i], lengths[i]);
+        packed[lengths[i]] = 0;
+        packed_fields[i] = packed;
+        packed += lengths[i] + 1;
     }
 
-    return -1;
+    user->name    = packed_fields[0];
+    user->surname = packed_fields[1];
+    user->phone   = packed_fields[2];
+    user->email   = packed_fields[3];
+    user->age     = age;
+    return user;
 }
 
-static int add_user(const struct User user) {
-    if (users_count == MAX_USERS) {
-        printk(KERN_ERR "Phonebook: no more space in the users array\n");
-        return 1;
+static int init_indexes(void) {
+    int error;
+
+    error = rhltable_init(&users_by_surname, &surname_params);
+    if (error)
+        return error;
+
+    error = rhltable_init(&users_by_phone, &phone_params);
+    if (error) {
+        rhltable_destroy(&users_by_surname);
+        return error;
+    }
+
+    error = rhltable_init(&users_by_email, &email_params);
+    if (error) {
+        rhltable_destroy(&users_by_phone);
+        rhltable_destroy(&users_by_surname);
+        return error;
     }
 
-    users[users_count++] = user;
     return 0;
 }
 
-static int remove_user(size_t index) {
-    size_t i;
+// Only for the empty indexes
+static void destroy_indexes(void) {
+    rhltable_destroy(&users_by_email);
+    rhltable_destroy(&users_by_phone);
+    rhltable_destroy(&users_by_surname);
+}
+
+static u32 string_hashfn(const void *data, u32 len, u32 seed) {
+    const char *string = data;
+    return jhash(string, strlen(string), seed);
+}
+
+static u32 surname_hashfn(const void *data, u32 len, u32 seed) {
+    const struct User *user = data;
+    return string_hashfn(user->surname, len, seed);
+}
+
+static int surname_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
+    const struct User *user = obj;
+    return strcmp(user->surname, arg->key);
+}
+
+static u32 phone_hashfn(const void *data, u32 len, u32 seed) {
+    const struct User *user = data;
+    return string_hashfn(user->phone, len, seed);
+}
+
+static int phone_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
+    const struct User *user = obj;
+    return strcmp(user->phone, arg->key);
+}
+
+static u32 email_hashfn(const void *data, u32 len, u32 seed) {
+    const struct User *user = data;
+    return string_hashfn(user->email, len, seed);
+}
+
+static int email_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
+    const struct User *user = obj;
+    return strcmp(user->email, arg->key);
+}
+
+// New users are inserted at the head of the list of a key, so the earliest one is the last
+static struct User *earliest_user(struct rhlist_head *list, unsigned int head_offset) {
+    struct rhlist_head *pos, *last = NULL;
+
+    rhl_for_each_rcu(pos, list)
+        last = pos;
+
+    return last ? (struct User *)((char *)last - head_offset) : NULL;
+}
+
+// Returns the earliest added user with this surname, or NULL; must be called under rcu_read_lock()
+static struct User *lookup_user(const char *surname) {
+    return earliest_user(rhltable_lookup(&users_by_surname, surname, surname_params), surname_params.head_offset);
+}
+
+// Same, by phone
+static struct User *lookup_user_by_phone(const char *phone) {
+    return earliest_user(rhltable_lookup(&users_by_phone, phone, phone_params), phone_params.head_offset);
+}
+
+// Same, by email
+static struct User *lookup_user_by_email(const char *email) {
+    return earliest_user(rhltable_lookup(&users_by_email, email, email_params), email_params.head_offset);
+}
+
+static void format_user(const struct User *user, char *buffer, size_t size) {
+    snprintf(buffer, size, "%s %s %s %s %ld\n", user->name, user->surname, user->phone, user->email, user->age);
+}
+
+// Formats the user found by the key into the buffer without taking any locks, returns 1 if not found
+static int find_user(struct User *(*lookup)(const char *), const char *key, char *buffer, size_t size) {
+    struct User *user;
+
+    rcu_read_lock();
+    user = lookup(key);
+    if (user)
+        format_user(user, buffer, size);
+    rcu_read_unlock();
+
+    return user == NULL;
+}
+
+static int compare_by_surname(const struct User *user, const char *surname, u64 id) {
+    int result = strcmp(user->surname, surname);
+
+    if (result)
+        return result;
+    return user->id < id ? -1 : user->id > id;
+}
+
+static int compare_by_age(const struct User *user, long age, u64 id) {
+    if (user->age != age)
+        return user->age < age ? -1 : 1;
+    return user->id < id ? -1 : user->id > id;
+}
+
+// The trees are changed under users_sem taken for writing
+static void insert_ordered(struct User *user) {
+    struct rb_node **link = &users_by_surname_order.rb_node, *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        if (compare_by_surname(rb_entry(parent, struct User, surname_rb), user->surname, user->id) < 0)
+            link = &parent->rb_right;
+        else
+            link = &parent->rb_left;
+    }
+    rb_link_node(&user->surname_rb, parent, link);
+    rb_insert_color(&user->surname_rb, &users_by_surname_order);
+
+    link = &users_by_age.rb_node;
+    parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (compare_by_age(rb_entry(parent, struct User, age_rb), user->age, user->id) < 0)
+            link = &parent->rb_right;
+        else
+            link = &parent->rb_left;
+    }
+    rb_link_node(&user->age_rb, parent, link);
+    rb_insert_color(&user->age_rb, &users_by_age);
+
+    // The new user always has the biggest id
+    link = &users_by_id.rb_node;
+    parent = NULL;
+    while (*link) {
+        parent = *link;
+        link = &parent->rb_right;
+    }
+    rb_link_node(&user->id_rb, parent, link);
+    rb_insert_color(&user->id_rb, &users_by_id);
+}
+
+// Returns the first user after (surname, id) in the surname order, or NULL
+static struct User *first_after_surname(const char *surname, u64 id) {
+    struct rb_node *node = users_by_surname_order.rb_node;
+    struct User *user, *found = NULL;
+
+    while (node) {
+        user = rb_entry(node, struct User, surname_rb);
+        if (compare_by_surname(user, surname, id) > 0) {
+            found = user;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+
+    return found;
+}
+
+// Returns the first user after (age, id) in the age order, or NULL
+static struct User *first_after_age(long age, u64 id) {
+    struct rb_node *node = users_by_age.rb_node;
+    struct User *user, *found = NULL;
+
+    while (node) {
+        user = rb_entry(node, struct User, age_rb);
+        if (compare_by_age(user, age, id) > 0) {
+            found = user;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
 
-    if (index >= users_count) {
-        printk(KERN_ERR "Phonebook: can't remove user #%zu -- there are %zu total users\n", index, users_count);
+    return found;
+}
+
+// Returns the first user with an id bigger than this one, or NULL
+static struct User *first_after_id(u64 id) {
+    struct rb_node *node = users_by_id.rb_node;
+    struct User *user, *found = NULL;
+
+    while (node) {
+        user = rb_entry(node, struct User, id_rb);
+        if (user->id > id) {
+            found = user;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+
+    return found;
+}
+
+static struct User *next_by_surname(struct User *user) {
+    struct rb_node *node = rb_next(&user->surname_rb);
+    return node ? rb_entry(node, struct User, surname_rb) : NULL;
+}
+
+static struct User *next_by_age(struct User *user) {
+    struct rb_node *node = rb_next(&user->age_rb);
+    return node ? rb_entry(node, struct User, age_rb) : NULL;
+}
+
+/*
+* "s prefix [surname id]" -- the users whose surname starts with the prefix, in the surname order;
+* "r min max [age id]" -- the users aged from min to max inclusive, in the age order.
+* Every matching user is answered with a line of its data, at most QUERY_PAGE of them,
+* followed by "end\n", or by "more <key> <id>\n" if there are more: the same query
+* with the key and the id appended answers the next page.
+* The lines of the users are queued right away, the last line is left in the device buffer.
+* Both return 1 on error.
+*/
+static int query_by_prefix(struct Session *session) {
+    char *args = session->user_buffer + 2, *prefix, *id_str;
+    const char *after = "";
+    u64 after_id = 0; // ids start from 1, so the first page starts from the prefix itself
+    struct User *user, *last = NULL;
+    size_t prefix_len, count = 0;
+    int error = 0;
+
+    prefix = strsep(&args, " ");
+    if (args) {
+        after = strsep(&args, " ");
+        id_str = strsep(&args, " ");
+        if (!id_str || args || kstrtou64(id_str, 10, &after_id)) {
+            printk(KERN_ERR "Phonebook: invalid query format (expected 's prefix [surname id]')\n");
+            return 1;
+        }
+    }
+    prefix_len = strlen(prefix);
+    if (strcmp(after, prefix) < 0) {
+        after = prefix;
+        after_id = 0;
+    }
+
+    down_read(&users_sem);
+    user = first_after_surname(after, after_id);
+    for (; user && !strncmp(user->surname, prefix, prefix_len) && count < QUERY_PAGE; user = next_by_surname(user), count++) {
+        format_user(user, session->device_buffer, BUFFER_SIZE);
+        error = append_response(&session->responses, session->device_buffer, strlen(session->device_buffer));
+        if (error)
+            break;
+        last = user;
+    }
+    if (!error && user && !strncmp(user->surname, prefix, prefix_len))
+        snprintf(session->device_buffer, BUFFER_SIZE, "more %s %llu\n", last->surname, last->id);
+    else
+        strcpy(session->device_buffer, "end\n");
+    up_read(&users_sem);
+
+    printk(KERN_INFO "Phonebook: answered %zu users with surnames starting with %s\n", count, prefix);
+    return error;
+}
+
+static int query_by_age(struct Session *session) {
+    char *args = session->user_buffer + 2, *fields[5];
+    long min_age, max_age, after = 0;
+    u64 after_id = 0;
+    struct User *user, *last = NULL;
+    size_t n_fields = 0, count = 0;
+    int error = 0;
+
+    while (args && n_fields < 5)
+        fields[n_fields++] = strsep(&args, " ");
+    if (
+        args || (n_fields != 2 && n_fields != 4) ||
+        kstrtol(fields[0], 10, &min_age) || kstrtol(fields[1], 10, &max_age) ||
+        (n_fields == 4 && (kstrtol(fields[2], 10, &after) || kstrtou64(fields[3], 10, &after_id)))
+    ) {
+        printk(KERN_ERR "Phonebook: invalid query format (expected 'r min max [age id]')\n");
         return 1;
     }
+    if (n_fields == 2 || after < min_age) {
+        after = min_age;
+        after_id = 0;
+    }
 
-    kfree(users[index].to_split);
+    down_read(&users_sem);
+    user = first_after_age(after, after_id);
+    for (; user && user->age <= max_age && count < QUERY_PAGE; user = next_by_age(user), count++) {
+        format_user(user, session->device_buffer, BUFFER_SIZE);
+        error = append_response(&session->responses, session->device_buffer, strlen(session->device_buffer));
+        if (error)
+            break;
+        last = user;
+    }
+    if (!error && user && user->age <= max_age)
+        snprintf(session->device_buffer, BUFFER_SIZE, "more %ld %llu\n", last->age, last->id);
+    else
+        strcpy(session->device_buffer, "end\n");
+    up_read(&users_sem);
+
+    printk(KERN_INFO "Phonebook: answered %zu users aged from %ld to %ld\n", count, min_age, max_age);
+    return error;
+}
 
-    for (i = index; i < users_count - 1; i++)
-        users[i] = users[i + 1];
+static int add_user(struct User *user) {
+    int error;
+
+    down_write(&users_sem);
+    error = rhltable_insert(&users_by_surname, &user->surname_node, surname_params);
+    if (!error) {
+        error = rhltable_insert(&users_by_phone, &user->phone_node, phone_params);
+        if (error)
+            rhltable_remove(&users_by_surname, &user->surname_node, surname_params);
+    }
+    if (!error) {
+        error = rhltable_insert(&users_by_email, &user->email_node, email_params);
+        if (error) {
+            rhltable_remove(&users_by_phone, &user->phone_node, phone_params);
+            rhltable_remove(&users_by_surname, &user->surname_node, surname_params);
+        }
+    }
+    if (!error) {
+        user->id = users_next_id++;
+        insert_ordered(user);
+        users_count++;
+    }
+    up_write(&users_sem);
+
+    if (error) {
+        printk(KERN_ERR "Phonebook: failed to index the user (error %d)\n", error);
+        return 1;
+    }
 
-    users_count--;
     return 0;
 }
 
+static void free_user(void *ptr, void *arg) {
+    struct User *user = ptr;
+
+    kfree(user->strings);
+    kmem_cache_free(users_cache, user);
+}
+
+static void free_user_rcu(struct rcu_head *head) {
+    free_user(container_of(head, struct User, rcu), NULL);
+}
+
+// The record is only unlinked from the indexes and freed once no reader can see it, returns an error code
+static int remove_user(const char *surname) {
+    struct User *user;
+    int error = -ENOENT;
+
+    down_write(&users_sem);
+    rcu_read_lock();
+    user = lookup_user(surname);
+    if (user) {
+        // It was inserted into all of them under the same lock, so only the first one can fail
+        error = rhltable_remove(&users_by_surname, &user->surname_node, surname_params);
+        if (!error) {
+            rhltable_remove(&users_by_phone, &user->phone_node, phone_params);
+            rhltable_remove(&users_by_email, &user->email_node, email_params);
+            rb_erase(&user->surname_rb, &users_by_surname_order);
+            rb_erase(&user->age_rb, &users_by_age);
+            rb_erase(&user->id_rb, &users_by_id);
+            call_rcu(&user->rcu, free_user_rcu);
+            users_count--;
+        }
+    }
+    rcu_read_unlock();
+    up_write(&users_sem);
+
+    if (error == -ENOENT)
+        printk(KERN_ERR "Phonebook: user %s not found\n", surname);
+    else if (error)
+        printk(KERN_ERR "Phonebook: can't remove user %s from the index (error %d)\n", surname, error);
+
+    return error;
+}
+
 /*
 * Format:
 * f surname -- get all user data by surname (finds the first user with this surname)
+* p phone -- get all user data by phone (finds the first user with this phone)
+* e email -- get all user data by email (finds the first user with this email)
+* s prefix [surname id] -- get the users whose surname starts with the prefix, a page at a time
+* r min max [age id] -- get the users aged from min to max, a page at a time
 * a name surname phone email age -- add a user
 * d surname -- remove a user by surname (finds the first user with this surname)
+* The response is left in the device buffer: the user data for 'f', 'p' and 'e', the last line for 's' and 'r'
+* (see query_by_prefix()), "ok\n" for the rest;
+* the caller answers "error\n" when this returns 1.
 */
-static int parse_user_buffer(void) {
-    ssize_t index;
-    struct User user;
+static int parse_user_buffer(struct Session *session) {
+    struct User *user;
 
-    if (user_msg_size < 3) { // command char, space, first char of the argument
+    if (session->user_msg_size < 3) { // command char, space, first char of the argument
         printk(KERN_ERR "Phonebook: failed to parse the user buffer -- not enough arguments\n");
         return 1;
     }
 
-    switch (user_buffer[0]) { // command char
+    switch (session->user_buffer[0]) { // command char
     case 'f':
-        index = find_user(user_buffer + 2); // skip the first 2 chars
-        if (index == -1) {
+        if (find_user(lookup_user, session->user_buffer + 2, session->device_buffer, BUFFER_SIZE)) { // skip the first 2 chars
             printk(KERN_ERR "Phonebook: failed to parse the user buffer -- user not found in 'f'\n");
             return 1;
         }
-        user = users[index];
-
-        snprintf(
-            device_buffer,
-            BUFFER_SIZE,
-            "%s %s %s %s %ld\n",
-            user.name,
-            user.surname,
-            user.phone,
-            user.email,
-            user.age
+
+        printk(
+            KERN_INFO "Phonebook: found user %s\n",
+            session->user_buffer + 2
         );
-        device_msg_size = strlen(device_buffer);
+        break;
+    case 'p':
+        if (find_user(lookup_user_by_phone, session->user_buffer + 2, session->device_buffer, BUFFER_SIZE)) {
+            printk(KERN_ERR "Phonebook: failed to parse the user buffer -- user not found in 'p'\n");
+            return 1;
+        }
 
+        printk(
+            KERN_INFO "Phonebook: found user with phone %s\n",
+            session->user_buffer + 2
+        );
+        break;
+    case 'e':
+        if (find_user(lookup_user_by_email, session->user_buffer + 2, session->device_buffer, BUFFER_SIZE)) {
+            printk(KERN_ERR "Phonebook: failed to parse the user buffer -- user not found in 'e'\n");
+            return 1;
+        }
 
         printk(
-            KERN_INFO "Phonebook: found user %s\n",
-            user_buffer + 2
+            KERN_INFO "Phonebook: found user with email %s\n",
+            session->user_buffer + 2
         );
         break;
+    case 's':
+        if (query_by_prefix(session)) { // query_by_prefix returns 1 on error
+            printk(KERN_ERR "Phonebook: failed to parse the user buffer -- failed to answer the query in 's'\n");
+            return 1;
+        }
+        break;
+    case 'r':
+        if (query_by_age(session)) { // query_by_age returns 1 on error
+            printk(KERN_ERR "Phonebook: failed to parse the user buffer -- failed to answer the query in 'r'\n");
+            return 1;
+        }
+        break;
     case 'a':
-        user = new_user(user_buffer + 2); // skip the first 2 chars
-        if (!user.successfully_created) {
+        user = new_user(session->user_buffer + 2); // skip the first 2 chars
+        if (!user) {
             printk(KERN_ERR "Phonebook: failed to parse the user buffer -- failed to create a new user\n");
             return 1;
         }
+        // Logged while the user is still private, once added it may be removed and freed by someone else
+        printk(
+            KERN_INFO "Phonebook: new user -- '%s', '%s', '%s', '%s', '%ld'\n",
+            user->name,
+            user->surname,
+            user->phone,
+            user->email,
+            user->age
+        );
+
         if (add_user(user)) { // add_user returns 1 on error
             printk(KERN_ERR "Phonebook: failed to parse the user buffer -- failed to add the created user\n");
+            free_user(user, NULL);
             return 1;
         }
 
-        printk(
-            KERN_INFO "Phonebook: new user -- '%s', '%s', '%s', '%s', '%ld'\n",
-            user.name,
-            user.surname,
-            user.phone,
-            user.email,
-            user.age
-        );
+        strcpy(session->device_buffer, "ok\n");
         break;
     case 'd':
-        index = find_user(user_buffer + 2); // skip the first 2 chars
-        if (index == -1) {
-            printk(KERN_ERR "Phonebook: failed to parse the user buffer -- user not found in 'd'\n");
-            return 1;
-        }
-        if (remove_user(index)) { // remove_user returns 1 on error
+        if (remove_user(session->user_buffer + 2)) { // skip the first 2 chars, remove_user returns an error code
             printk(KERN_ERR "Phonebook: failed to parse the user buffer -- failed to remove the user\n");
             return 1;
         }
 
         printk(
             KERN_INFO "Phonebook: removed user %s\n",
-            user_buffer + 2
+            session->user_buffer + 2
         );
+
+        strcpy(session->device_buffer, "ok\n");
         break;
     default:
         printk(KERN_ERR "Phonebook: failed to parse the user buffer -- unknown command\n");
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef PHONEBOOK_IOCTL_H
+#define PHONEBOOK_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+* Binary interface of /dev/phonebook_device, shared by the module and its clients.
+* The strings are NUL-terminated and may not contain spaces or newlines,
+* so that every record stays representable in the text protocol;
+* PHONEBOOK_IOC_ADD fails with -EOVERFLOW if its line "name surname phone email age\n" is longer than 255 characters.
+*/
+
+#define PHONEBOOK_FIELD_SIZE 128
+
+struct phonebook_user {
+    char  name[PHONEBOOK_FIELD_SIZE];
+    char  surname[PHONEBOOK_FIELD_SIZE];
+    char  phone[PHONEBOOK_FIELD_SIZE];
+    char  email[PHONEBOOK_FIELD_SIZE];
+    __s64 age;
+};
+
+struct phonebook_surname {
+    char surname[PHONEBOOK_FIELD_SIZE];
+};
+
+#define PHONEBOOK_IOC_MAGIC 'p'
+
+// Adds a user
+#define PHONEBOOK_IOC_ADD    _IOW(PHONEBOOK_IOC_MAGIC, 1, struct phonebook_user)
+// Takes the surname, returns the whole record (the first user with this surname) in place; -ENOENT if not found
+#define PHONEBOOK_IOC_FIND   _IOWR(PHONEBOOK_IOC_MAGIC, 2, struct phonebook_user)
+// Removes the first user with this surname; -ENOENT if not found
+#define PHONEBOOK_IOC_DELETE _IOW(PHONEBOOK_IOC_MAGIC, 3, struct phonebook_surname)
+// Returns the number of users
+#define PHONEBOOK_IOC_COUNT  _IOR(PHONEBOOK_IOC_MAGIC, 4, __u64)
+// Like PHONEBOOK_IOC_FIND, but takes the phone or the email instead of the surname
+#define PHONEBOOK_IOC_FIND_BY_PHONE _IOWR(PHONEBOOK_IOC_MAGIC, 5, struct phonebook_user)
+#define PHONEBOOK_IOC_FIND_BY_EMAIL _IOWR(PHONEBOOK_IOC_MAGIC, 6, struct phonebook_user)
+
+#endif
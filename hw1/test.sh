@@ -62,5 +62,36 @@ cat /dev/phonebook_device
 echo "f Alexeev" > /dev/phonebook_device
 cat /dev/phonebook_device
 
+echo "[TEST]: Phone and email search test"
+echo "p +75554433" > /dev/phonebook_device
+cat /dev/phonebook_device
+echo "e alex@alexeev.ru" > /dev/phonebook_device
+cat /dev/phonebook_device
+
+echo "[TEST]: Prefix and range query test"
+echo "s Iv" > /dev/phonebook_device
+cat /dev/phonebook_device
+echo "r 35 80" > /dev/phonebook_device
+cat /dev/phonebook_device
+
+echo "[TEST]: Dump test"
+cat /proc/phonebook
+
+echo "[TEST]: Batch test"
+printf 'a Sergey Sergeev +71112233 sergey@sergeev.ru 25\nf Sergeev\nd Sergeev\nf Sergeev\n' > /dev/phonebook_device
+cat /dev/phonebook_device
+
+echo "[TEST]: Responses are read once"
+echo "f Ivanov" > /dev/phonebook_device
+cat /dev/phonebook_device
+echo "[TEST] The second read should be empty:"
+cat /dev/phonebook_device
+
+echo "[TEST]: Response limit test"
+yes "f Ivanov" | head -n 5000 > /dev/phonebook_device || echo "[TEST] The write stopped at the response limit"
+echo "[TEST] Responses kept: `cat /dev/phonebook_device | wc -l`"
+
+print_dmesg
+
 rmmod phonebook
 echo "[TEST]: Removed the module"
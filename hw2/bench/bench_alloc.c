@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../filesystem/constants.h"
+#include "../filesystem/superblock.h"
+
+#define DEFAULT_TOTAL_BLOCKS 1048576
+#define NAIVE_ALLOCATIONS    20000
+#define CHURN_PERCENT        10
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const size_t n, const double seconds) {
+    printf("[bench_alloc] %-28s %9zu allocations in %8.3f s, %12.0f allocations/s\n", name, n, seconds, n / seconds);
+}
+
+// The bit-by-bit first-fit scan from block #1, for comparison
+static int naive_get_unused_block(const struct Superblock *superblock, uint32_t *block) {
+    for (uint32_t i = 1; i <= superblock->total_blocks; ++i) {
+        int block_use = get_block_use(superblock, i);
+        if (block_use == -1) {
+            return 1;
+        } else if (block_use == 0) {
+            *block = i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int allocate_one(struct Superblock *superblock, const int naive) {
+    uint32_t block_id;
+    if (naive ? naive_get_unused_block(superblock, &block_id) : get_unused_blocks(superblock, &block_id, 1))
+        return 1;
+
+    return set_block_use(superblock, block_id, 1);
+}
+
+static int bench_fill(struct Superblock *superblock, const size_t n, const int naive) {
+    const double start = now();
+    for (size_t i = 0; i < n; ++i) {
+        if (allocate_one(superblock, naive)) {
+            fprintf(stderr, "[bench_alloc] Allocation #%zu failed\n", i);
+            return 1;
+        }
+    }
+
+    report(naive ? "fill (bit-by-bit first-fit)" : "fill (word next-fit)", n, now() - start);
+    return 0;
+}
+
+// Frees random blocks all over the image and allocates the same amount back
+static int bench_churn(struct Superblock *superblock) {
+    const size_t n = (size_t)superblock->total_blocks * CHURN_PERCENT / 100;
+
+    srand(1);
+    size_t freed = 0;
+    while (freed < n) {
+        const uint32_t block_id = 1 + (uint32_t)(((uint64_t)rand() * RAND_MAX + rand()) % superblock->total_blocks);
+        if (get_block_use(superblock, block_id) == 1) {
+            if (set_block_use(superblock, block_id, 0))
+                return 1;
+            ++freed;
+        }
+    }
+
+    const double start = now();
+    for (size_t i = 0; i < n; ++i) {
+        if (allocate_one(superblock, 0)) {
+            fprintf(stderr, "[bench_alloc] Allocation #%zu failed\n", i);
+            return 1;
+        }
+    }
+
+    report("churn (word next-fit)", n, now() - start);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t total_blocks = DEFAULT_TOTAL_BLOCKS;
+    if (argc == 2) {
+        char *end;
+        errno = 0;
+        long next = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || errno == ERANGE || next <= 0 || next > UINT32_MAX) {
+            fprintf(stderr, "Usage: %s [TOTAL_BLOCKS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        total_blocks = next;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [TOTAL_BLOCKS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("[bench_alloc] TOTAL_BLOCKS: %u\n", total_blocks);
+
+    // Only the in-memory superblock is needed, the bitmap is what is being measured
+    struct Superblock superblock = create_superblock(MAGIC, 0, total_blocks, 1, 128);
+    if (!superblock.used_blocks_bitmap || !superblock.used_inodes_bitmap) {
+        fprintf(stderr, "[bench_alloc] Failed to allocate memory for the bitmaps\n");
+        free_superblock(&superblock);
+        return EXIT_FAILURE;
+    }
+
+    int result = bench_fill(&superblock, total_blocks, 0) || bench_churn(&superblock);
+    free_superblock(&superblock);
+    if (result)
+        return EXIT_FAILURE;
+
+    const size_t naive_allocations = total_blocks < NAIVE_ALLOCATIONS ? total_blocks : NAIVE_ALLOCATIONS;
+    superblock = create_superblock(MAGIC, 0, total_blocks, 1, 128);
+    if (!superblock.used_blocks_bitmap || !superblock.used_inodes_bitmap) {
+        fprintf(stderr, "[bench_alloc] Failed to allocate memory for the bitmaps\n");
+        free_superblock(&superblock);
+        return EXIT_FAILURE;
+    }
+
+    result = bench_fill(&superblock, naive_allocations, 1);
+    free_superblock(&superblock);
+
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../filesystem/constants.h"
+#include "../filesystem/device.h"
+#include "../filesystem/directory_ops.h"
+#include "../filesystem/superblock.h"
+
+#define IMAGE_FILE           "bench_dir.img"
+#define DEFAULT_ENTRIES      200000
+#define LINEAR_ENTRIES       20000
+#define BENCH_BLOCK_SIZE     1024
+#define BENCH_TOTAL_BLOCKS   131072
+#define BENCH_CACHE_BLOCKS   4096
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *layout, const char *name, const size_t n, const double seconds) {
+    printf("[bench_dir] %-7s %-7s %9zu entries in %8.3f s, %12.0f ops/s\n", layout, name, n, seconds, n / seconds);
+}
+
+static struct DirectoryEntry make_entry(const size_t i) {
+    struct DirectoryEntry entry = {
+        .inode_id = 2 + i,
+        .filetype = FILETYPE_FILE
+    };
+    entry.name_len = snprintf(entry.name, MAX_FILENAME_LEN, "file_%zu", i);
+
+    return entry;
+}
+
+// The same steps as touch/stat/rm take on the directory itself
+static int bench_layout(const uint32_t features, const size_t n) {
+    const char *layout = features & FEATURE_DIR_INDEX ? "hashed" : "linear";
+
+    struct Superblock superblock = create_superblock(
+        MAGIC_FEATURES,
+        features,
+        BENCH_TOTAL_BLOCKS,
+        1,
+        BENCH_BLOCK_SIZE
+    );
+    if (!superblock.used_blocks_bitmap || !superblock.used_inodes_bitmap) {
+        fprintf(stderr, "[bench_dir] Failed to allocate memory for the bitmaps\n");
+        free_superblock(&superblock);
+        return 1;
+    }
+
+    struct Device device;
+    if (open_device(IMAGE_FILE, "w+b", DEVICE_BACKEND_STDIO, BENCH_CACHE_BLOCKS, &device)) {
+        free_superblock(&superblock);
+        return 1;
+    }
+
+    // The lookups have to reach the directory itself
+    device.dentries = create_dentry_cache(0);
+
+    int result = 1;
+    if (resize_device(&device, BOOT_OFFSET + superblock.size + (size_t)BENCH_TOTAL_BLOCKS * BENCH_BLOCK_SIZE))
+        goto out;
+
+    // The inode table is not used, only the block with the root inode is reserved
+    if (set_block_use(&superblock, 1, 1))
+        goto out;
+
+    struct FsFile directory = {
+        .inode_id = 1,
+        .filetype = FILETYPE_DIRECTORY
+    };
+    const struct DirectoryEntry dot = {
+        .inode_id = 1,
+        .filetype = FILETYPE_DIRECTORY,
+        .name_len = 1,
+        .name     = "."
+    };
+    if (init_directory(&device, &superblock, &directory, &dot, 1))
+        goto out;
+
+    double start = now();
+    for (size_t i = 0; i < n; ++i) {
+        const struct DirectoryEntry entry = make_entry(i);
+        struct DirectoryEntry existing;
+        if (find_entry(&device, &superblock, &directory, entry.name, &existing) != 0) {
+            fprintf(stderr, "[bench_dir] Lookup before insert #%zu failed\n", i);
+            goto out;
+        }
+        if (add_entry(&device, &superblock, &directory, &entry)) {
+            fprintf(stderr, "[bench_dir] Insert #%zu failed\n", i);
+            goto out;
+        }
+    }
+    report(layout, "insert", n, now() - start);
+
+    srand(1);
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        const size_t index = ((size_t)rand() * RAND_MAX + rand()) % n;
+        const struct DirectoryEntry entry = make_entry(index);
+        struct DirectoryEntry found;
+        if (find_entry(&device, &superblock, &directory, entry.name, &found) != 1 || found.inode_id != entry.inode_id) {
+            fprintf(stderr, "[bench_dir] Lookup of %s failed\n", entry.name);
+            goto out;
+        }
+    }
+    report(layout, "lookup", n, now() - start);
+
+    start = now();
+    for (size_t i = 0; i < n; i += 2) {
+        const struct DirectoryEntry entry = make_entry(i);
+        struct DirectoryEntry removed;
+        if (remove_entry(&device, &superblock, &directory, entry.name, &removed) != 1) {
+            fprintf(stderr, "[bench_dir] Removal of %s failed\n", entry.name);
+            goto out;
+        }
+    }
+    report(layout, "remove", (n + 1) / 2, now() - start);
+
+    result = 0;
+
+out:
+    free_superblock(&superblock);
+    if (close_device(&device))
+        result = 1;
+    remove(IMAGE_FILE);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    size_t n_entries = DEFAULT_ENTRIES;
+    if (argc == 2) {
+        char *end;
+        errno = 0;
+        long next = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || errno == ERANGE || next <= 0) {
+            fprintf(stderr, "Usage: %s [N_ENTRIES]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        n_entries = next;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [N_ENTRIES]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("[bench_dir] N_ENTRIES: %zu\n", n_entries);
+
+    // Inserts append to the linear layout in place, but every lookup (one before each insert too) scans
+    // the whole directory, so it gets a smaller one, and the hashed layout is timed at that size as well
+    const size_t linear_entries = n_entries < LINEAR_ENTRIES ? n_entries : LINEAR_ENTRIES;
+    if (
+        bench_layout(FEATURE_EXTENTS | FEATURE_DIR_INDEX, n_entries) ||
+        (linear_entries < n_entries && bench_layout(FEATURE_EXTENTS | FEATURE_DIR_INDEX, linear_entries)) ||
+        bench_layout(FEATURE_EXTENTS, linear_entries)
+    ) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+#include "block_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct BlockCache create_block_cache(const size_t capacity) {
+    struct BlockCache new_cache = {
+        .capacity = capacity
+    };
+
+    return new_cache;
+}
+
+int setup_block_cache(struct BlockCache *cache, const size_t block_size, const size_t base_offset) {
+    if (cache->capacity == 0 || cache->block_size != 0)
+        return 0;
+
+    size_t n_buckets = 1;
+    while (n_buckets < cache->capacity)
+        n_buckets <<= 1;
+
+    cache->entries = calloc(cache->capacity, sizeof(struct BlockCacheEntry));
+    cache->data    = malloc(cache->capacity * block_size);
+    cache->buckets = calloc(n_buckets, sizeof(struct BlockCacheEntry*));
+    if (!cache->entries || !cache->data || !cache->buckets) {
+        fprintf(stderr, "Failed to allocate memory for the block cache\n");
+        free(cache->entries);
+        free(cache->data);
+        free(cache->buckets);
+        cache->entries = NULL;
+        cache->data    = NULL;
+        cache->buckets = NULL;
+        return 1;
+    }
+
+    cache->n_buckets   = n_buckets;
+    cache->block_size  = block_size;
+    cache->base_offset = base_offset;
+
+    // All entries start out empty and are chained in the LRU list
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        struct BlockCacheEntry *entry = cache->entries + i;
+        entry->data     = cache->data + i * block_size;
+        entry->lru_prev = i > 0 ? entry - 1 : NULL;
+        entry->lru_next = i + 1 < cache->capacity ? entry + 1 : NULL;
+    }
+    cache->lru_head = cache->entries;
+    cache->lru_tail = cache->entries + cache->capacity - 1;
+
+    return 0;
+}
+
+void free_block_cache(struct BlockCache *cache) {
+    free(cache->entries);
+    free(cache->data);
+    free(cache->buckets);
+    *cache = create_block_cache(cache->capacity);
+}
+
+static struct BlockCacheEntry** bucket_of(const struct BlockCache *cache, const uint32_t block_id) {
+    return cache->buckets + (block_id & (cache->n_buckets - 1));
+}
+
+static void unlink_lru(struct BlockCache *cache, struct BlockCacheEntry *entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void push_lru_head(struct BlockCache *cache, struct BlockCacheEntry *entry) {
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail)
+        cache->lru_tail = entry;
+}
+
+static void push_lru_tail(struct BlockCache *cache, struct BlockCacheEntry *entry) {
+    entry->lru_prev = cache->lru_tail;
+    if (cache->lru_tail)
+        cache->lru_tail->lru_next = entry;
+    cache->lru_tail = entry;
+    if (!cache->lru_head)
+        cache->lru_head = entry;
+}
+
+// Does not touch the LRU order or the statistics
+struct BlockCacheEntry* lookup_cached_block(const struct BlockCache *cache, const uint32_t block_id) {
+    for (struct BlockCacheEntry *entry = *bucket_of(cache, block_id); entry; entry = entry->hash_next) {
+        if (entry->block_id == block_id)
+            return entry;
+    }
+
+    return NULL;
+}
+
+struct BlockCacheEntry* find_cached_block(struct BlockCache *cache, const uint32_t block_id) {
+    struct BlockCacheEntry *entry = lookup_cached_block(cache, block_id);
+    if (!entry) {
+        ++cache->misses;
+        return NULL;
+    }
+
+    ++cache->hits;
+    unlink_lru(cache, entry);
+    push_lru_head(cache, entry);
+    return entry;
+}
+
+// Returns the least recently used entry, the caller has to write it back if it is dirty
+struct BlockCacheEntry* take_cache_entry(struct BlockCache *cache) {
+    return cache->lru_tail;
+}
+
+// Rebinds the entry to block_id (0 to make it empty) and marks it as the most recently used
+void bind_cache_entry(
+     struct BlockCache *cache,
+     struct BlockCacheEntry *entry,
+     const uint32_t block_id
+) {
+    if (entry->block_id != 0) {
+        struct BlockCacheEntry **link = bucket_of(cache, entry->block_id);
+        while (*link != entry)
+            link = &(*link)->hash_next;
+        *link = entry->hash_next;
+    }
+
+    entry->block_id  = block_id;
+    entry->dirty     = 0;
+    entry->hash_next = NULL;
+
+    unlink_lru(cache, entry);
+    if (block_id != 0) {
+        struct BlockCacheEntry **bucket = bucket_of(cache, block_id);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+
+        push_lru_head(cache, entry);
+    } else {
+        push_lru_tail(cache, entry);
+    }
+}
+
+// Forgets the blocks that have not been modified, so that they are read from the file again
+void drop_clean_blocks(struct BlockCache *cache) {
+    for (size_t i = 0; cache->entries && i < cache->capacity; ++i) {
+        struct BlockCacheEntry *entry = cache->entries + i;
+        if (entry->block_id != 0 && !entry->dirty)
+            bind_cache_entry(cache, entry, 0);
+    }
+}
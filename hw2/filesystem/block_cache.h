@@ -0,0 +1,42 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct BlockCacheEntry {
+    uint32_t               block_id; // 0 if the entry holds no block
+    int                    dirty;
+    uint8_t                *data;
+    struct BlockCacheEntry *lru_prev, *lru_next;
+    struct BlockCacheEntry *hash_next;
+};
+
+struct BlockCache {
+    size_t                 capacity;    // in blocks, 0 disables the cache
+    size_t                 block_size;  // 0 until the cache is set up
+    size_t                 base_offset; // file offset of the block #1
+    struct BlockCacheEntry *entries;
+    uint8_t                *data;
+    struct BlockCacheEntry **buckets;
+    size_t                 n_buckets;
+    struct BlockCacheEntry *lru_head, *lru_tail; // head is the most recently used
+    size_t                 hits, misses, writebacks;
+};
+
+struct BlockCache create_block_cache(const size_t capacity);
+
+int  setup_block_cache(struct BlockCache *cache, const size_t block_size, const size_t base_offset);
+void free_block_cache (struct BlockCache *cache);
+void drop_clean_blocks(struct BlockCache *cache);
+
+struct BlockCacheEntry* find_cached_block  (struct BlockCache *cache, const uint32_t block_id);
+struct BlockCacheEntry* lookup_cached_block(const struct BlockCache *cache, const uint32_t block_id);
+struct BlockCacheEntry* take_cache_entry (struct BlockCache *cache);
+void                    bind_cache_entry (
+    struct BlockCache *cache,
+    struct BlockCacheEntry *entry,
+    const uint32_t block_id
+);
+
+#endif
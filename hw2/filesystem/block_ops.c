@@ -4,26 +4,134 @@
 
 #include "constants.h"
 
-static int seek_to_block(
-     FILE *file,
-     const struct Superblock *superblock,
-     const uint32_t block_id
-) {
+static size_t block_offset(const struct Superblock *superblock, const uint32_t block_id) {
+    return BOOT_OFFSET + superblock->size + (block_id - 1) * superblock->block_size;
+}
+
+static int check_block_id(const struct Superblock *superblock, const uint32_t block_id) {
     if (block_id == 0 || block_id > superblock->total_blocks) {
         fprintf(stderr, "Invalid block id\n");
         return 1;
     }
 
-    if (
-        fseek(
-            file,
-            BOOT_OFFSET +
-             superblock->size +
-             (block_id - 1) * superblock->block_size,
-            SEEK_SET
-        )
+    return 0;
+}
+
+/*
+* Returns the cache entry holding block_id, loading it from the file if load is set.
+* *entry is NULL if the cache is disabled.
+*/
+static int get_cached_block(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const uint32_t block_id,
+     const int load,
+     struct BlockCacheEntry **entry
+) {
+    struct BlockCache *cache = &device->cache;
+
+    *entry = NULL;
+    if (cache->capacity == 0)
+        return 0;
+
+    if (setup_block_cache(cache, superblock->block_size, block_offset(superblock, 1)))
+        return 1;
+
+    *entry = find_cached_block(cache, block_id);
+    if (*entry)
+        return 0;
+
+    struct BlockCacheEntry *victim = take_cache_entry(cache);
+    if (write_back_block(device, victim))
+        return 1;
+
+    if (load) {
+        if (device_read(device, block_offset(superblock, block_id), victim->data, superblock->block_size)) {
+            fprintf(stderr, "Failed to read a block\n");
+            bind_cache_entry(cache, victim, 0);
+            return 1;
+        }
+    }
+
+    bind_cache_entry(cache, victim, block_id);
+    *entry = victim;
+    return 0;
+}
+
+static size_t part_size(const struct Superblock *superblock, const size_t offset, const size_t ptr_size) {
+    if (ptr_size - offset < superblock->block_size)
+        return ptr_size - offset;
+
+    return superblock->block_size;
+}
+
+/*
+* Counts the physically adjacent blocks starting at block_ids[first] that can be transferred at once.
+* With the cache enabled the run stops at the first cached block.
+*/
+static size_t run_length(
+     const struct BlockCache *cache,
+     const struct Superblock *superblock,
+     const uint32_t *block_ids,
+     const size_t first,
+     const size_t n_block_ids,
+     const size_t ptr_size
+) {
+    size_t last = first + 1;
+    while (
+        last < n_block_ids &&
+        block_ids[last] == block_ids[last - 1] + 1 &&
+        block_ids[last] <= superblock->total_blocks &&
+        last * superblock->block_size < ptr_size
     ) {
-        fprintf(stderr, "Failed to seek to the block\n");
+        if (cache->capacity != 0) {
+            if (
+                last - first == cache->capacity ||
+                last - first == DEVICE_IOV_MAX ||
+                lookup_cached_block(cache, block_ids[last])
+            ) {
+                break;
+            }
+        }
+
+        ++last;
+    }
+
+    return last - first;
+}
+
+// Reads a run of adjacent blocks that are not cached into fresh cache entries with a single preadv()
+static int read_cached_run(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const uint32_t *block_ids,
+     const size_t n_block_ids,
+     struct BlockCacheEntry **entries
+) {
+    struct BlockCache *cache = &device->cache;
+    struct iovec iov[DEVICE_IOV_MAX];
+
+    for (size_t i = 0; i < n_block_ids; ++i) {
+        struct BlockCacheEntry *victim = take_cache_entry(cache);
+        if (write_back_block(device, victim)) {
+            for (size_t j = 0; j < i; ++j)
+                bind_cache_entry(cache, entries[j], 0);
+            return 1;
+        }
+
+        bind_cache_entry(cache, victim, block_ids[i]);
+        entries[i] = victim;
+        iov[i] = (struct iovec){
+            .iov_base = victim->data,
+            .iov_len  = superblock->block_size
+        };
+    }
+    cache->misses += n_block_ids - 1; // the first miss is counted by find_cached_block()
+
+    if (device_readv(device, block_offset(superblock, block_ids[0]), iov, n_block_ids)) {
+        fprintf(stderr, "Failed to read the blocks\n");
+        for (size_t i = 0; i < n_block_ids; ++i)
+            bind_cache_entry(cache, entries[i], 0);
         return 1;
     }
 
@@ -31,70 +139,207 @@ static int seek_to_block(
 }
 
 int read_blocks(
-     FILE *file,
+     struct Device *device,
      const struct Superblock *superblock,
      const uint32_t *block_ids,
      const size_t n_block_ids,
      uint8_t *ptr,
      const size_t ptr_size
 ) {
-    for (size_t i = 0; i < n_block_ids; ++i) {
+    struct BlockCache *cache = &device->cache;
+    if (setup_block_cache(cache, superblock->block_size, block_offset(superblock, 1)))
+        return 1;
+
+    for (size_t i = 0; i < n_block_ids;) {
         const uint32_t current_block_id = *(block_ids + i);
-        if (seek_to_block(file, superblock, current_block_id))
+        if (check_block_id(superblock, current_block_id))
             return 1;
 
         const size_t offset = i * superblock->block_size;
         if (offset >= ptr_size) {
             fprintf(stderr, "ptr is too small\n");
             return 1;
-        } else if (ptr_size - offset < superblock->block_size) {
-            const size_t block_part_size = ptr_size - offset;
-            if (fread(ptr + offset, block_part_size, 1, file) != 1) {
-                fprintf(stderr, "Failed to read the final block part\n");
+        }
+
+        if (cache->capacity != 0) {
+            struct BlockCacheEntry *entry = find_cached_block(cache, current_block_id);
+            if (entry) {
+                memcpy(ptr + offset, entry->data, part_size(superblock, offset, ptr_size));
+                ++i;
+                continue;
+            }
+        }
+
+        const size_t run = run_length(cache, superblock, block_ids, i, n_block_ids, ptr_size);
+
+        if (cache->capacity != 0) {
+            struct BlockCacheEntry *entries[DEVICE_IOV_MAX];
+            if (read_cached_run(device, superblock, block_ids + i, run, entries))
                 return 1;
+
+            for (size_t j = 0; j < run; ++j) {
+                const size_t block_offset = (i + j) * superblock->block_size;
+                memcpy(ptr + block_offset, entries[j]->data, part_size(superblock, block_offset, ptr_size));
             }
         } else {
-            if (fread(ptr + offset, superblock->block_size, 1, file) != 1) {
-                fprintf(stderr, "Failed to read a block\n");
+            // The destination is contiguous, so the whole run (with the final block part) is one read
+            size_t run_size = run * superblock->block_size;
+            if (run_size > ptr_size - offset)
+                run_size = ptr_size - offset;
+
+            if (device_read(device, block_offset(superblock, current_block_id), ptr + offset, run_size)) {
+                fprintf(stderr, "Failed to read the blocks\n");
                 return 1;
             }
         }
+
+        i += run;
     }
 
     return 0;
 }
 
 int write_blocks(
-     FILE *file,
+     struct Device *device,
      const struct Superblock *superblock,
      const uint32_t *block_ids,
      const size_t n_block_ids,
      const uint8_t *ptr,
      const size_t ptr_size
 ) {
-    for (size_t i = 0; i < n_block_ids; ++i) {
+    struct BlockCache *cache = &device->cache;
+    if (setup_block_cache(cache, superblock->block_size, block_offset(superblock, 1)))
+        return 1;
+
+    for (size_t i = 0; i < n_block_ids;) {
         const uint32_t current_block_id = *(block_ids + i);
-        if (seek_to_block(file, superblock, current_block_id))
+        if (check_block_id(superblock, current_block_id))
             return 1;
 
         const size_t offset = i * superblock->block_size;
         if (offset >= ptr_size) {
             fprintf(stderr, "Not enough data in the ptr, offset too big\n");
             return 1;
-        } else if (ptr_size - offset < superblock->block_size) {
-            const size_t block_part_size = ptr_size - offset;
-            if (fwrite(ptr + offset, block_part_size, 1, file) != 1) {
-                fprintf(stderr, "Failed to write the final block part\n");
+        }
+
+        const size_t block_part_size = part_size(superblock, offset, ptr_size);
+
+        // Cached blocks are only marked dirty, they are written back in runs by sync_device()
+        if (cache->capacity != 0) {
+            struct BlockCacheEntry *entry;
+            if (get_cached_block(device, superblock, current_block_id, 0, &entry))
                 return 1;
-            }
-            for (size_t j = 0; j < superblock->block_size - block_part_size; ++j)
-                fputc(0, file);
-        } else {
-            if (fwrite(ptr + offset, superblock->block_size, 1, file) != 1) {
-                fprintf(stderr, "Failed to write a block\n");
+
+            memcpy(entry->data, ptr + offset, block_part_size);
+            memset(entry->data + block_part_size, 0, superblock->block_size - block_part_size);
+            entry->dirty = 1;
+            ++i;
+            continue;
+        }
+
+        const size_t run = run_length(cache, superblock, block_ids, i, n_block_ids, ptr_size);
+
+        size_t run_size = run * superblock->block_size;
+        if (run_size > ptr_size - offset)
+            run_size = ptr_size - offset;
+
+        // The final block part is padded with zeroes in the same pwritev()
+        struct iovec iov[2] = {
+            { .iov_base = (uint8_t*)ptr + offset, .iov_len = run_size },
+            { .iov_base = NULL,                   .iov_len = run * superblock->block_size - run_size }
+        };
+        int iovcnt = 1;
+        if (iov[1].iov_len != 0) {
+            iov[1].iov_base = calloc(iov[1].iov_len, sizeof(uint8_t));
+            if (!iov[1].iov_base) {
+                fprintf(stderr, "Failed to allocate memory for the final block part\n");
                 return 1;
             }
+            iovcnt = 2;
+        }
+
+        if (device_writev(device, block_offset(superblock, current_block_id), iov, iovcnt)) {
+            fprintf(stderr, "Failed to write the blocks\n");
+            free(iov[1].iov_base);
+            return 1;
+        }
+
+        free(iov[1].iov_base);
+        i += run;
+    }
+
+    return 0;
+}
+
+int read_bytes(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const size_t offset,
+     uint8_t *ptr,
+     const size_t size
+) {
+    size_t done = 0;
+    while (done < size) {
+        const uint32_t block_id     = (offset + done) / superblock->block_size + 1;
+        const size_t   block_offset = (offset + done) % superblock->block_size;
+
+        size_t part_size = superblock->block_size - block_offset;
+        if (part_size > size - done)
+            part_size = size - done;
+
+        if (check_block_id(superblock, block_id))
+            return 1;
+
+        struct BlockCacheEntry *entry;
+        if (get_cached_block(device, superblock, block_id, 1, &entry))
+            return 1;
+
+        if (entry) {
+            memcpy(ptr + done, entry->data + block_offset, part_size);
+        } else if (device_read(device, BOOT_OFFSET + superblock->size + offset + done, ptr + done, part_size)) {
+            fprintf(stderr, "Failed to read a block part\n");
+            return 1;
+        }
+
+        done += part_size;
+    }
+
+    return 0;
+}
+
+int write_bytes(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const size_t offset,
+     const uint8_t *ptr,
+     const size_t size
+) {
+    size_t done = 0;
+    while (done < size) {
+        const uint32_t block_id     = (offset + done) / superblock->block_size + 1;
+        const size_t   block_offset = (offset + done) % superblock->block_size;
+
+        size_t part_size = superblock->block_size - block_offset;
+        if (part_size > size - done)
+            part_size = size - done;
+
+        if (check_block_id(superblock, block_id))
+            return 1;
+
+        // Partially overwritten blocks have to be loaded first
+        struct BlockCacheEntry *entry;
+        if (get_cached_block(device, superblock, block_id, part_size != superblock->block_size, &entry))
+            return 1;
+
+        if (entry) {
+            memcpy(entry->data + block_offset, ptr + done, part_size);
+            entry->dirty = 1;
+        } else if (device_write(device, BOOT_OFFSET + superblock->size + offset + done, ptr + done, part_size)) {
+            fprintf(stderr, "Failed to write a block part\n");
+            return 1;
         }
+
+        done += part_size;
     }
 
     return 0;
@@ -5,10 +5,11 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "device.h"
 #include "superblock.h"
 
 int read_blocks(
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     const uint32_t *block_ids,
     const size_t n_block_ids,
@@ -17,7 +18,7 @@ int read_blocks(
 );
 
 int write_blocks(
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     const uint32_t *block_ids,
     const size_t n_block_ids,
@@ -25,4 +26,21 @@ int write_blocks(
     const size_t ptr_size
 );
 
+// offset is counted from the beginning of the block #1
+int read_bytes(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const size_t offset,
+    uint8_t *ptr,
+    const size_t size
+);
+
+int write_bytes(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const size_t offset,
+    const uint8_t *ptr,
+    const size_t size
+);
+
 #endif
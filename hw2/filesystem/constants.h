@@ -2,14 +2,39 @@
 #define CONSTANTS_H
 
 #define MAGIC                 0xEF53
+#define MAGIC_FEATURES        0xEF54 // the superblock has the features field after the magic
 #define BOOT_OFFSET           1024   // bytes
 
 #define INODE_BLOCK_COUNT     14
 #define INDIRECT_BLOCK        12
 #define DOUBLE_INDIRECT_BLOCK 13
 
+#define FEATURE_EXTENTS       0x1    // inodes map their blocks with extents
+#define FEATURE_DIR_INDEX     0x2    // directories are hash tables of entries
+#define FEATURE_MOUNT_STATE   0x4    // the superblock has the mount state and a generation after the block size
+#define SUPPORTED_FEATURES    (FEATURE_EXTENTS | FEATURE_DIR_INDEX | FEATURE_MOUNT_STATE)
+
+// With FEATURE_MOUNT_STATE
+#define STATE_CLEAN           0x1    // unmounted cleanly, so the free counts match the bitmaps
+#define STATE_MOUNTED         0x2
+
+#define SUPERBLOCK_HEADER_MAX 34     // bytes before the bitmaps with all the optional fields
+#define SUPERBLOCK_FIRST_READ 4096   // bytes read along with the header, so that small bitmaps need no other read
+
+// With FEATURE_EXTENTS the inode blocks hold an extent header followed by the extents
+#define EXTENT_COUNT          0      // number of extents in the file
+#define EXTENT_DEPTH          1      // 0 -- extents are in the inode, 1 -- in the leaf blocks,
+                                     // 2 -- the leaf block ids are in the index blocks
+#define EXTENT_FIRST          2
+#define INODE_EXTENT_COUNT    6      // extents in the inode itself
+#define EXTENT_NODE_COUNT     12     // leaf or index block ids in the inode
+
 #define MAX_FILENAME_LEN      63
 
+// With FEATURE_DIR_INDEX a free slot has the inode id 0, deleted slots are also marked with the name_len
+#define DIRECTORY_TOMBSTONE   0xFF
+#define MIN_DIRECTORY_SLOTS   8      // must be a power of two
+
 #define FILETYPE_FILE         0
 #define FILETYPE_DIRECTORY    1
 
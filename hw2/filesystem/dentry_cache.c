@@ -0,0 +1,198 @@
+#include "dentry_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "misc.h"
+
+struct DentryCache create_dentry_cache(const size_t capacity) {
+    struct DentryCache new_cache = {
+        .capacity = capacity
+    };
+
+    return new_cache;
+}
+
+static int setup_dentry_cache(struct DentryCache *cache) {
+    size_t n_buckets = 1;
+    while (n_buckets < cache->capacity)
+        n_buckets <<= 1;
+
+    cache->entries = calloc(cache->capacity, sizeof(struct DentryCacheEntry));
+    cache->buckets = calloc(n_buckets, sizeof(struct DentryCacheEntry*));
+    if (!cache->entries || !cache->buckets) {
+        fprintf(stderr, "Failed to allocate memory for the dentry cache\n");
+        free(cache->entries);
+        free(cache->buckets);
+        cache->entries = NULL;
+        cache->buckets = NULL;
+        return 1;
+    }
+
+    cache->n_buckets = n_buckets;
+    clear_dentry_cache(cache);
+    return 0;
+}
+
+void free_dentry_cache(struct DentryCache *cache) {
+    free(cache->entries);
+    free(cache->buckets);
+    *cache = create_dentry_cache(cache->capacity);
+}
+
+// Empties every entry and chains them all in the LRU list
+void clear_dentry_cache(struct DentryCache *cache) {
+    if (!cache->entries)
+        return;
+
+    memset(cache->buckets, 0, cache->n_buckets * sizeof(struct DentryCacheEntry*));
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        struct DentryCacheEntry *entry = cache->entries + i;
+        entry->parent_id = 0;
+        entry->hash_next = NULL;
+        entry->lru_prev  = i > 0 ? entry - 1 : NULL;
+        entry->lru_next  = i + 1 < cache->capacity ? entry + 1 : NULL;
+    }
+    cache->lru_head = cache->entries;
+    cache->lru_tail = cache->entries + cache->capacity - 1;
+}
+
+static struct DentryCacheEntry** bucket_of(
+     const struct DentryCache *cache,
+     const uint32_t parent_id,
+     const char *name
+) {
+    const uint32_t hash = hash_name(name) ^ (parent_id * 2654435761u);
+    return cache->buckets + (hash & (cache->n_buckets - 1));
+}
+
+static void unlink_lru(struct DentryCache *cache, struct DentryCacheEntry *entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void push_lru_head(struct DentryCache *cache, struct DentryCacheEntry *entry) {
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail)
+        cache->lru_tail = entry;
+}
+
+static void push_lru_tail(struct DentryCache *cache, struct DentryCacheEntry *entry) {
+    entry->lru_prev = cache->lru_tail;
+    if (cache->lru_tail)
+        cache->lru_tail->lru_next = entry;
+    cache->lru_tail = entry;
+    if (!cache->lru_head)
+        cache->lru_head = entry;
+}
+
+static struct DentryCacheEntry** link_of(
+     const struct DentryCache *cache,
+     const uint32_t parent_id,
+     const char *name
+) {
+    struct DentryCacheEntry **link = bucket_of(cache, parent_id, name);
+    while (*link) {
+        if ((*link)->parent_id == parent_id && strncmp((*link)->name, name, MAX_FILENAME_LEN) == 0)
+            break;
+        link = &(*link)->hash_next;
+    }
+
+    return link;
+}
+
+static void unlink_hash(struct DentryCache *cache, struct DentryCacheEntry *entry) {
+    struct DentryCacheEntry **link = link_of(cache, entry->parent_id, entry->name);
+    if (*link == entry)
+        *link = entry->hash_next;
+
+    entry->hash_next = NULL;
+}
+
+// Longer names cannot be in a directory, so they are not worth remembering
+static int name_fits(const char *name) {
+    for (size_t i = 0; i < MAX_FILENAME_LEN; ++i) {
+        if (name[i] == '\0')
+            return 1;
+    }
+
+    return 0;
+}
+
+struct DentryCacheEntry* find_dentry(struct DentryCache *cache, const uint32_t parent_id, const char *name) {
+    if (!cache->entries)
+        return NULL;
+
+    struct DentryCacheEntry *entry = *link_of(cache, parent_id, name);
+    if (!entry) {
+        ++cache->misses;
+        return NULL;
+    }
+
+    ++cache->hits;
+    unlink_lru(cache, entry);
+    push_lru_head(cache, entry);
+    return entry;
+}
+
+int insert_dentry(
+     struct DentryCache *cache,
+     const uint32_t parent_id,
+     const char *name,
+     const uint32_t inode_id,
+     const uint8_t filetype
+) {
+    if (cache->capacity == 0 || !name_fits(name))
+        return 0;
+    if (!cache->entries && setup_dentry_cache(cache))
+        return 1;
+
+    // An existing entry for the name is updated in place, otherwise the least recently used one is taken
+    struct DentryCacheEntry *entry = *link_of(cache, parent_id, name);
+    if (!entry) {
+        entry = cache->lru_tail;
+        if (entry->parent_id != 0)
+            unlink_hash(cache, entry);
+
+        entry->parent_id = parent_id;
+        strcpy(entry->name, name);
+
+        struct DentryCacheEntry **bucket = bucket_of(cache, parent_id, entry->name);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+    }
+
+    entry->inode_id = inode_id;
+    entry->filetype = filetype;
+
+    unlink_lru(cache, entry);
+    push_lru_head(cache, entry);
+    return 0;
+}
+
+void invalidate_dentry(struct DentryCache *cache, const uint32_t parent_id, const char *name) {
+    if (!cache->entries)
+        return;
+
+    struct DentryCacheEntry *entry = *link_of(cache, parent_id, name);
+    if (!entry)
+        return;
+
+    unlink_hash(cache, entry);
+    entry->parent_id = 0;
+
+    unlink_lru(cache, entry);
+    push_lru_tail(cache, entry);
+}
@@ -0,0 +1,46 @@
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "constants.h"
+
+#define DEFAULT_DENTRY_CACHE_SIZE 4096 // entries
+
+// Maps a name in the directory parent_id to its inode, remembering missing names as well
+struct DentryCacheEntry {
+    uint32_t                parent_id; // 0 if the entry is empty
+    uint32_t                inode_id;  // 0 if there is no such name
+    uint8_t                 filetype;
+    char                    name[MAX_FILENAME_LEN];
+    struct DentryCacheEntry *lru_prev, *lru_next;
+    struct DentryCacheEntry *hash_next;
+};
+
+struct DentryCache {
+    size_t                  capacity; // in entries, 0 disables the cache
+    struct DentryCacheEntry *entries; // NULL until the first insertion
+    struct DentryCacheEntry **buckets;
+    size_t                  n_buckets;
+    struct DentryCacheEntry *lru_head, *lru_tail; // head is the most recently used
+    size_t                  hits, misses;
+};
+
+struct DentryCache create_dentry_cache(const size_t capacity);
+
+void free_dentry_cache (struct DentryCache *cache);
+void clear_dentry_cache(struct DentryCache *cache);
+
+struct DentryCacheEntry* find_dentry(struct DentryCache *cache, const uint32_t parent_id, const char *name);
+
+int  insert_dentry(
+    struct DentryCache *cache,
+    const uint32_t parent_id,
+    const char *name,
+    const uint32_t inode_id,
+    const uint8_t filetype
+);
+void invalidate_dentry(struct DentryCache *cache, const uint32_t parent_id, const char *name);
+
+#endif
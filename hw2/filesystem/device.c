@@ -0,0 +1,320 @@
+#define _DEFAULT_SOURCE
+
+#include "device.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int map_device(struct Device *device) {
+    struct stat file_stat;
+    if (fstat(fileno(device->file), &file_stat)) {
+        fprintf(stderr, "Failed to get the file size\n");
+        return 1;
+    }
+
+    device->map      = NULL;
+    device->map_size = file_stat.st_size;
+    if (device->map_size == 0)
+        return 0;
+
+    void *map = mmap(NULL, device->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(device->file), 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map the file into memory\n");
+        device->map_size = 0;
+        return 1;
+    }
+
+    device->map = map;
+    return 0;
+}
+
+static int unmap_device(struct Device *device) {
+    if (!device->map)
+        return 0;
+
+    int result = munmap(device->map, device->map_size);
+    device->map      = NULL;
+    device->map_size = 0;
+    if (result) {
+        fprintf(stderr, "Failed to unmap the file\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int open_device(
+     const char *path,
+     const char *mode,
+     const int backend,
+     const size_t cache_blocks,
+     struct Device *device
+) {
+    FILE *file = fopen(path, mode);
+    if (!file) {
+        fprintf(stderr, "Failed to open the file %s\n", path);
+        return 1;
+    }
+
+    // The mapping already is the kernel page cache, so there is no need for another one
+    *device = (struct Device){
+        .file     = file,
+        .backend  = backend,
+        .cache    = create_block_cache(backend == DEVICE_BACKEND_MMAP ? 0 : cache_blocks),
+        .dentries = create_dentry_cache(DEFAULT_DENTRY_CACHE_SIZE)
+    };
+
+    if (backend == DEVICE_BACKEND_MMAP && map_device(device)) {
+        fclose(file);
+        return 1;
+    }
+
+    return 0;
+}
+
+int resize_device(struct Device *device, const size_t size) {
+    if (sync_device(device) || unmap_device(device))
+        return 1;
+
+    if (ftruncate(fileno(device->file), size)) {
+        fprintf(stderr, "Failed to resize the file to %zu bytes\n", size);
+        return 1;
+    }
+
+    if (device->backend == DEVICE_BACKEND_MMAP)
+        return map_device(device);
+
+    return 0;
+}
+
+uint8_t* device_pointer(struct Device *device, const size_t offset, const size_t size) {
+    if (!device->map || offset > device->map_size || size > device->map_size - offset)
+        return NULL;
+
+    return device->map + offset;
+}
+
+// Transfers the whole vector, retrying short reads and writes
+static int transfer_vector(
+     struct Device *device,
+     size_t offset,
+     struct iovec *iov,
+     int iovcnt,
+     const int is_write
+) {
+    while (iovcnt > 0) {
+        if (device->backend == DEVICE_BACKEND_MMAP) {
+            uint8_t *mapped = device_pointer(device, offset, iov->iov_len);
+            if (!mapped)
+                return 1;
+
+            if (is_write)
+                memcpy(mapped, iov->iov_base, iov->iov_len);
+            else
+                memcpy(iov->iov_base, mapped, iov->iov_len);
+
+            offset += iov->iov_len;
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        const ssize_t done = is_write
+            ? pwritev(fileno(device->file), iov, iovcnt, offset)
+            : preadv(fileno(device->file), iov, iovcnt, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return 1;
+
+        offset += done;
+        size_t left = done;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    return 0;
+}
+
+int device_readv(struct Device *device, const size_t offset, struct iovec *iov, const int iovcnt) {
+    if (transfer_vector(device, offset, iov, iovcnt, 0)) {
+        fprintf(stderr, "Failed to read %d buffers at the offset %zu\n", iovcnt, offset);
+        return 1;
+    }
+
+    return 0;
+}
+
+int device_writev(struct Device *device, const size_t offset, struct iovec *iov, const int iovcnt) {
+    if (transfer_vector(device, offset, iov, iovcnt, 1)) {
+        fprintf(stderr, "Failed to write %d buffers at the offset %zu\n", iovcnt, offset);
+        return 1;
+    }
+
+    return 0;
+}
+
+int device_read(struct Device *device, const size_t offset, uint8_t *ptr, const size_t size) {
+    struct iovec iov = { .iov_base = ptr, .iov_len = size };
+    if (transfer_vector(device, offset, &iov, 1, 0)) {
+        fprintf(stderr, "Failed to read %zu bytes at the offset %zu\n", size, offset);
+        return 1;
+    }
+
+    return 0;
+}
+
+int device_read_partial(
+     struct Device *device,
+     const size_t offset,
+     uint8_t *ptr,
+     const size_t size,
+     size_t *read_len
+) {
+    *read_len = 0;
+    if (device->backend == DEVICE_BACKEND_MMAP) {
+        if (offset < device->map_size)
+            *read_len = size < device->map_size - offset ? size : device->map_size - offset;
+        memcpy(ptr, device->map + offset, *read_len);
+        return 0;
+    }
+
+    while (*read_len < size) {
+        const ssize_t done = pread(fileno(device->file), ptr + *read_len, size - *read_len, offset + *read_len);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0) {
+            fprintf(stderr, "Failed to read %zu bytes at the offset %zu\n", size, offset);
+            return 1;
+        }
+        if (done == 0)
+            break;
+
+        *read_len += done;
+    }
+
+    return 0;
+}
+
+int device_write(struct Device *device, const size_t offset, const uint8_t *ptr, const size_t size) {
+    struct iovec iov = { .iov_base = (uint8_t*)ptr, .iov_len = size };
+    if (transfer_vector(device, offset, &iov, 1, 1)) {
+        fprintf(stderr, "Failed to write %zu bytes at the offset %zu\n", size, offset);
+        return 1;
+    }
+
+    return 0;
+}
+
+static size_t cached_block_offset(const struct BlockCache *cache, const uint32_t block_id) {
+    return cache->base_offset + (block_id - 1) * cache->block_size;
+}
+
+int write_back_block(struct Device *device, struct BlockCacheEntry *entry) {
+    if (!entry->dirty)
+        return 0;
+
+    const struct BlockCache *cache = &device->cache;
+    if (device_write(device, cached_block_offset(cache, entry->block_id), entry->data, cache->block_size)) {
+        fprintf(stderr, "Failed to write back the block #%u\n", entry->block_id);
+        return 1;
+    }
+
+    entry->dirty = 0;
+    ++device->cache.writebacks;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const uint32_t id_a = (*(struct BlockCacheEntry* const*)a)->block_id;
+    const uint32_t id_b = (*(struct BlockCacheEntry* const*)b)->block_id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+int sync_device(struct Device *device) {
+    struct BlockCache *cache = &device->cache;
+
+    if (cache->entries) {
+        struct BlockCacheEntry **dirty = malloc(cache->capacity * sizeof(struct BlockCacheEntry*));
+        if (!dirty) {
+            fprintf(stderr, "Failed to allocate memory for the dirty blocks list\n");
+            return 1;
+        }
+
+        size_t n_dirty = 0;
+        for (size_t i = 0; i < cache->capacity; ++i) {
+            if (cache->entries[i].block_id != 0 && cache->entries[i].dirty)
+                dirty[n_dirty++] = cache->entries + i;
+        }
+
+        // Runs of adjacent dirty blocks are written back with a single pwritev()
+        qsort(dirty, n_dirty, sizeof(struct BlockCacheEntry*), compare_entries);
+        for (size_t i = 0; i < n_dirty;) {
+            struct iovec iov[DEVICE_IOV_MAX];
+            int iovcnt = 0;
+            size_t j = i;
+            do {
+                iov[iovcnt++] = (struct iovec){
+                    .iov_base = dirty[j]->data,
+                    .iov_len  = cache->block_size
+                };
+                ++j;
+            } while (
+                j < n_dirty &&
+                iovcnt < DEVICE_IOV_MAX &&
+                dirty[j]->block_id == dirty[j - 1]->block_id + 1
+            );
+
+            if (device_writev(device, cached_block_offset(cache, dirty[i]->block_id), iov, iovcnt)) {
+                fprintf(stderr, "Failed to write back the blocks #%u-#%u\n", dirty[i]->block_id, dirty[j - 1]->block_id);
+                free(dirty);
+                return 1;
+            }
+
+            for (; i < j; ++i) {
+                dirty[i]->dirty = 0;
+                ++cache->writebacks;
+            }
+        }
+
+        free(dirty);
+    }
+
+    if (device->map && msync(device->map, device->map_size, MS_SYNC)) {
+        fprintf(stderr, "Failed to sync the mapped file\n");
+        return 1;
+    }
+
+    if (device->backend == DEVICE_BACKEND_STDIO && fsync(fileno(device->file))) {
+        fprintf(stderr, "Failed to sync the file\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int close_device(struct Device *device) {
+    int result = sync_device(device);
+
+    free_block_cache(&device->cache);
+    free_dentry_cache(&device->dentries);
+    clear_extent_map(&device->extents);
+    if (unmap_device(device))
+        result = 1;
+    if (fclose(device->file) == EOF) {
+        fprintf(stderr, "Failed to close the file\n");
+        result = 1;
+    }
+
+    return result;
+}
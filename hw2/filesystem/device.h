@@ -0,0 +1,58 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "block_cache.h"
+#include "dentry_cache.h"
+#include "extent_map.h"
+
+#define DEVICE_BACKEND_STDIO 0
+#define DEVICE_BACKEND_MMAP  1
+
+#define DEVICE_IOV_MAX       1024 // buffers per preadv()/pwritev() call
+
+// All I/O goes through the file descriptor (pread/pwrite) or the mapping, never through stdio buffers
+struct Device {
+    FILE               *file;
+    int                backend;
+    uint8_t            *map;     // the whole file with DEVICE_BACKEND_MMAP
+    size_t             map_size;
+    struct BlockCache  cache;    // unused with DEVICE_BACKEND_MMAP
+    struct DentryCache dentries;
+    struct ExtentMap   extents;
+};
+
+int open_device  (
+    const char *path,
+    const char *mode,
+    const int backend,
+    const size_t cache_blocks,
+    struct Device *device
+);
+int resize_device(struct Device *device, const size_t size);
+int sync_device  (struct Device *device);
+int close_device (struct Device *device);
+
+int device_read (struct Device *device, const size_t offset, uint8_t *ptr, const size_t size);
+// Like device_read(), but *read_len may be less than size at the end of the file
+int device_read_partial(
+    struct Device *device,
+    const size_t offset,
+    uint8_t *ptr,
+    const size_t size,
+    size_t *read_len
+);
+int device_write(struct Device *device, const size_t offset, const uint8_t *ptr, const size_t size);
+
+int device_readv (struct Device *device, const size_t offset, struct iovec *iov, const int iovcnt);
+int device_writev(struct Device *device, const size_t offset, struct iovec *iov, const int iovcnt);
+
+uint8_t* device_pointer(struct Device *device, const size_t offset, const size_t size);
+
+int write_back_block(struct Device *device, struct BlockCacheEntry *entry);
+
+#endif
@@ -14,4 +14,11 @@ struct DirectoryEntry {
 
 #define DIRECTORY_ENTRY_SIZE sizeof(struct DirectoryEntry)
 
+// Takes the first entry-sized slot of an indexed directory, the n_slots slots of the table follow it
+struct DirectoryIndexHeader {
+    uint32_t n_slots; // a power of two
+    uint32_t n_entries;
+    uint32_t n_deleted;
+};
+
 #endif
@@ -2,104 +2,599 @@
 
 #include <string.h>
 
+#include "block_ops.h"
 #include "directory_entry.h"
 #include "inode.h"
 #include "misc.h"
 
+static int uses_dir_index(const struct Superblock *superblock) {
+    return (superblock->features & FEATURE_DIR_INDEX) != 0;
+}
+
+static size_t slot_offset(const uint32_t slot) {
+    return (1 + (size_t)slot) * DIRECTORY_ENTRY_SIZE;
+}
+
+// The smallest table that is at most 3/4 full with n_entries entries
+static uint32_t index_slots(const size_t n_entries) {
+    uint32_t n_slots = MIN_DIRECTORY_SLOTS;
+    while (n_entries * 4 > (size_t)n_slots * 3)
+        n_slots <<= 1;
+
+    return n_slots;
+}
+
+// Reads or writes a part of the directory contents without loading the rest of it
+static int transfer_directory(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct FsFile *directory,
+     size_t offset,
+     uint8_t *ptr,
+     size_t size,
+     const int is_write
+) {
+    while (size > 0) {
+        uint32_t block_id;
+        if (get_block_id(device, superblock, &directory->inode, offset / superblock->block_size, &block_id))
+            return 1;
+
+        const size_t in_block = offset % superblock->block_size;
+        const size_t part = size < superblock->block_size - in_block ? size : superblock->block_size - in_block;
+        const size_t disk_offset = (block_id - 1) * superblock->block_size + in_block;
+        if (
+            is_write
+                ? write_bytes(device, superblock, disk_offset, ptr, part)
+                : read_bytes(device, superblock, disk_offset, ptr, part)
+        ) {
+            return 1;
+        }
+
+        offset += part;
+        ptr    += part;
+        size   -= part;
+    }
+
+    return 0;
+}
+
+static int read_index_header(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct FsFile *directory,
+     struct DirectoryIndexHeader *header
+) {
+    if (
+        transfer_directory(
+            device,
+            superblock,
+            directory,
+            0,
+            (uint8_t*)header,
+            sizeof(*header),
+            0
+        )
+    ) {
+        fprintf(stderr, "Failed to read the directory index header\n");
+        return 1;
+    }
+
+    if (
+        header->n_slots == 0 ||
+        (header->n_slots & (header->n_slots - 1)) != 0 ||
+        directory->inode.file_size != slot_offset(header->n_slots)
+    ) {
+        fprintf(stderr, "Invalid directory index header\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int write_index_header(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct FsFile *directory,
+     struct DirectoryIndexHeader *header
+) {
+    if (
+        transfer_directory(
+            device,
+            superblock,
+            directory,
+            0,
+            (uint8_t*)header,
+            sizeof(*header),
+            1
+        )
+    ) {
+        fprintf(stderr, "Failed to write the directory index header\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Finds the slot holding name, or the first free slot of its probe sequence if there is none,
+// entry receives the contents of that slot
+static int probe_index(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct FsFile *directory,
+     const struct DirectoryIndexHeader *header,
+     const char *name,
+     uint32_t *slot,
+     struct DirectoryEntry *entry,
+     int *found
+) {
+    const uint32_t mask = header->n_slots - 1;
+    uint32_t position = hash_name(name) & mask;
+
+    int has_free = 0;
+    uint32_t free_slot = 0;
+    struct DirectoryEntry free_entry;
+    for (uint32_t i = 0; i < header->n_slots; ++i, position = (position + 1) & mask) {
+        if (
+            transfer_directory(
+                device,
+                superblock,
+                directory,
+                slot_offset(position),
+                (uint8_t*)entry,
+                DIRECTORY_ENTRY_SIZE,
+                0
+            )
+        ) {
+            fprintf(stderr, "Failed to read the directory slot #%u\n", position);
+            return 1;
+        }
+
+        if (entry->inode_id == 0) {
+            if (!has_free) {
+                free_slot  = position;
+                free_entry = *entry;
+                has_free   = 1;
+            }
+
+            // Only an empty slot ends the probe sequence, deleted ones do not
+            if (entry->name_len != DIRECTORY_TOMBSTONE)
+                break;
+        } else if (strncmp(entry->name, name, MAX_FILENAME_LEN) == 0) {
+            *slot = position;
+            *found = 1;
+            return 0;
+        }
+    }
+
+    if (!has_free) {
+        fprintf(stderr, "The directory index is full\n");
+        return 1;
+    }
+
+    *slot  = free_slot;
+    *entry = free_entry;
+    *found = 0;
+    return 0;
+}
+
+// Places the entries into a new table of n_slots slots and writes it as the directory contents
+static int build_index(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct FsFile *directory,
+     const struct DirectoryEntry *entries,
+     const size_t n_entries,
+     const uint32_t n_slots
+) {
+    struct DirectoryEntry *table = calloc(1 + (size_t)n_slots, DIRECTORY_ENTRY_SIZE);
+    if (!table) {
+        fprintf(stderr, "Failed to allocate memory for the directory index\n");
+        return 1;
+    }
+
+    const struct DirectoryIndexHeader header = {
+        .n_slots   = n_slots,
+        .n_entries = n_entries
+    };
+    memcpy(table, &header, sizeof(header));
+
+    const uint32_t mask = n_slots - 1;
+    for (size_t i = 0; i < n_entries; ++i) {
+        uint32_t position = hash_name(entries[i].name) & mask;
+        while (table[1 + position].inode_id != 0)
+            position = (position + 1) & mask;
+
+        table[1 + position] = entries[i];
+    }
+
+    if (write_contents(device, superblock, directory, (const uint8_t*)table, slot_offset(n_slots))) {
+        fprintf(stderr, "Failed to write the directory index\n");
+        free(table);
+        return 1;
+    }
+
+    free(table);
+    return 0;
+}
+
 int find_file(
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     const struct FsFile *where,
     const char *filename,
     struct FsFile *found_handle
 ) {
     struct FsFile current;
-    char *split_filename;
-
     if (filename[0] == '/') {
         current = (struct FsFile){
-            .fullname = "/",
             .inode_id = 1,
             .filetype = FILETYPE_DIRECTORY
         };
-        if (read_inode(file, superblock, &current.inode, 1)) {
+        if (read_inode(device, superblock, &current.inode, 1)) {
             fprintf(stderr, "Failed to read the root directory inode\n");
             return 1;
         }
-
-        if (strcmp(filename, "/") == 0) {
-            *found_handle = current;
-            return 0;
-        }
-
-        split_filename = malloc(strlen(filename) - 1);
-        if (!split_filename) {
-            fprintf(stderr, "Failed to allocate memory for split_filename\n");
-            return 1;
-        }
-        strcpy(split_filename, filename + 1);
     } else {
         current = *where;
-        split_filename = malloc(strlen(filename));
-        if (!split_filename) {
-            fprintf(stderr, "Failed to allocate memory for split_filename\n");
-            return 1;
-        }
-        strcpy(split_filename, filename);
     }
 
-    char *next = strtok(split_filename, "/");
-    do {
+    char *split_filename = malloc(strlen(filename) + 1);
+    if (!split_filename) {
+        fprintf(stderr, "Failed to allocate memory for split_filename\n");
+        return 1;
+    }
+    strcpy(split_filename, filename);
+
+    // Only the inodes are followed here, the full name is built once at the end
+    for (char *next = strtok(split_filename, "/"); next; next = strtok(NULL, "/")) {
         if (current.filetype != FILETYPE_DIRECTORY) {
             fprintf(stderr, "Is not a directory\n");
+            free(split_filename);
             return 1;
         }
 
-        struct DirectoryEntry *entries;
-        if (load_contents(file, superblock, &current, (uint8_t**)&entries)) {
-            fprintf(stderr, "Failed to load current directory contents\n");
+        struct DirectoryEntry entry;
+        const int found = find_entry(device, superblock, &current, next, &entry);
+        if (found == -1) {
+            fprintf(stderr, "Failed to look up %s\n", next);
             free(split_filename);
             return 1;
         }
 
-        int found = 0;
-        for (size_t i = 0; i < current.inode.file_size / DIRECTORY_ENTRY_SIZE; i++) {
-            if (strcmp(entries[i].name, next) == 0) {
-                char *new_path;
-                if (path_join(current.fullname, next, &new_path)) {
-                    free(entries);
-                    free(split_filename);
-                    return 1;
-                }
-                //free(current->fullname);
-
-                current = (struct FsFile){
-                    .fullname = new_path,
-                    .inode_id = entries[i].inode_id,
-                    .filetype = entries[i].filetype
-                };
-                if (read_inode(file, superblock, &current.inode, current.inode_id)) {
-                    fprintf(stderr, "Failed to read inode\n");
-                    free(entries);
-                    free(split_filename);
-                    return 1;
-                }
-
-                found = 1;
-                break;
-            }
-        }
-
-        free(entries);
-
         if (!found) {
             fprintf(stderr, "File not found\n");
             free(split_filename);
             return 1;
         }
-    } while (next = strtok(NULL, "/"));
+
+        current.inode_id = entry.inode_id;
+        current.filetype = entry.filetype;
+        if (read_inode(device, superblock, &current.inode, current.inode_id)) {
+            fprintf(stderr, "Failed to read inode\n");
+            free(split_filename);
+            return 1;
+        }
+    }
 
     free(split_filename);
+
+    if (path_resolve(where->fullname, filename, &current.fullname))
+        return 1;
+
     *found_handle = current;
     return 0;
 }
+
+static int lookup_entry(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct FsFile *directory,
+    const char *name,
+    struct DirectoryEntry *entry
+) {
+    if (uses_dir_index(superblock)) {
+        struct DirectoryIndexHeader header;
+        if (read_index_header(device, superblock, directory, &header))
+            return -1;
+
+        uint32_t slot;
+        int found;
+        if (probe_index(device, superblock, directory, &header, name, &slot, entry, &found))
+            return -1;
+
+        return found;
+    }
+
+    struct DirectoryEntry *entries;
+    if (load_contents(device, superblock, directory, (uint8_t**)&entries)) {
+        fprintf(stderr, "Failed to load directory contents\n");
+        return -1;
+    }
+
+    int found = 0;
+    for (size_t i = 0; i < directory->inode.file_size / DIRECTORY_ENTRY_SIZE; ++i) {
+        if (strcmp(entries[i].name, name) == 0) {
+            *entry = entries[i];
+            found = 1;
+            break;
+        }
+    }
+
+    free(entries);
+    return found;
+}
+
+int find_entry(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct FsFile *directory,
+    const char *name,
+    struct DirectoryEntry *entry
+) {
+    const struct DentryCacheEntry *cached = find_dentry(&device->dentries, directory->inode_id, name);
+    if (cached) {
+        if (cached->inode_id == 0)
+            return 0;
+
+        *entry = (struct DirectoryEntry){
+            .inode_id = cached->inode_id,
+            .filetype = cached->filetype,
+            .name_len = strlen(cached->name)
+        };
+        strcpy(entry->name, cached->name);
+        return 1;
+    }
+
+    const int found = lookup_entry(device, superblock, directory, name, entry);
+    if (found != -1) {
+        // The cache is only an optimization, so failing to fill it is not an error
+        insert_dentry(
+            &device->dentries,
+            directory->inode_id,
+            name,
+            found ? entry->inode_id : 0,
+            found ? entry->filetype : 0
+        );
+    }
+
+    return found;
+}
+
+int add_entry(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *directory,
+    const struct DirectoryEntry *entry
+) {
+    invalidate_dentry(&device->dentries, directory->inode_id, entry->name);
+
+    if (uses_dir_index(superblock)) {
+        struct DirectoryIndexHeader header;
+        if (read_index_header(device, superblock, directory, &header))
+            return 1;
+
+        // Rebuilding doubles the table, so the growth is amortized O(1) per entry
+        const size_t n_used = (size_t)header.n_entries + header.n_deleted + 1;
+        if (n_used * 4 > (size_t)header.n_slots * 3) {
+            struct DirectoryEntry *entries;
+            size_t n_entries;
+            if (list_entries(device, superblock, directory, &entries, &n_entries))
+                return 1;
+
+            entries[n_entries++] = *entry;
+            int result = build_index(
+                device,
+                superblock,
+                directory,
+                entries,
+                n_entries,
+                index_slots(2 * n_entries)
+            );
+
+            free(entries);
+            return result;
+        }
+
+        uint32_t slot;
+        int found;
+        struct DirectoryEntry existing;
+        if (probe_index(device, superblock, directory, &header, entry->name, &slot, &existing, &found))
+            return 1;
+
+        if (found) {
+            fprintf(stderr, "The name %s is already used\n", entry->name);
+            return 1;
+        }
+
+        if (existing.name_len == DIRECTORY_TOMBSTONE)
+            --header.n_deleted;
+        ++header.n_entries;
+
+        if (
+            transfer_directory(
+                device,
+                superblock,
+                directory,
+                slot_offset(slot),
+                (uint8_t*)entry,
+                DIRECTORY_ENTRY_SIZE,
+                1
+            ) ||
+            write_index_header(device, superblock, directory, &header)
+        ) {
+            fprintf(stderr, "Failed to write the directory entry\n");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Only the new entry is written, the rest of the directory stays where it is
+    if (
+         write_range(
+             device,
+             superblock,
+             directory,
+             directory->inode.file_size,
+             (const uint8_t*)entry,
+             DIRECTORY_ENTRY_SIZE
+         )
+    ) {
+        fprintf(stderr, "Failed to write the new directory entry\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int remove_entry(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *directory,
+    const char *name,
+    struct DirectoryEntry *removed
+) {
+    invalidate_dentry(&device->dentries, directory->inode_id, name);
+
+    if (uses_dir_index(superblock)) {
+        struct DirectoryIndexHeader header;
+        if (read_index_header(device, superblock, directory, &header))
+            return -1;
+
+        uint32_t slot;
+        int found;
+        if (probe_index(device, superblock, directory, &header, name, &slot, removed, &found))
+            return -1;
+
+        if (!found)
+            return 0;
+
+        const struct DirectoryEntry tombstone = {
+            .inode_id = 0,
+            .name_len = DIRECTORY_TOMBSTONE
+        };
+        --header.n_entries;
+        ++header.n_deleted;
+
+        if (
+            transfer_directory(
+                device,
+                superblock,
+                directory,
+                slot_offset(slot),
+                (uint8_t*)&tombstone,
+                DIRECTORY_ENTRY_SIZE,
+                1
+            ) ||
+            write_index_header(device, superblock, directory, &header)
+        ) {
+            fprintf(stderr, "Failed to remove the directory entry\n");
+            return -1;
+        }
+
+        return 1;
+    }
+
+    struct DirectoryEntry *entries;
+    if (load_contents(device, superblock, directory, (uint8_t**)&entries)) {
+        fprintf(stderr, "Failed to load directory contents\n");
+        return -1;
+    }
+
+    const size_t n_entries = directory->inode.file_size / DIRECTORY_ENTRY_SIZE;
+    int index = -1;
+    for (size_t i = 0; i < n_entries; ++i) {
+        if (strcmp(entries[i].name, name) == 0) {
+            *removed = entries[i];
+            index = i;
+            break;
+        }
+    }
+
+    if (index == -1) {
+        free(entries);
+        return 0;
+    }
+
+    // The last entry fills the hole, so only one entry is rewritten before the directory is cut
+    const size_t last = n_entries - 1;
+    if (
+        (
+            (size_t)index != last &&
+            write_range(
+                device,
+                superblock,
+                directory,
+                index * DIRECTORY_ENTRY_SIZE,
+                (const uint8_t*)(entries + last),
+                DIRECTORY_ENTRY_SIZE
+            )
+        ) ||
+        truncate_file(device, superblock, directory, last * DIRECTORY_ENTRY_SIZE)
+    ) {
+        fprintf(stderr, "Failed to write the directory contents\n");
+        free(entries);
+        return -1;
+    }
+
+    free(entries);
+    return 1;
+}
+
+int list_entries(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct FsFile *directory,
+    struct DirectoryEntry **entries,
+    size_t *n_entries
+) {
+    if (load_contents(device, superblock, directory, (uint8_t**)entries)) {
+        fprintf(stderr, "Failed to load directory contents\n");
+        return 1;
+    }
+
+    const size_t n_slots = directory->inode.file_size / DIRECTORY_ENTRY_SIZE;
+    if (!uses_dir_index(superblock)) {
+        *n_entries = n_slots;
+        return 0;
+    }
+
+    // Packing the used slots to the front, the first slot is the header
+    *n_entries = 0;
+    for (size_t i = 1; i < n_slots; ++i) {
+        if ((*entries)[i].inode_id != 0)
+            (*entries)[(*n_entries)++] = (*entries)[i];
+    }
+
+    return 0;
+}
+
+int init_directory(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *directory,
+    const struct DirectoryEntry *entries,
+    const size_t n_entries
+) {
+    // The inode id may have belonged to a removed directory, whose . and .. are still cached
+    for (size_t i = 0; i < n_entries; ++i)
+        invalidate_dentry(&device->dentries, directory->inode_id, entries[i].name);
+
+    if (uses_dir_index(superblock))
+        return build_index(device, superblock, directory, entries, n_entries, index_slots(n_entries));
+
+    if (
+         write_contents(
+             device,
+             superblock,
+             directory,
+             (const uint8_t*)entries,
+             n_entries * DIRECTORY_ENTRY_SIZE
+         )
+    ) {
+        fprintf(stderr, "Failed to write the directory contents\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -3,15 +3,59 @@
 
 #include <stdio.h>
 
+#include "directory_entry.h"
 #include "fs_file.h"
 #include "superblock.h"
 
 int find_file(
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     const struct FsFile *where,
     const char *filename,
     struct FsFile *found_handle
 );
 
+// Returns 1 if the entry was found, 0 if it was not and -1 on failure
+int find_entry(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct FsFile *directory,
+    const char *name,
+    struct DirectoryEntry *entry
+);
+
+// The caller checks that the name is not used yet and writes the directory inode afterwards
+int add_entry(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *directory,
+    const struct DirectoryEntry *entry
+);
+
+// Returns 1 if the entry was removed, 0 if it was not found and -1 on failure
+int remove_entry(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *directory,
+    const char *name,
+    struct DirectoryEntry *removed
+);
+
+int list_entries(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct FsFile *directory,
+    struct DirectoryEntry **entries,
+    size_t *n_entries
+);
+
+// Writes the contents of a new directory
+int init_directory(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *directory,
+    const struct DirectoryEntry *entries,
+    const size_t n_entries
+);
+
 #endif
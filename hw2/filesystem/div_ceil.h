@@ -1,3 +1,3 @@
 #ifndef DIV_CEIL
-#define DIV_CEIL(x, y) x / y + (x % y != 0)
+#define DIV_CEIL(x, y) ((x) / (y) + ((x) % (y) != 0))
 #endif
@@ -0,0 +1,76 @@
+#include "extent_map.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void clear_extent_map(struct ExtentMap *map) {
+    free(map->extents);
+    free(map->firsts);
+    *map = (struct ExtentMap){0};
+}
+
+int extent_map_matches(const struct ExtentMap *map, const uint32_t *blocks) {
+    return map->extents && memcmp(map->blocks, blocks, sizeof(map->blocks)) == 0;
+}
+
+int update_extent_map(
+     struct ExtentMap *map,
+     const uint32_t *blocks,
+     const size_t first,
+     const struct Extent *extents,
+     const size_t n_extents
+) {
+    if (first > map->n_extents) {
+        clear_extent_map(map);
+        return 1;
+    }
+
+    if (first + n_extents > map->capacity) {
+        size_t capacity = map->capacity > 0 ? map->capacity : 64;
+        while (capacity < first + n_extents)
+            capacity *= 2;
+
+        struct Extent *grown_extents = realloc(map->extents, capacity * sizeof(struct Extent));
+        if (grown_extents)
+            map->extents = grown_extents;
+        size_t *grown_firsts = realloc(map->firsts, capacity * sizeof(size_t));
+        if (grown_firsts)
+            map->firsts = grown_firsts;
+
+        if (!grown_extents || !grown_firsts) {
+            fprintf(stderr, "Failed to allocate memory for the extent map\n");
+            clear_extent_map(map);
+            return 1;
+        }
+        map->capacity = capacity;
+    }
+
+    memcpy(map->extents + first, extents, n_extents * sizeof(struct Extent));
+    for (size_t i = first; i < first + n_extents; ++i)
+        map->firsts[i] = i > 0 ? map->firsts[i - 1] + map->extents[i - 1].length : 0;
+
+    memcpy(map->blocks, blocks, sizeof(map->blocks));
+    map->n_extents = first + n_extents;
+    return 0;
+}
+
+size_t find_extent(const struct ExtentMap *map, const size_t index) {
+    if (map->n_extents == 0)
+        return 0;
+
+    const struct Extent *last = map->extents + map->n_extents - 1;
+    if (index >= map->firsts[map->n_extents - 1] + last->length)
+        return map->n_extents;
+
+    // The last extent that starts at or before the index
+    size_t low = 0, high = map->n_extents - 1;
+    while (low < high) {
+        const size_t middle = low + (high - low + 1) / 2;
+        if (map->firsts[middle] <= index)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    return low;
+}
@@ -0,0 +1,39 @@
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "constants.h"
+
+// A run of length blocks starting at the block #start
+struct Extent {
+    uint32_t start;
+    uint32_t length;
+};
+
+// Extents of the last file whose extents are in the leaf blocks, so that mapping its blocks doesn't read them again
+struct ExtentMap {
+    uint32_t      blocks[INODE_BLOCK_COUNT]; // the extent header of the inode they were loaded for
+    struct Extent *extents;                  // NULL if nothing is loaded
+    size_t        *firsts;                   // the first block of the file in every extent
+    size_t        n_extents, capacity;
+};
+
+void clear_extent_map(struct ExtentMap *map);
+
+int extent_map_matches(const struct ExtentMap *map, const uint32_t *blocks);
+
+// Replaces the extents from the first-th one on and takes the new header, the map is cleared on failure
+int update_extent_map(
+    struct ExtentMap *map,
+    const uint32_t *blocks,
+    const size_t first,
+    const struct Extent *extents,
+    const size_t n_extents
+);
+
+// Returns the extent that holds the index-th block of the file, or n_extents if the file is shorter
+size_t find_extent(const struct ExtentMap *map, const size_t index);
+
+#endif
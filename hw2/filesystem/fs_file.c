@@ -5,84 +5,337 @@
 
 #include "constants.h"
 #include "block_ops.h"
+#include "directory_ops.h"
 #include "div_ceil.h"
 
-int load_contents(
-     FILE *file,
+int read_range(
+     struct Device *device,
      const struct Superblock *superblock,
      const struct FsFile *fsfile,
-     uint8_t **ptr
+     const size_t offset,
+     const size_t len,
+     uint8_t *buf,
+     size_t *read_len
 ) {
-    uint32_t *block_ids;
-    size_t n_block_ids;
-    if (get_block_ids(file, superblock, &fsfile->inode, &block_ids, &n_block_ids)) {
-        fprintf(stderr, "Failed to get block ids in load_contents()\n");
-        return 1;
+    const size_t block_size = superblock->block_size;
+
+    *read_len = 0;
+    if (offset >= fsfile->inode.file_size)
+        return 0;
+    const size_t available = fsfile->inode.file_size - offset;
+    const size_t total = len < available ? len : available;
+
+    uint32_t block_ids[RANGE_BLOCKS];
+    size_t done = 0;
+    while (done < total) {
+        const size_t position = offset + done;
+        const size_t in_block = position % block_size;
+
+        size_t n_blocks = DIV_CEIL(in_block + (total - done), block_size);
+        if (n_blocks > RANGE_BLOCKS)
+            n_blocks = RANGE_BLOCKS;
+
+        if (get_block_range(device, superblock, &fsfile->inode, position / block_size, n_blocks, block_ids)) {
+            fprintf(stderr, "Failed to map the blocks of the range\n");
+            return 1;
+        }
+
+        const size_t part = total - done < n_blocks * block_size - in_block ? total - done : n_blocks * block_size - in_block;
+
+        // An unaligned head is read on its own, the whole blocks after it go in one call
+        size_t head = 0;
+        if (in_block != 0) {
+            head = part < block_size - in_block ? part : block_size - in_block;
+            const size_t head_offset = (block_ids[0] - 1) * block_size + in_block;
+            if (read_bytes(device, superblock, head_offset, buf + done, head)) {
+                fprintf(stderr, "Failed to read the file's blocks\n");
+                return 1;
+            }
+        }
+
+        if (
+            part > head &&
+            read_blocks(
+                device,
+                superblock,
+                block_ids + (in_block != 0),
+                n_blocks - (in_block != 0),
+                buf + done + head,
+                part - head
+            )
+        ) {
+            fprintf(stderr, "Failed to read the file's blocks\n");
+            return 1;
+        }
+
+        done += part;
     }
 
+    *read_len = total;
+    return 0;
+}
+
+int load_contents(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct FsFile *fsfile,
+     uint8_t **ptr
+) {
     *ptr = malloc(fsfile->inode.file_size);
-    if (!*ptr) {
+    if (!*ptr && fsfile->inode.file_size != 0) {
         fprintf(stderr, "Failed to allocate memory for ptr in load_contents()\n");
-        free(block_ids);
         return 1;
     }
 
-    if (read_blocks(file, superblock, block_ids, n_block_ids, *ptr, fsfile->inode.file_size)) {
-        fprintf(stderr, "Failed to read the file's blocks\n");
-        free(block_ids);
+    size_t read_len;
+    if (read_range(device, superblock, fsfile, 0, fsfile->inode.file_size, *ptr, &read_len)) {
+        fprintf(stderr, "Failed to read the file's contents\n");
         free(*ptr);
         return 1;
     }
 
-    free(block_ids);
     return 0;
 }
 
-int write_contents(
-     FILE *file,
+// Overwrites len bytes at offset, the range has to be within the blocks that are already mapped
+static int write_mapped_range(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     const size_t offset,
+     const uint8_t *data,
+     const size_t len
+) {
+    const size_t block_size = superblock->block_size;
+
+    uint32_t block_ids[RANGE_BLOCKS];
+    size_t done = 0;
+    while (done < len) {
+        const size_t position = offset + done;
+        const size_t in_block = position % block_size;
+
+        size_t n_blocks = DIV_CEIL(in_block + (len - done), block_size);
+        if (n_blocks > RANGE_BLOCKS)
+            n_blocks = RANGE_BLOCKS;
+
+        if (get_block_range(device, superblock, inode, position / block_size, n_blocks, block_ids)) {
+            fprintf(stderr, "Failed to map the blocks of the range\n");
+            return 1;
+        }
+
+        const size_t part = len - done < n_blocks * block_size - in_block ? len - done : n_blocks * block_size - in_block;
+
+        // Partial blocks at either end keep the rest of their contents, the whole ones in between go in one call
+        size_t head = 0;
+        if (in_block != 0 || part < block_size) {
+            head = part < block_size - in_block ? part : block_size - in_block;
+            const size_t head_offset = (block_ids[0] - 1) * block_size + in_block;
+            if (write_bytes(device, superblock, head_offset, data + done, head)) {
+                fprintf(stderr, "Failed to write the file's blocks\n");
+                return 1;
+            }
+        }
+
+        const size_t first_whole = head != 0;
+        const size_t n_whole = (part - head) / block_size;
+        if (
+            n_whole > 0 &&
+            write_blocks(
+                device,
+                superblock,
+                block_ids + first_whole,
+                n_whole,
+                data + done + head,
+                n_whole * block_size
+            )
+        ) {
+            fprintf(stderr, "Failed to write the file's blocks\n");
+            return 1;
+        }
+
+        const size_t tail = part - head - n_whole * block_size;
+        if (tail > 0) {
+            const size_t tail_offset = (block_ids[first_whole + n_whole] - 1) * block_size;
+            if (write_bytes(device, superblock, tail_offset, data + done + part - tail, tail)) {
+                fprintf(stderr, "Failed to write the file's blocks\n");
+                return 1;
+            }
+        }
+
+        done += part;
+    }
+
+    return 0;
+}
+
+// Zero fills len bytes at offset, which are past the old end of the file and may hold stale data
+static int zero_range(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     const size_t offset,
+     const size_t len
+) {
+    const size_t buffer_size = (size_t)RANGE_BLOCKS * superblock->block_size;
+    uint8_t *zeroed = calloc(len < buffer_size ? len : buffer_size, sizeof(uint8_t));
+    if (!zeroed) {
+        fprintf(stderr, "Failed to initialize zeroed memory\n");
+        return 1;
+    }
+
+    for (size_t done = 0; done < len;) {
+        const size_t part = len - done < buffer_size ? len - done : buffer_size;
+        if (write_mapped_range(device, superblock, inode, offset + done, zeroed, part)) {
+            free(zeroed);
+            return 1;
+        }
+
+        done += part;
+    }
+
+    free(zeroed);
+    return 0;
+}
+
+// Maps the blocks between the old and the new end of the file, the contents of the new part are left as they are
+static int grow_file(
+     struct Device *device,
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     const uint8_t *ptr,
-     const size_t ptr_size
+     const size_t new_size
 ) {
-    if (clear_block_ids(file, superblock, &fsfile->inode)) {
-        fprintf(stderr, "Failed to clear block ids\n");
+    if (new_size > UINT32_MAX) {
+        fprintf(stderr, "The file is too large\n");
         return 1;
     }
 
-    const size_t ptr_blocks = DIV_CEIL(ptr_size * sizeof(uint8_t), superblock->block_size);
-    uint32_t *block_ids = calloc(ptr_blocks, superblock->block_size);
-    if (!block_ids) {
-        fprintf(stderr, "Failed to allocate memory for block_ids\n");
+    const size_t old_blocks = DIV_CEIL((size_t)fsfile->inode.file_size, superblock->block_size);
+    const size_t new_blocks = DIV_CEIL(new_size, superblock->block_size);
+    if (new_blocks > max_file_blocks(superblock)) {
+        fprintf(stderr, "The file is too large\n");
         return 1;
     }
 
-    if (get_unused_blocks(superblock, block_ids, ptr_blocks)) {
-        fprintf(stderr, "Failed to get unused blocks\n");
+    if (new_blocks > old_blocks) {
+        const size_t n_new = new_blocks - old_blocks;
+        uint32_t *block_ids = malloc(n_new * sizeof(uint32_t));
+        if (!block_ids) {
+            fprintf(stderr, "Failed to allocate memory for block_ids\n");
+            return 1;
+        }
+
+        if (get_unused_blocks(superblock, block_ids, n_new)) {
+            fprintf(stderr, "Failed to get unused blocks\n");
+            free(block_ids);
+            return 1;
+        }
+
+        if (append_block_ids(device, superblock, &fsfile->inode, old_blocks, block_ids, n_new)) {
+            fprintf(stderr, "Failed to set block ids\n");
+            free(block_ids);
+            return 1;
+        }
+
         free(block_ids);
+    }
+
+    fsfile->inode.file_size = new_size;
+    return 0;
+}
+
+int write_range(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     const size_t offset,
+     const uint8_t *data,
+     const size_t len
+) {
+    if (len == 0)
+        return 0;
+
+    const size_t old_size = fsfile->inode.file_size;
+    if (offset > SIZE_MAX - len) {
+        fprintf(stderr, "The file is too large\n");
         return 1;
     }
 
-    if (set_block_ids(file, superblock, &fsfile->inode, block_ids, ptr_blocks)) {
-        fprintf(stderr, "Failed to set block ids\n");
-        free(block_ids);
+    if (offset + len > old_size) {
+        if (grow_file(device, superblock, fsfile, offset + len))
+            return 1;
+
+        // A gap between the old end and the range reads as zeros
+        if (offset > old_size && zero_range(device, superblock, &fsfile->inode, old_size, offset - old_size)) {
+            fprintf(stderr, "Failed to zero fill the gap\n");
+            return 1;
+        }
+    }
+
+    if (write_mapped_range(device, superblock, &fsfile->inode, offset, data, len)) {
+        fprintf(stderr, "Failed to write the range\n");
         return 1;
     }
 
-    if (write_blocks(file, superblock, block_ids, ptr_blocks, ptr, ptr_size)) {
-        fprintf(stderr, "Failed to write file contents\n");
-        free(block_ids);
+    return 0;
+}
+
+int truncate_file(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     const size_t new_size
+) {
+    const size_t old_size = fsfile->inode.file_size;
+    if (new_size > old_size) {
+        if (
+            grow_file(device, superblock, fsfile, new_size) ||
+            zero_range(device, superblock, &fsfile->inode, old_size, new_size - old_size)
+        ) {
+            fprintf(stderr, "Failed to extend the file\n");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (
+         truncate_block_ids(
+             device,
+             superblock,
+             &fsfile->inode,
+             DIV_CEIL(old_size, superblock->block_size),
+             DIV_CEIL(new_size, superblock->block_size)
+         )
+    ) {
+        fprintf(stderr, "Failed to release the blocks past the new end\n");
         return 1;
     }
 
-    fsfile->inode.file_size = ptr_size;
+    fsfile->inode.file_size = new_size;
+    return 0;
+}
+
+// The blocks that are already mapped are overwritten in place, only the difference in size is allocated or released
+int write_contents(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     const uint8_t *ptr,
+     const size_t ptr_size
+) {
+    if (
+        write_range(device, superblock, fsfile, 0, ptr, ptr_size) ||
+        truncate_file(device, superblock, fsfile, ptr_size)
+    ) {
+        fprintf(stderr, "Failed to write file contents\n");
+        return 1;
+    }
 
-    free(block_ids);
     return 0;
 }
 
 int clear_file(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      struct FsFile *fsfile
 ) {
@@ -92,7 +345,7 @@ int clear_file(
         return 1;
     }
 
-    if (write_contents(file, superblock, fsfile, zeroed, fsfile->inode.file_size)) {
+    if (write_contents(device, superblock, fsfile, zeroed, fsfile->inode.file_size)) {
         fprintf(stderr, "Failed to zero out memory\n");
         free(zeroed);
         return 1;
@@ -100,12 +353,12 @@ int clear_file(
 
     free(zeroed);
 
-    if (clear_block_ids(file, superblock, &fsfile->inode)) {
+    if (clear_block_ids(device, superblock, &fsfile->inode)) {
         fprintf(stderr, "Failed to clear block ids\n");
         return 1;
     }
 
-    if (clear_inode(file, superblock, fsfile->inode_id)) {
+    if (clear_inode(device, superblock, fsfile->inode_id)) {
         fprintf(stderr, "Failed to clear inode\n");
         return 1;
     }
@@ -114,7 +367,7 @@ int clear_file(
 }
 
 int remove_file(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      struct FsFile *directory,
      const char *filename
@@ -124,50 +377,20 @@ int remove_file(
         return 1;
     }
 
-    struct DirectoryEntry *entries, entry;
-    if (load_contents(file, superblock, directory, (uint8_t**)&entries)) {
-        fprintf(stderr, "Failed to load directory contents\n");
+    struct DirectoryEntry entry;
+    const int removed = remove_entry(device, superblock, directory, filename, &entry);
+    if (removed == -1) {
+        fprintf(stderr, "Failed to remove directory entry\n");
         return 1;
-    }
-
-    const size_t n_entries = directory->inode.file_size / DIRECTORY_ENTRY_SIZE;
-    int index = -1;
-    for (size_t i = 0; i < n_entries; ++i) {
-        if (strcmp(entries[i].name, filename) == 0) {
-            entry = entries[i];
-            index = i;
-            break;
-        }
-    }
-
-    if (index == -1) {
+    } else if (!removed) {
         fprintf(stderr, "File not found in current directory\n");
-        free(entries);
         return 1;
     }
 
-    entries[index] = entries[n_entries - 1];
-
-    if (
-         write_contents(
-             file,
-             superblock,
-             directory,
-             (const uint8_t*)entries,
-             (n_entries - 1) * DIRECTORY_ENTRY_SIZE
-         )
-    ) {
-        fprintf(stderr, "Failed to remove directory entry\n");
-        free(entries);
-        return 1;
-    }
-
-    free(entries);
-
     if (entry.filetype == FILETYPE_DIRECTORY)
         --directory->inode.links_count; // ..
 
-    if (write_inode(file, superblock, &directory->inode, directory->inode_id)) {
+    if (write_inode(device, superblock, &directory->inode, directory->inode_id)) {
         fprintf(stderr, "Failed to write directory inode\n");
         return 1;
     }
@@ -176,23 +399,24 @@ int remove_file(
         .inode_id = entry.inode_id,
         .filetype = entry.filetype
     };
-    if (read_inode(file, superblock, &found_file.inode, found_file.inode_id)) {
+    if (read_inode(device, superblock, &found_file.inode, found_file.inode_id)) {
         fprintf(stderr, "Failed to read inode\n");
         return 1;
     }
     --found_file.inode.links_count; // removed from parent directory
 
     if (found_file.filetype == FILETYPE_DIRECTORY) {
-        if (load_contents(file, superblock, &found_file, (uint8_t**)&entries)) {
+        struct DirectoryEntry *entries;
+        size_t dir_len;
+        if (list_entries(device, superblock, &found_file, &entries, &dir_len)) {
             fprintf(stderr, "Failed to load directory contents\n");
             return 1;
         }
 
-        const size_t dir_len = found_file.inode.file_size / DIRECTORY_ENTRY_SIZE;
         for (size_t i = 0; i < dir_len; ++i) {
             if (strcmp(entries[i].name, ".") != 0 && strcmp(entries[i].name, "..") != 0) {
                 printf("Removing nested file %s\n", entries[i].name);
-                if (remove_file(file, superblock, &found_file, entries[i].name)) {
+                if (remove_file(device, superblock, &found_file, entries[i].name)) {
                     fprintf(stderr, "Failed to remove nested directory\n");
                     free(entries);
                     return 1;
@@ -206,13 +430,13 @@ int remove_file(
 
     if (found_file.inode.links_count == 0) {
         printf("No more links to the file, clearing\n");
-        if (clear_file(file, superblock, &found_file)) {
+        if (clear_file(device, superblock, &found_file)) {
             fprintf(stderr, "Failed to clear file\n");
             return 1;
         }
     } else {
         printf("%d links left\n", found_file.inode.links_count);
-        if (write_inode(file, superblock, &found_file.inode, found_file.inode_id)) {
+        if (write_inode(device, superblock, &found_file.inode, found_file.inode_id)) {
             fprintf(stderr, "Failed to write inode\n");
             return 1;
         }
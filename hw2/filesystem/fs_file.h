@@ -8,6 +8,8 @@
 #include "inode.h"
 #include "superblock.h"
 
+#define RANGE_BLOCKS 64 // blocks mapped at once by read_range() and write_range()
+
 struct FsFile {
     struct Inode inode;
     uint32_t     inode_id;
@@ -15,15 +17,44 @@ struct FsFile {
     char         *fullname;
 };
 
+// Reads up to len bytes at offset, *read_len is less than len only at the end of the file
+int read_range(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct FsFile *fsfile,
+    const size_t offset,
+    const size_t len,
+    uint8_t *buf,
+    size_t *read_len
+);
+
 int load_contents(
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     const struct FsFile *fsfile,
     uint8_t **ptr
 );
 
+// Overwrites len bytes at offset, the blocks past the end of the file are allocated as needed
+int write_range(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *fsfile,
+    const size_t offset,
+    const uint8_t *data,
+    const size_t len
+);
+
+// Cuts the file or extends it with zeros
+int truncate_file(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct FsFile *fsfile,
+    const size_t new_size
+);
+
 int write_contents(
-    FILE *file,
+    struct Device *device,
     struct Superblock *superblock,
     struct FsFile *fsfile,
     const uint8_t *ptr,
@@ -31,13 +62,13 @@ int write_contents(
 );
 
 int clear_file(
-    FILE *file,
+    struct Device *device,
     struct Superblock *superblock,
     struct FsFile *fsfile
 );
 
 int remove_file(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      struct FsFile *directory,
      const char *filename
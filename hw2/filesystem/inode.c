@@ -3,9 +3,9 @@
 #include <string.h>
 
 #include "block_ops.h"
+#include "div_ceil.h"
 
-static int seek_to_inode(
-     FILE *file,
+static int check_inode_id(
      const struct Superblock *superblock,
      const uint32_t inode_id
 ) {
@@ -14,28 +14,24 @@ static int seek_to_inode(
         return 1;
     }
 
-    if (fseek(file, BOOT_OFFSET + superblock->size, SEEK_SET)){
-        fprintf(stderr, "Failed to seek to the beginning of the inode table\n");
-        return 1;
-    }
-    if (fseek(file, (inode_id - 1) * INODE_SIZE, SEEK_CUR)) {
-        fprintf(stderr, "Failed to seek to the inode\n");
-        return 1;
-    }
-
     return 0;
 }
 
+// The inode table starts at the block #1, so it goes through the block cache
+static size_t inode_offset(const uint32_t inode_id) {
+    return (inode_id - 1) * INODE_SIZE;
+}
+
 int write_inode(
-     FILE *file,
+     struct Device *device,
      const struct Superblock *superblock,
      const struct Inode *inode,
      const uint32_t inode_id
 ) {
-    if (seek_to_inode(file, superblock, inode_id))
+    if (check_inode_id(superblock, inode_id))
         return 1;
 
-    if (fwrite(inode, sizeof(*inode), 1, file) != 1) {
+    if (write_bytes(device, superblock, inode_offset(inode_id), (const uint8_t*)inode, sizeof(*inode))) {
         fprintf(stderr, "Failed to write the inode\n");
         return 1;
     }
@@ -44,15 +40,15 @@ int write_inode(
 }
 
 int read_inode (
-     FILE *file,
+     struct Device *device,
      const struct Superblock *superblock,
      struct Inode *inode,
      const uint32_t inode_id
 ) {
-    if (seek_to_inode(file, superblock, inode_id))
+    if (check_inode_id(superblock, inode_id))
         return 1;
 
-    if (fread(inode, sizeof(*inode), 1, file) != 1) {
+    if (read_bytes(device, superblock, inode_offset(inode_id), (uint8_t*)inode, sizeof(*inode))) {
         fprintf(stderr, "Failed to read the inode\n");
         return 1;
     }
@@ -61,214 +57,530 @@ int read_inode (
 }
 
 int clear_inode(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      const uint32_t inode_id
 ) {
-    if (inode_id == 0 || inode_id > superblock->total_inodes) {
-        fprintf(stderr, "Invalid inode id\n");
+    if (check_inode_id(superblock, inode_id))
         return 1;
-    }
 
     if (set_inode_use(superblock, inode_id, 0)) {
         fprintf(stderr, "Failed to unset inode use\n");
         return 1;
     }
 
-    if (seek_to_inode(file, superblock, inode_id))
+    const struct Inode zeroed = {0};
+    if (write_inode(device, superblock, &zeroed, inode_id)) {
+        fprintf(stderr, "Failed to zero out the inode\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int uses_extents(const struct Superblock *superblock) {
+    return (superblock->features & FEATURE_EXTENTS) != 0;
+}
+
+static size_t extents_per_leaf(const struct Superblock *superblock) {
+    return superblock->block_size / sizeof(struct Extent);
+}
+
+static size_t ids_per_block(const struct Superblock *superblock) {
+    return superblock->block_size / sizeof(uint32_t);
+}
+
+static int check_extent_header(
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     size_t *n_leaves,
+     size_t *n_index
+) {
+    const size_t count = inode->blocks[EXTENT_COUNT];
+    const uint32_t depth = inode->blocks[EXTENT_DEPTH];
+
+    *n_leaves = depth > 0 ? DIV_CEIL(count, extents_per_leaf(superblock)) : 0;
+    *n_index  = depth > 1 ? DIV_CEIL(*n_leaves, ids_per_block(superblock)) : 0;
+
+    if (
+        depth > 2 ||
+        (depth == 0 && count > INODE_EXTENT_COUNT) ||
+        (depth == 1 && *n_leaves > EXTENT_NODE_COUNT) ||
+        (depth == 2 && *n_index > EXTENT_NODE_COUNT)
+    ) {
+        fprintf(stderr, "Invalid extent header\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Collects the ids of the leaf blocks, which are either in the inode or in the index blocks
+static int get_extent_leaves(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     uint32_t **leaves,
+     size_t *n_leaves
+) {
+    size_t n_index;
+    if (check_extent_header(superblock, inode, n_leaves, &n_index))
         return 1;
 
-    uint8_t *zeroed = calloc(INODE_SIZE / sizeof(uint8_t), sizeof(uint8_t));
-    if (!zeroed) {
-        fprintf(stderr, "Failed to initialize zeroed memory\n");
+    *leaves = NULL;
+    if (*n_leaves == 0)
+        return 0;
+
+    *leaves = malloc(*n_leaves * sizeof(uint32_t));
+    if (!*leaves) {
+        fprintf(stderr, "Failed to allocate memory for the extent leaves\n");
         return 1;
     }
 
-    if (fwrite(zeroed, INODE_SIZE, 1, file) != 1) {
-        fprintf(stderr, "Failed to zero out the inode\n");
+    if (n_index == 0) {
+        memcpy(*leaves, inode->blocks + EXTENT_FIRST, *n_leaves * sizeof(uint32_t));
+    } else if (
+         read_blocks(
+             device,
+             superblock,
+             inode->blocks + EXTENT_FIRST,
+             n_index,
+             (uint8_t*)*leaves,
+             *n_leaves * sizeof(uint32_t)
+         )
+    ) {
+        fprintf(stderr, "Failed to read the extent index\n");
+        free(*leaves);
         return 1;
     }
 
     return 0;
 }
 
-static int get_indirect_block_ids(
-     FILE *file,
+static int check_extent(const struct Superblock *superblock, const struct Extent *extent) {
+    if (
+        extent->start == 0 ||
+        extent->start > superblock->total_blocks ||
+        extent->length == 0 ||
+        extent->length > superblock->total_blocks - extent->start + 1
+    ) {
+        fprintf(stderr, "Invalid extent\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int get_extents(
+     struct Device *device,
      const struct Superblock *superblock,
-     const uint32_t indirect_block_id,
-     uint32_t *block_ids, // already malloc'ed
-     size_t *n_block_ids
+     const struct Inode *inode,
+     struct Extent **extents,
+     size_t *n_extents
 ) {
-    if (indirect_block_id == 0 || indirect_block_id > superblock->total_blocks) {
-        fprintf(stderr, "Invalid block id\n");
+    const size_t count = inode->blocks[EXTENT_COUNT];
+
+    *extents = NULL;
+    *n_extents = 0;
+
+    uint32_t *leaves;
+    size_t n_leaves;
+    if (get_extent_leaves(device, superblock, inode, &leaves, &n_leaves))
+        return 1;
+
+    if (count == 0)
+        return 0;
+
+    *extents = malloc(count * sizeof(struct Extent));
+    if (!*extents) {
+        fprintf(stderr, "Failed to allocate memory for extents\n");
+        free(leaves);
         return 1;
     }
 
-    if (read_blocks(file, superblock, &indirect_block_id, 1, (uint8_t*)block_ids, superblock->block_size)) {
-        fprintf(stderr, "Failed to read indirect blocks\n");
+    if (n_leaves == 0) {
+        memcpy(*extents, inode->blocks + EXTENT_FIRST, count * sizeof(struct Extent));
+    } else if (
+         read_blocks(
+             device,
+             superblock,
+             leaves,
+             n_leaves,
+             (uint8_t*)*extents,
+             count * sizeof(struct Extent)
+         )
+    ) {
+        fprintf(stderr, "Failed to read the extent leaves\n");
+        free(leaves);
+        free(*extents);
         return 1;
     }
 
-    *n_block_ids = 0;
-    for (size_t i = 0; i < superblock->block_size / sizeof(uint32_t); ++i) {
-        if (block_ids[i] != 0) {
-            int block_use = get_block_use(superblock, block_ids[i]);
-            if (block_use == -1) {
-                fprintf(stderr, "Failed to get block use\n");
-                return 1;
-            }
+    free(leaves);
 
-            if (block_use)
-                ++(*n_block_ids);
-            else
-                break;
-        } else {
-            break;
+    for (size_t i = 0; i < count; ++i) {
+        if (check_extent(superblock, *extents + i)) {
+            free(*extents);
+            return 1;
         }
     }
 
+    *n_extents = count;
     return 0;
 }
 
-static int finalize_get_all_block_ids(
-     uint32_t **block_ids,
-     size_t *n_block_ids,
-     const size_t offset
+// Copies the ids of the blocks [first, first + n) of the file starting with the i-th extent, returns how many were mapped
+static size_t map_extent_blocks(
+     const struct Extent *extents,
+     const size_t n_extents,
+     size_t i,
+     size_t extent_first,
+     const size_t first,
+     const size_t n,
+     uint32_t *block_ids
 ) {
-    uint32_t *reallocated = realloc(*block_ids, offset * sizeof(uint32_t));
-    if (!reallocated) {
-        fprintf(stderr, "Failed to resize block_ids\n");
-        free(*block_ids);
-        return 1;
+    size_t done = 0;
+    for (; i < n_extents && done < n; ++i) {
+        const size_t extent_end = extent_first + extents[i].length;
+        for (; done < n && first + done < extent_end; ++done)
+            block_ids[done] = extents[i].start + (first + done - extent_first);
+
+        extent_first = extent_end;
     }
 
-    *block_ids = reallocated;
-    *n_block_ids = offset;
-    return 0;
+    return done;
+}
+
+static int load_extent_map(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode
+) {
+    struct Extent *extents;
+    size_t n_extents;
+    if (get_extents(device, superblock, inode, &extents, &n_extents))
+        return 1;
+
+    const int result = update_extent_map(&device->extents, inode->blocks, 0, extents, n_extents);
+    free(extents);
+    return result;
 }
 
-int get_block_ids(
-     FILE *file,
+// The extents in the leaf blocks are read once and then searched in the extent map of the device
+static int get_extent_block_range(
+     struct Device *device,
      const struct Superblock *superblock,
      const struct Inode *inode,
-     uint32_t **block_ids,
-     size_t *n_block_ids
+     const size_t first,
+     const size_t n,
+     uint32_t *block_ids
 ) {
-    const size_t indirect_len = superblock->block_size / sizeof(uint32_t);
+    size_t done = 0;
+    if (inode->blocks[EXTENT_DEPTH] == 0) {
+        struct Extent *extents;
+        size_t n_extents;
+        if (get_extents(device, superblock, inode, &extents, &n_extents))
+            return 1;
 
-    *block_ids = calloc(
-        indirect_len * indirect_len + indirect_len + INDIRECT_BLOCK,
-        sizeof(uint32_t)
-    ); // maximum possible block ids
-    if (!(*block_ids)) {
-        fprintf(stderr, "Failed to allocate memory for block_ids\n");
+        done = map_extent_blocks(extents, n_extents, 0, 0, first, n, block_ids);
+        free(extents);
+    } else {
+        const struct ExtentMap *map = &device->extents;
+        if (!extent_map_matches(map, inode->blocks) && load_extent_map(device, superblock, inode))
+            return 1;
+
+        const size_t i = find_extent(map, first);
+        if (i < map->n_extents)
+            done = map_extent_blocks(map->extents, map->n_extents, i, map->firsts[i], first, n, block_ids);
+    }
+
+    if (done < n) {
+        fprintf(stderr, "Block #%zu of the file is not mapped\n", first + done);
         return 1;
     }
 
-    // Direct access
-    size_t offset = 0;
-    for (size_t i = 0; i < INDIRECT_BLOCK; ++i) {
-        if (inode->blocks[i] != 0) {
-            int block_use = get_block_use(superblock, inode->blocks[i]);
-            if (block_use == -1) {
-                fprintf(stderr, "Failed to get block use\n");
-                free(*block_ids);
-                return 1;
-            }
+    return 0;
+}
 
-            if (block_use) {
-                *(*block_ids + offset) = inode->blocks[i];
-                ++offset;
-            } else {
-                break;
-            }
-        } else {
-            break;
+// Frees the leaf and index blocks, the extents themselves are left untouched
+static int release_extent_nodes(
+     struct Device *device,
+     struct Superblock *superblock,
+     const struct Inode *inode
+) {
+    uint32_t *leaves;
+    size_t n_leaves, n_index;
+    if (
+        check_extent_header(superblock, inode, &n_leaves, &n_index) ||
+        get_extent_leaves(device, superblock, inode, &leaves, &n_leaves)
+    ) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < n_leaves; ++i) {
+        if (set_block_use(superblock, leaves[i], 0)) {
+            fprintf(stderr, "Failed to unset the extent leaf use\n");
+            free(leaves);
+            return 1;
         }
     }
 
-    if (offset == 0) {
-        *n_block_ids = 0;
+    free(leaves);
+
+    for (size_t i = 0; i < n_index; ++i) {
+        if (set_block_use(superblock, inode->blocks[EXTENT_FIRST + i], 0)) {
+            fprintf(stderr, "Failed to unset the extent index use\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Lays the extents out in the inode, spilling them into leaf and index blocks when they do not fit
+static int store_extents(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     const struct Extent *extents,
+     const size_t n_extents
+) {
+    // The map of this file is about to go stale, and its leaf blocks may go to another file
+    if (extent_map_matches(&device->extents, inode->blocks))
+        clear_extent_map(&device->extents);
+
+    if (release_extent_nodes(device, superblock, inode))
+        return 1;
+
+    memset(inode->blocks, 0, sizeof(inode->blocks));
+    inode->blocks[EXTENT_COUNT] = n_extents;
+
+    if (n_extents <= INODE_EXTENT_COUNT) {
+        memcpy(inode->blocks + EXTENT_FIRST, extents, n_extents * sizeof(struct Extent));
         return 0;
     }
 
-    if (offset < INDIRECT_BLOCK || inode->blocks[INDIRECT_BLOCK] == 0)
-        return finalize_get_all_block_ids(block_ids, n_block_ids, offset);
+    const size_t n_leaves = DIV_CEIL(n_extents, extents_per_leaf(superblock));
+    const size_t n_index = n_leaves > EXTENT_NODE_COUNT ? DIV_CEIL(n_leaves, ids_per_block(superblock)) : 0;
+    if (n_index > EXTENT_NODE_COUNT) {
+        fprintf(stderr, "Too many extents for a single inode\n");
+        return 1;
+    }
+
+    // Leaves come first, then the index blocks
+    uint32_t *nodes = malloc((n_leaves + n_index) * sizeof(uint32_t));
+    if (!nodes) {
+        fprintf(stderr, "Failed to allocate memory for the extent nodes\n");
+        return 1;
+    }
 
+    if (get_unused_blocks(superblock, nodes, n_leaves + n_index)) {
+        fprintf(stderr, "Failed to get unused blocks for the extent nodes\n");
+        free(nodes);
+        return 1;
+    }
+
+    for (size_t i = 0; i < n_leaves + n_index; ++i) {
+        if (set_block_use(superblock, nodes[i], 1)) {
+            fprintf(stderr, "Failed to set the extent node use\n");
+            free(nodes);
+            return 1;
+        }
+    }
 
-    // Indirect access
-    size_t n_indirect_blocks;
     if (
-         get_indirect_block_ids(
-             file,
+         write_blocks(
+             device,
              superblock,
-             inode->blocks[INDIRECT_BLOCK],
-             *block_ids + offset,
-             &n_indirect_blocks
+             nodes,
+             n_leaves,
+             (const uint8_t*)extents,
+             n_extents * sizeof(struct Extent)
          )
     ) {
-        free(*block_ids);
+        fprintf(stderr, "Failed to write the extent leaves\n");
+        free(nodes);
         return 1;
     }
 
-    offset += n_indirect_blocks;
-
-    if (n_indirect_blocks < indirect_len || inode->blocks[DOUBLE_INDIRECT_BLOCK] == 0)
-        return finalize_get_all_block_ids(block_ids, n_block_ids, offset);
-
-    // Double indirect access
-    uint32_t *double_indirect_map = malloc(superblock->block_size);
-    if (!double_indirect_map) {
-        fprintf(stderr, "Failed to allocate memory for double_indirect_map\n");
-        free(*block_ids);
-        return 1;
+    if (n_index == 0) {
+        inode->blocks[EXTENT_DEPTH] = 1;
+        memcpy(inode->blocks + EXTENT_FIRST, nodes, n_leaves * sizeof(uint32_t));
+        free(nodes);
+        update_extent_map(&device->extents, inode->blocks, 0, extents, n_extents);
+        return 0;
     }
 
-    size_t double_indirect_map_len;
     if (
-         get_indirect_block_ids(
-             file,
+         write_blocks(
+             device,
              superblock,
-             inode->blocks[DOUBLE_INDIRECT_BLOCK],
-             double_indirect_map,
-             &double_indirect_map_len
+             nodes + n_leaves,
+             n_index,
+             (const uint8_t*)nodes,
+             n_leaves * sizeof(uint32_t)
          )
     ) {
-        free(double_indirect_map);
-        free(*block_ids);
+        fprintf(stderr, "Failed to write the extent index\n");
+        free(nodes);
         return 1;
     }
 
-    for (size_t i = 0; i < double_indirect_map_len; ++i) {
-        if (*(double_indirect_map + i) == 0)
-            break;
+    inode->blocks[EXTENT_DEPTH] = 2;
+    memcpy(inode->blocks + EXTENT_FIRST, nodes + n_leaves, n_index * sizeof(uint32_t));
+    free(nodes);
+    update_extent_map(&device->extents, inode->blocks, 0, extents, n_extents);
+    return 0;
+}
 
-        size_t n_last_indirect_blocks;
-        if (
-             get_indirect_block_ids(
-                 file,
-                 superblock,
-                 *(double_indirect_map + i),
-                 *block_ids + offset,
-                 &n_last_indirect_blocks
-             )
-        ) {
-            free(double_indirect_map);
-            free(*block_ids);
+static int truncate_extent_block_ids(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     const size_t n_keep
+) {
+    struct Extent *extents;
+    size_t n_extents;
+    if (get_extents(device, superblock, inode, &extents, &n_extents)) {
+        fprintf(stderr, "Failed to get the extents\n");
+        return 1;
+    }
+
+    size_t kept = 0;
+    size_t n_kept_extents = 0;
+    for (size_t i = 0; i < n_extents; ++i) {
+        struct Extent *extent = extents + i;
+        const uint32_t keep = n_keep - kept < extent->length ? n_keep - kept : extent->length;
+        for (uint32_t j = keep; j < extent->length; ++j) {
+            if (set_block_use(superblock, extent->start + j, 0)) {
+                fprintf(stderr, "Failed to unset block use\n");
+                free(extents);
+                return 1;
+            }
+        }
+
+        kept += keep;
+        if (keep > 0) {
+            extent->length = keep;
+            n_kept_extents = i + 1;
+        }
+    }
+
+    const int result = store_extents(device, superblock, inode, extents, n_kept_extents);
+    free(extents);
+    return result;
+}
+
+// Extents are only limited by the fragmentation, so they are not checked in advance
+size_t max_file_blocks(const struct Superblock *superblock) {
+    if (uses_extents(superblock))
+        return SIZE_MAX;
+
+    const size_t indirect_len = superblock->block_size / sizeof(uint32_t);
+    return INDIRECT_BLOCK + indirect_len + indirect_len * indirect_len;
+}
+
+static int read_indirect_entries(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const uint32_t indirect_block_id,
+     const size_t index,
+     const size_t n,
+     uint32_t *entries
+) {
+    if (indirect_block_id == 0 || indirect_block_id > superblock->total_blocks) {
+        fprintf(stderr, "Invalid block id\n");
+        return 1;
+    }
+
+    const size_t offset = (indirect_block_id - 1) * superblock->block_size + index * sizeof(uint32_t);
+    if (read_bytes(device, superblock, offset, (uint8_t*)entries, n * sizeof(uint32_t))) {
+        fprintf(stderr, "Failed to read the indirect block entries\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+* Maps n consecutive blocks of the file starting at the first-th one without building the whole block list,
+* the caller has to keep the range within the file size
+*/
+int get_block_range(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     const size_t first,
+     const size_t n,
+     uint32_t *block_ids
+) {
+    if (uses_extents(superblock))
+        return get_extent_block_range(device, superblock, inode, first, n, block_ids);
+
+    const size_t indirect_len = superblock->block_size / sizeof(uint32_t);
+
+    for (size_t i = 0; i < n;) {
+        const size_t index = first + i;
+        if (index < INDIRECT_BLOCK) {
+            block_ids[i++] = inode->blocks[index];
+            continue;
+        }
+
+        // The rest of the range that is in the same indirect block is read at once
+        uint32_t indirect_block_id;
+        size_t position;
+        if (index < INDIRECT_BLOCK + indirect_len) {
+            indirect_block_id = inode->blocks[INDIRECT_BLOCK];
+            position = index - INDIRECT_BLOCK;
+        } else if (index < max_file_blocks(superblock)) {
+            const size_t double_index = index - INDIRECT_BLOCK - indirect_len;
+            if (
+                read_indirect_entries(
+                    device,
+                    superblock,
+                    inode->blocks[DOUBLE_INDIRECT_BLOCK],
+                    double_index / indirect_len,
+                    1,
+                    &indirect_block_id
+                )
+            ) {
+                return 1;
+            }
+            position = double_index % indirect_len;
+        } else {
+            fprintf(stderr, "Block #%zu of the file is not mapped\n", index);
             return 1;
         }
 
-        offset += n_last_indirect_blocks;
-        if (n_last_indirect_blocks < indirect_len)
-            break;
+        const size_t count = n - i < indirect_len - position ? n - i : indirect_len - position;
+        if (read_indirect_entries(device, superblock, indirect_block_id, position, count, block_ids + i))
+            return 1;
+
+        i += count;
     }
 
-    free(double_indirect_map);
-    return finalize_get_all_block_ids(block_ids, n_block_ids, offset);
+    for (size_t i = 0; i < n; ++i) {
+        if (block_ids[i] == 0 || block_ids[i] > superblock->total_blocks) {
+            fprintf(stderr, "Block #%zu of the file is not mapped\n", first + i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int get_block_id(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     const size_t index,
+     uint32_t *block_id
+) {
+    return get_block_range(device, superblock, inode, index, 1, block_id);
 }
 
 static int allocate_indirect_block(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      uint32_t *where
 ) {
@@ -283,7 +595,7 @@ static int allocate_indirect_block(
         return 1;
     }
 
-    if (write_blocks(file, superblock, &indirect_block_id, 1, (const uint8_t*)zero_fill, superblock->block_size)) {
+    if (write_blocks(device, superblock, &indirect_block_id, 1, (const uint8_t*)zero_fill, superblock->block_size)) {
         fprintf(stderr, "Failed to zero fill the block\n");
         free(zero_fill);
         return 1;
@@ -300,196 +612,450 @@ static int allocate_indirect_block(
     return 0;
 }
 
-static int fill_indirect_block(
-     FILE *file,
+
+static int write_indirect_entry(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const uint32_t indirect_block_id,
+     const size_t index,
+     const uint32_t entry
+) {
+    if (indirect_block_id == 0 || indirect_block_id > superblock->total_blocks) {
+        fprintf(stderr, "Invalid block id\n");
+        return 1;
+    }
+
+    const size_t offset = (indirect_block_id - 1) * superblock->block_size + index * sizeof(uint32_t);
+    if (write_bytes(device, superblock, offset, (const uint8_t*)&entry, sizeof(entry))) {
+        fprintf(stderr, "Failed to write the indirect block entry\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Points the index-th block of the file to block_id, an indirect block is allocated when the file grows into it
+static int set_block_pointer(
+     struct Device *device,
      struct Superblock *superblock,
-     const uint32_t block_id,
-     const uint32_t *data,
-     const size_t n_data,
-     size_t *offset
+     struct Inode *inode,
+     const size_t index,
+     const uint32_t block_id
 ) {
-    const size_t indirect_len = superblock->block_size / sizeof(uint32_t);
-    uint32_t *indirect_data = calloc(indirect_len, sizeof(uint32_t));
-    if (!indirect_data) {
-        fprintf(stderr, "Failed to allocate memory for indirect_data\n");
+    const size_t indirect_len = ids_per_block(superblock);
+
+    if (index < INDIRECT_BLOCK) {
+        inode->blocks[index] = block_id;
+        return 0;
+    }
+
+    if (index < INDIRECT_BLOCK + indirect_len) {
+        if (index == INDIRECT_BLOCK && allocate_indirect_block(device, superblock, &inode->blocks[INDIRECT_BLOCK]))
+            return 1;
+
+        return write_indirect_entry(
+            device,
+            superblock,
+            inode->blocks[INDIRECT_BLOCK],
+            index - INDIRECT_BLOCK,
+            block_id
+        );
+    }
+
+    if (index >= max_file_blocks(superblock)) {
+        fprintf(stderr, "The file is too large for the indirect block mapping\n");
         return 1;
     }
 
-    for (size_t i = 0; i < indirect_len && *offset < n_data; ++i) {
-        if (set_block_use(superblock, data[*offset], 1)) {
-            fprintf(stderr, "Failed to set block use\n");
+    const size_t double_index = index - INDIRECT_BLOCK - indirect_len;
+    if (double_index == 0 && allocate_indirect_block(device, superblock, &inode->blocks[DOUBLE_INDIRECT_BLOCK]))
+        return 1;
+
+    uint32_t indirect_block_id;
+    if (double_index % indirect_len == 0) {
+        if (
+            allocate_indirect_block(device, superblock, &indirect_block_id) ||
+            write_indirect_entry(
+                device,
+                superblock,
+                inode->blocks[DOUBLE_INDIRECT_BLOCK],
+                double_index / indirect_len,
+                indirect_block_id
+            )
+        ) {
             return 1;
         }
+    } else if (
+        read_indirect_entries(
+            device,
+            superblock,
+            inode->blocks[DOUBLE_INDIRECT_BLOCK],
+            double_index / indirect_len,
+            1,
+            &indirect_block_id
+        )
+    ) {
+        return 1;
+    }
 
-        indirect_data[i] = data[(*offset)++];
+    return write_indirect_entry(device, superblock, indirect_block_id, double_index % indirect_len, block_id);
+}
+
+// Returns the id of the i-th leaf block of a file whose extents are not in the inode
+static int get_extent_leaf(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     const size_t i,
+     uint32_t *leaf_id
+) {
+    const size_t per_index = ids_per_block(superblock);
+    if (inode->blocks[EXTENT_DEPTH] == 1) {
+        *leaf_id = inode->blocks[EXTENT_FIRST + i];
+    } else if (
+        read_indirect_entries(
+            device,
+            superblock,
+            inode->blocks[EXTENT_FIRST + i / per_index],
+            i % per_index,
+            1,
+            leaf_id
+        )
+    ) {
+        return 1;
     }
 
-    if (write_blocks(file, superblock, &block_id, 1, (const uint8_t*)indirect_data, superblock->block_size)) {
-        fprintf(stderr, "Failed to write the indirect block\n");
-        free(indirect_data);
+    if (*leaf_id == 0 || *leaf_id > superblock->total_blocks) {
+        fprintf(stderr, "Invalid extent leaf id\n");
         return 1;
     }
 
-    free(indirect_data);
     return 0;
 }
 
-int set_block_ids(
-     FILE *file,
-     struct Superblock *superblock,
-     struct Inode *inode,
-     const uint32_t *block_ids,
-     const size_t n_block_ids
+static int read_extent(
+     struct Device *device,
+     const struct Superblock *superblock,
+     const struct Inode *inode,
+     const size_t index,
+     struct Extent *extent
 ) {
-    size_t offset = 0;
+    const size_t per_leaf = extents_per_leaf(superblock);
+    if (inode->blocks[EXTENT_DEPTH] == 0) {
+        memcpy(extent, (const uint8_t*)(inode->blocks + EXTENT_FIRST) + index * sizeof(struct Extent), sizeof(struct Extent));
+    } else {
+        uint32_t leaf_id;
+        if (get_extent_leaf(device, superblock, inode, index / per_leaf, &leaf_id))
+            return 1;
 
-    // Direct addressing
-    for (size_t i = 0; i < INDIRECT_BLOCK && offset < n_block_ids; ++i) {
-        if (set_block_use(superblock, block_ids[offset], 1)) {
-            fprintf(stderr, "Failed to set block use\n");
+        const size_t offset = (leaf_id - 1) * superblock->block_size + (index % per_leaf) * sizeof(struct Extent);
+        if (read_bytes(device, superblock, offset, (uint8_t*)extent, sizeof(struct Extent))) {
+            fprintf(stderr, "Failed to read the extent\n");
             return 1;
         }
-
-        inode->blocks[i] = block_ids[offset++];
     }
 
-    if (offset == n_block_ids)
+    return check_extent(superblock, extent);
+}
+
+// Adds a leaf block after the n_leaves ones, the leaf ids move to an index block once they do not fit in the inode
+static int add_extent_leaf(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     const size_t n_leaves,
+     const uint32_t leaf_id
+) {
+    if (inode->blocks[EXTENT_DEPTH] == 1 && n_leaves < EXTENT_NODE_COUNT) {
+        inode->blocks[EXTENT_FIRST + n_leaves] = leaf_id;
         return 0;
+    }
 
-    // Indirect addressing
-    if (inode->blocks[INDIRECT_BLOCK] == 0) {
-        if (allocate_indirect_block(file, superblock, &inode->blocks[INDIRECT_BLOCK]))
+    if (inode->blocks[EXTENT_DEPTH] == 1) {
+        uint32_t index_id;
+        if (allocate_indirect_block(device, superblock, &index_id))
             return 1;
-    } else {
-        int block_use = get_block_use(superblock, inode->blocks[INDIRECT_BLOCK]);
-        if (block_use == -1) {
-            fprintf(stderr, "Failed to get block use\n");
+
+        if (
+            write_bytes(
+                device,
+                superblock,
+                (index_id - 1) * superblock->block_size,
+                (const uint8_t*)(inode->blocks + EXTENT_FIRST),
+                n_leaves * sizeof(uint32_t)
+            )
+        ) {
+            fprintf(stderr, "Failed to write the extent index\n");
             return 1;
         }
 
-        if (!block_use) {
-            if (allocate_indirect_block(file, superblock, &inode->blocks[INDIRECT_BLOCK]))
+        memset(inode->blocks + EXTENT_FIRST, 0, EXTENT_NODE_COUNT * sizeof(uint32_t));
+        inode->blocks[EXTENT_FIRST] = index_id;
+        inode->blocks[EXTENT_DEPTH] = 2;
+    }
+
+    const size_t per_index = ids_per_block(superblock);
+    if (n_leaves % per_index == 0) {
+        if (n_leaves / per_index >= EXTENT_NODE_COUNT) {
+            fprintf(stderr, "Too many extents for a single inode\n");
+            return 1;
+        }
+
+        if (allocate_indirect_block(device, superblock, &inode->blocks[EXTENT_FIRST + n_leaves / per_index]))
+            return 1;
+    }
+
+    return write_indirect_entry(
+        device,
+        superblock,
+        inode->blocks[EXTENT_FIRST + n_leaves / per_index],
+        n_leaves % per_index,
+        leaf_id
+    );
+}
+
+// Writes the extents from the first-th one on into their leaf blocks, adding the leaves that the file does not have yet
+static int write_extent_tail(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     size_t n_leaves,
+     const size_t first,
+     const struct Extent *extents,
+     const size_t n_extents
+) {
+    const size_t per_leaf = extents_per_leaf(superblock);
+
+    for (size_t done = 0; done < n_extents;) {
+        const size_t index = first + done;
+        uint32_t leaf_id;
+        if (index / per_leaf < n_leaves) {
+            if (get_extent_leaf(device, superblock, inode, index / per_leaf, &leaf_id))
+                return 1;
+        } else {
+            if (get_unused_blocks(superblock, &leaf_id, 1) || set_block_use(superblock, leaf_id, 1)) {
+                fprintf(stderr, "Failed to get an unused block for the extent leaf\n");
+                return 1;
+            }
+
+            if (add_extent_leaf(device, superblock, inode, n_leaves++, leaf_id))
                 return 1;
         }
+
+        const size_t slot = index % per_leaf;
+        const size_t part = n_extents - done < per_leaf - slot ? n_extents - done : per_leaf - slot;
+        const size_t offset = (leaf_id - 1) * superblock->block_size + slot * sizeof(struct Extent);
+        if (write_bytes(device, superblock, offset, (const uint8_t*)(extents + done), part * sizeof(struct Extent))) {
+            fprintf(stderr, "Failed to write the extent leaf\n");
+            return 1;
+        }
+
+        done += part;
     }
 
-    if (
-         fill_indirect_block(
-             file,
-             superblock,
-             inode->blocks[INDIRECT_BLOCK],
-             block_ids,
-             n_block_ids,
-             &offset
-         )
-    ) {
+    return 0;
+}
+
+/*
+* A block that continues the last extent only makes it longer, so appending rarely adds extents.
+* Only the last extent and the new ones are written, into the tail leaf and the leaves added after it.
+*/
+static int append_extent_block_ids(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     const uint32_t *block_ids,
+     const size_t n_new
+) {
+    const size_t count = inode->blocks[EXTENT_COUNT];
+    size_t n_leaves, n_index;
+    if (check_extent_header(superblock, inode, &n_leaves, &n_index))
+        return 1;
+
+    struct Extent *tail = malloc((n_new + 1) * sizeof(struct Extent));
+    if (!tail) {
+        fprintf(stderr, "Failed to allocate memory for extents\n");
         return 1;
     }
 
-    if (offset == n_block_ids)
-        return 0;
+    size_t n_tail = 0;
+    if (count > 0) {
+        if (read_extent(device, superblock, inode, count - 1, tail)) {
+            free(tail);
+            return 1;
+        }
+        n_tail = 1;
+    }
 
-    // Double indirect addressing
-    if (inode->blocks[DOUBLE_INDIRECT_BLOCK] == 0) {
-        if (allocate_indirect_block(file, superblock, &inode->blocks[DOUBLE_INDIRECT_BLOCK]))
+    for (size_t i = 0; i < n_new; ++i) {
+        struct Extent *last = n_tail > 0 ? tail + n_tail - 1 : NULL;
+        if (last && last->start + last->length == block_ids[i] && last->length < UINT32_MAX)
+            ++last->length;
+        else
+            tail[n_tail++] = (struct Extent){ .start = block_ids[i], .length = 1 };
+    }
+
+    const size_t first = count > 0 ? count - 1 : 0;
+    int result = 0;
+    if (inode->blocks[EXTENT_DEPTH] == 0 && first + n_tail <= INODE_EXTENT_COUNT) {
+        memcpy((uint8_t*)(inode->blocks + EXTENT_FIRST) + first * sizeof(struct Extent), tail, n_tail * sizeof(struct Extent));
+        inode->blocks[EXTENT_COUNT] = first + n_tail;
+    } else if (inode->blocks[EXTENT_DEPTH] == 0) {
+        // The extents spill out of the inode, which happens once per file
+        struct Extent *extents = malloc((first + n_tail) * sizeof(struct Extent));
+        if (!extents) {
+            fprintf(stderr, "Failed to allocate memory for extents\n");
+            free(tail);
             return 1;
+        }
+
+        memcpy(extents, inode->blocks + EXTENT_FIRST, first * sizeof(struct Extent));
+        memcpy(extents + first, tail, n_tail * sizeof(struct Extent));
+        result = store_extents(device, superblock, inode, extents, first + n_tail);
+        free(extents);
     } else {
-        int block_use = get_block_use(superblock, inode->blocks[DOUBLE_INDIRECT_BLOCK]);
-        if (block_use == -1) {
-            fprintf(stderr, "Failed to get block use\n");
+        const int cached = extent_map_matches(&device->extents, inode->blocks);
+        result = write_extent_tail(device, superblock, inode, n_leaves, first, tail, n_tail);
+        if (!result)
+            inode->blocks[EXTENT_COUNT] = first + n_tail;
+
+        if (cached && !result)
+            update_extent_map(&device->extents, inode->blocks, first, tail, n_tail);
+        else if (cached)
+            clear_extent_map(&device->extents);
+    }
+
+    free(tail);
+    return result;
+}
+
+int append_block_ids(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     const size_t n_blocks,
+     const uint32_t *block_ids,
+     const size_t n_new
+) {
+    if (n_new == 0)
+        return 0;
+
+    // The data blocks are marked first, so that the mapping blocks are not allocated on top of them
+    for (size_t i = 0; i < n_new; ++i) {
+        if (set_block_use(superblock, block_ids[i], 1)) {
+            fprintf(stderr, "Failed to set block use\n");
             return 1;
         }
+    }
 
-        if (!block_use) {
-            if (allocate_indirect_block(file, superblock, &inode->blocks[DOUBLE_INDIRECT_BLOCK]))
-                return 1;
-        }
+    if (uses_extents(superblock))
+        return append_extent_block_ids(device, superblock, inode, block_ids, n_new);
+
+    for (size_t i = 0; i < n_new; ++i) {
+        if (set_block_pointer(device, superblock, inode, n_blocks + i, block_ids[i]))
+            return 1;
     }
 
-    const size_t indirect_len = superblock->block_size / sizeof(uint32_t);
-    uint32_t *double_indirect_map = calloc(indirect_len, sizeof(uint32_t));
-    if (!double_indirect_map) {
-        fprintf(stderr, "Failed to allocate memory for double_indirect_map\n");
+    return 0;
+}
+
+static int release_indirect_block(struct Superblock *superblock, uint32_t *where) {
+    if (set_block_use(superblock, *where, 0)) {
+        fprintf(stderr, "Failed to unset indirect block use\n");
         return 1;
     }
 
-    if (
-         read_blocks(
-             file,
-             superblock,
-             &inode->blocks[DOUBLE_INDIRECT_BLOCK],
-             1,
-             (uint8_t*)double_indirect_map,
-             superblock->block_size
-         )
-    ) {
-        fprintf(stderr, "Failed to fill double_indirect_map\n");
-        free(double_indirect_map);
+    *where = 0;
+    return 0;
+}
+
+int truncate_block_ids(
+     struct Device *device,
+     struct Superblock *superblock,
+     struct Inode *inode,
+     const size_t n_blocks,
+     const size_t n_keep
+) {
+    if (n_keep >= n_blocks)
+        return 0;
+
+    if (uses_extents(superblock))
+        return truncate_extent_block_ids(device, superblock, inode, n_keep);
+
+    uint32_t *block_ids = malloc((n_blocks - n_keep) * sizeof(uint32_t));
+    if (!block_ids) {
+        fprintf(stderr, "Failed to allocate memory for block_ids\n");
         return 1;
     }
 
-    for (size_t i = 0; i < indirect_len && offset < n_block_ids; ++i) {
-        uint32_t *current_block = double_indirect_map + i;
-        if (*current_block == 0) {
-            if (allocate_indirect_block(file, superblock, current_block)) {
-                free(double_indirect_map);
-                return 1;
-            }
-        } else {
-            int block_use = get_block_use(superblock, *current_block);
-            if (block_use == -1) {
-                fprintf(stderr, "Failed to get block use\n");
-                free(double_indirect_map);
-                return 1;
-            }
+    if (get_block_range(device, superblock, inode, n_keep, n_blocks - n_keep, block_ids)) {
+        fprintf(stderr, "Failed to get the released block ids\n");
+        free(block_ids);
+        return 1;
+    }
 
-            if (!block_use) {
-                if (allocate_indirect_block(file, superblock, current_block)) {
-                    free(double_indirect_map);
-                    return 1;
-                }
-            }
+    for (size_t i = 0; i < n_blocks - n_keep; ++i) {
+        if (set_block_use(superblock, block_ids[i], 0)) {
+            fprintf(stderr, "Failed to unset block use\n");
+            free(block_ids);
+            return 1;
         }
+    }
+
+    free(block_ids);
+
+    for (size_t i = n_keep; i < INDIRECT_BLOCK && i < n_blocks; ++i)
+        inode->blocks[i] = 0;
+
+    if (
+        n_blocks > INDIRECT_BLOCK &&
+        n_keep <= INDIRECT_BLOCK &&
+        release_indirect_block(superblock, &inode->blocks[INDIRECT_BLOCK])
+    ) {
+        return 1;
+    }
 
+    const size_t indirect_len = ids_per_block(superblock);
+    const size_t double_first = INDIRECT_BLOCK + indirect_len;
+    if (n_blocks <= double_first)
+        return 0;
+
+    // Only the second level blocks that are entirely past the new end are released
+    const size_t first_list = n_keep > double_first ? DIV_CEIL(n_keep - double_first, indirect_len) : 0;
+    const size_t end_list = DIV_CEIL(n_blocks - double_first, indirect_len);
+    for (size_t i = first_list; i < end_list; ++i) {
+        uint32_t indirect_block_id;
         if (
-            fill_indirect_block(
-                file,
+            read_indirect_entries(
+                device,
                 superblock,
-                *current_block,
-                block_ids,
-                n_block_ids,
-                &offset
-            )
+                inode->blocks[DOUBLE_INDIRECT_BLOCK],
+                i,
+                1,
+                &indirect_block_id
+            ) ||
+            release_indirect_block(superblock, &indirect_block_id)
         ) {
-            free(double_indirect_map);
             return 1;
         }
     }
 
-    free(double_indirect_map);
+    if (first_list == 0 && release_indirect_block(superblock, &inode->blocks[DOUBLE_INDIRECT_BLOCK]))
+        return 1;
+
     return 0;
 }
 
 int clear_block_ids(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      struct Inode *inode
 ) {
-    uint32_t *used_block_ids;
-    size_t n_used_block_ids;
-    if (get_block_ids(file, superblock, inode, &used_block_ids, &n_used_block_ids)) {
-        fprintf(stderr, "Failed to get used block ids\n");
+    const size_t n_blocks = DIV_CEIL(inode->file_size, superblock->block_size);
+    if (truncate_block_ids(device, superblock, inode, n_blocks, 0))
         return 1;
-    }
-
-    for (size_t i = 0; i < n_used_block_ids; ++i) {
-        if (set_block_use(superblock, used_block_ids[i], 0)) {
-            fprintf(stderr, "Failed to unset block use\n");
-            free(used_block_ids);
-            return 1;
-        }
-    }
 
-    free(used_block_ids);
+    // Pointers left over from an older version of the mapping code are dropped as well
+    memset(inode->blocks, 0, sizeof(inode->blocks));
     return 0;
 }
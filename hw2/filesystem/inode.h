@@ -6,6 +6,7 @@
 #include <stdlib.h>
 
 #include "constants.h"
+#include "extent_map.h"
 #include "superblock.h"
 
 struct Inode {
@@ -15,43 +16,74 @@ struct Inode {
 };
 
 int write_inode(
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     const struct Inode *inode,
     const uint32_t inode_id
 );
 
 int read_inode (
-    FILE *file,
+    struct Device *device,
     const struct Superblock *superblock,
     struct Inode *inode,
     const uint32_t inode_id
 );
 
 int clear_inode(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      const uint32_t inode_id
 );
 
-int get_block_ids(
-    FILE *file,
+int get_extents(
+    struct Device *device,
     const struct Superblock *superblock,
     const struct Inode *inode,
-    uint32_t **block_ids,
-    size_t *n_block_ids
+    struct Extent **extents,
+    size_t *n_extents
 );
 
-int set_block_ids(
-     FILE *file,
-     struct Superblock *superblock,
-     struct Inode *inode,
-     const uint32_t *block_ids,
-     const size_t n_block_ids
+size_t max_file_blocks(const struct Superblock *superblock);
+
+int get_block_range(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct Inode *inode,
+    const size_t first,
+    const size_t n,
+    uint32_t *block_ids
+);
+
+int get_block_id(
+    struct Device *device,
+    const struct Superblock *superblock,
+    const struct Inode *inode,
+    const size_t index,
+    uint32_t *block_id
+);
+
+// Maps n_new more blocks after the first n_blocks blocks of the file and marks them as used
+int append_block_ids(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct Inode *inode,
+    const size_t n_blocks,
+    const uint32_t *block_ids,
+    const size_t n_new
+);
+
+// Releases the blocks past the first n_keep of the n_blocks blocks, along with the mapping blocks that are no longer needed
+int truncate_block_ids(
+    struct Device *device,
+    struct Superblock *superblock,
+    struct Inode *inode,
+    const size_t n_blocks,
+    const size_t n_keep
 );
 
+// Releases all blocks of the file, which are taken from its size
 int clear_block_ids(
-     FILE *file,
+     struct Device *device,
      struct Superblock *superblock,
      struct Inode *inode
 );
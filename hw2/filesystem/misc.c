@@ -41,6 +41,61 @@ int path_join(const char *p1, const char *p2, char **result) {
     return 0;
 }
 
+// Joins path to the absolute directory base, collapsing the . and .. components
+int path_resolve(const char *base, const char *path, char **result) {
+    const char *parts[] = { path[0] == '/' ? "" : base, path };
+
+    *result = malloc(strlen(parts[0]) + strlen(path) + 3);
+    if (!*result) {
+        fprintf(stderr, "Failed to allocate memory for path resolving\n");
+        return 1;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < 2; ++i) {
+        const char *current = parts[i];
+        while (*current) {
+            while (*current == '/')
+                ++current;
+
+            const char *end = current;
+            while (*end && *end != '/')
+                ++end;
+
+            const size_t part_len = end - current;
+            if (part_len == 2 && current[0] == '.' && current[1] == '.') {
+                while (len > 0 && (*result)[len - 1] != '/')
+                    --len;
+                if (len > 0)
+                    --len;
+            } else if (part_len > 0 && !(part_len == 1 && current[0] == '.')) {
+                (*result)[len++] = '/';
+                memcpy(*result + len, current, part_len);
+                len += part_len;
+            }
+
+            current = end;
+        }
+    }
+
+    if (len == 0)
+        (*result)[len++] = '/';
+    (*result)[len] = '\0';
+
+    return 0;
+}
+
+// FNV-1a over at most MAX_FILENAME_LEN characters
+uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILENAME_LEN && name[i]; ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 const char* filetype_str(const uint8_t filetype) {
     char *filetype_cstr;
     switch (filetype) {
@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 int         path_join(const char *p1, const char *p2, char **result);
+int         path_resolve(const char *base, const char *path, char **result);
+uint32_t    hash_name(const char *name);
 const char* filetype_str(const uint8_t filetype);
 
 #endif
@@ -1,5 +1,7 @@
 #include "superblock.h"
 
+#include <string.h>
+
 #include "constants.h"
 #include "div_ceil.h"
 
@@ -7,11 +9,17 @@ static size_t superblock_size(struct Superblock *superblock) {
     size_t size = 0;
 
     size += sizeof(superblock->magic);
+    if (superblock->magic == MAGIC_FEATURES)
+        size += sizeof(superblock->features);
     size += sizeof(superblock->total_blocks);
     size += sizeof(superblock->total_inodes);
     size += sizeof(superblock->free_blocks);
     size += sizeof(superblock->free_inodes);
     size += sizeof(superblock->block_size);
+    if (superblock->features & FEATURE_MOUNT_STATE) {
+        size += sizeof(superblock->state);
+        size += sizeof(superblock->generation);
+    }
 
     size += sizeof(uint8_t) * superblock->used_blocks_bitmap_len;
     size += sizeof(uint8_t) * superblock->used_inodes_bitmap_len;
@@ -21,6 +29,7 @@ static size_t superblock_size(struct Superblock *superblock) {
 
 struct Superblock create_superblock(
      const uint16_t magic,
+     const uint32_t features,
      const uint32_t total_blocks,
      const uint32_t total_inodes,
      const uint32_t block_size
@@ -30,15 +39,21 @@ struct Superblock create_superblock(
 
     struct Superblock new_superblock = {
         .magic = magic,
+        .features = features,
         .total_blocks = total_blocks,
         .total_inodes = total_inodes,
         .free_blocks = total_blocks,
         .free_inodes = total_inodes,
         .block_size = block_size,
+        .state = STATE_CLEAN,
         .used_blocks_bitmap = calloc(blocks_bitmap_len, sizeof(uint8_t)),
         .used_blocks_bitmap_len = blocks_bitmap_len,
         .used_inodes_bitmap = calloc(inodes_bitmap_len, sizeof(uint8_t)),
-        .used_inodes_bitmap_len = inodes_bitmap_len
+        .used_inodes_bitmap_len = inodes_bitmap_len,
+        .dirty_blocks = { .n = 1, .ranges = {{ 0, blocks_bitmap_len }} }, // nothing is on disk yet
+        .dirty_inodes = { .n = 1, .ranges = {{ 0, inodes_bitmap_len }} },
+        .next_free_block = 1,
+        .next_free_inode = 1
     };
 
     new_superblock.size = superblock_size(&new_superblock);
@@ -46,132 +61,371 @@ struct Superblock create_superblock(
     return new_superblock;
 }
 
-int write_superblock(const struct Superblock *superblock, FILE *file) {
-    if (fseek(file, BOOT_OFFSET, SEEK_SET)) {
-        fprintf(stderr, "Failed to seek to the beginning of the superblock\n");
-        return 1;
+static void put_field(uint8_t **ptr, const void *field, const size_t size) {
+    memcpy(*ptr, field, size);
+    *ptr += size;
+}
+
+static void get_field(const uint8_t **ptr, void *field, const size_t size) {
+    memcpy(field, *ptr, size);
+    *ptr += size;
+}
+
+// Writes the changed parts of a bitmap that starts at the given offset, one device_write() per range
+static int write_dirty_ranges(
+     struct Device *device,
+     const size_t offset,
+     const uint8_t *bitmap,
+     struct DirtyRanges *dirty
+) {
+    for (size_t i = 0; i < dirty->n; ++i) {
+        const size_t from = dirty->ranges[i].from;
+        const size_t to   = dirty->ranges[i].to;
+        if (device_write(device, offset + from, bitmap + from, to - from))
+            return 1;
     }
 
-    if (fwrite(&superblock->magic, sizeof(superblock->magic), 1, file) != 1) {
-        fprintf(stderr, "Failed to write the superblock's magic\n");
+    dirty->n = 0;
+    return 0;
+}
+
+int write_superblock(struct Superblock *superblock, struct Device *device) {
+    // Every commit gets a new generation, so that revalidate_superblock() can tell whether the bitmaps changed
+    ++superblock->generation;
+
+    // The header is small and changes on every commit, so it is always written whole
+    uint8_t header[SUPERBLOCK_HEADER_MAX];
+    uint8_t *ptr = header;
+
+    put_field(&ptr, &superblock->magic, sizeof(superblock->magic));
+    if (superblock->magic == MAGIC_FEATURES)
+        put_field(&ptr, &superblock->features, sizeof(superblock->features));
+    put_field(&ptr, &superblock->total_blocks, sizeof(superblock->total_blocks));
+    put_field(&ptr, &superblock->total_inodes, sizeof(superblock->total_inodes));
+    put_field(&ptr, &superblock->free_blocks, sizeof(superblock->free_blocks));
+    put_field(&ptr, &superblock->free_inodes, sizeof(superblock->free_inodes));
+    put_field(&ptr, &superblock->block_size, sizeof(superblock->block_size));
+    if (superblock->features & FEATURE_MOUNT_STATE) {
+        put_field(&ptr, &superblock->state, sizeof(superblock->state));
+        put_field(&ptr, &superblock->generation, sizeof(superblock->generation));
+    }
+
+    const size_t header_size = ptr - header;
+    if (device_write(device, BOOT_OFFSET, header, header_size)) {
+        fprintf(stderr, "Failed to write the superblock's header\n");
         return 1;
     }
-    if (fwrite(&superblock->total_blocks, sizeof(superblock->total_blocks), 1, file) != 1) {
-        fprintf(stderr, "Failed to write the superblock's total_blocks\n");
-        return 1;
+
+    // Mapped bitmaps are modified in place
+    if (superblock->bitmaps_mapped) {
+        superblock->dirty_blocks.n = 0;
+        superblock->dirty_inodes.n = 0;
+        return 0;
     }
-    if (fwrite(&superblock->total_inodes, sizeof(superblock->total_inodes), 1, file) != 1) {
-        fprintf(stderr, "Failed to write the superblock's total_inodes\n");
+
+    const size_t blocks_bitmap_offset = BOOT_OFFSET + header_size;
+    if (
+         write_dirty_ranges(
+             device,
+             blocks_bitmap_offset,
+             superblock->used_blocks_bitmap,
+             &superblock->dirty_blocks
+         )
+    ) {
+        fprintf(stderr, "Failed to write the superblock's block bitmap\n");
         return 1;
     }
-    if (fwrite(&superblock->free_blocks, sizeof(superblock->free_blocks), 1, file) != 1) {
-        fprintf(stderr, "Failed to write the superblock's free_blocks\n");
+
+    if (
+         write_dirty_ranges(
+             device,
+             blocks_bitmap_offset + superblock->used_blocks_bitmap_len,
+             superblock->used_inodes_bitmap,
+             &superblock->dirty_inodes
+         )
+    ) {
+        fprintf(stderr, "Failed to write the superblock's inode bitmap\n");
         return 1;
     }
-    if (fwrite(&superblock->free_inodes, sizeof(superblock->free_inodes), 1, file) != 1) {
-        fprintf(stderr, "Failed to write the superblock's free_inodes\n");
+
+    return 0;
+}
+
+// Parses the fields before the bitmaps from the SUPERBLOCK_HEADER_MAX bytes of buffer, header_size receives their length
+static int parse_header(const uint8_t *buffer, struct Superblock *header, size_t *header_size) {
+    const uint8_t *ptr = buffer;
+    *header = (struct Superblock){0};
+
+    get_field(&ptr, &header->magic, sizeof(header->magic));
+    if (header->magic != MAGIC && header->magic != MAGIC_FEATURES) {
+        fprintf(stderr, "Invalid magic\n");
         return 1;
     }
-    if (fwrite(&superblock->block_size, sizeof(superblock->block_size), 1, file) != 1) {
-        fprintf(stderr, "Failed to write the superblock's block_size\n");
+    if (header->magic == MAGIC_FEATURES)
+        get_field(&ptr, &header->features, sizeof(header->features));
+    if (header->features & ~SUPPORTED_FEATURES) {
+        fprintf(stderr, "Unsupported features 0x%x\n", header->features & ~SUPPORTED_FEATURES);
         return 1;
     }
-
-    for (size_t i = 0; i < superblock->used_blocks_bitmap_len; ++i) {
-        uint8_t bitmap_part = superblock->used_blocks_bitmap[i];
-        if (fwrite(&bitmap_part, sizeof(bitmap_part), 1, file) != 1) {
-            fprintf(stderr, "Failed to write the superblock's block bitmap\n");
-            return 1;
-        }
-    }
-
-    for (size_t i = 0; i < superblock->used_inodes_bitmap_len; ++i) {
-        uint8_t bitmap_part = superblock->used_inodes_bitmap[i];
-        if (fwrite(&bitmap_part, sizeof(bitmap_part), 1, file) != 1) {
-            fprintf(stderr, "Failed to write the superblock's inode bitmap\n");
-            return 1;
-        }
+    get_field(&ptr, &header->total_blocks, sizeof(header->total_blocks));
+    get_field(&ptr, &header->total_inodes, sizeof(header->total_inodes));
+    get_field(&ptr, &header->free_blocks, sizeof(header->free_blocks));
+    get_field(&ptr, &header->free_inodes, sizeof(header->free_inodes));
+    get_field(&ptr, &header->block_size, sizeof(header->block_size));
+    if (header->features & FEATURE_MOUNT_STATE) {
+        get_field(&ptr, &header->state, sizeof(header->state));
+        get_field(&ptr, &header->generation, sizeof(header->generation));
     }
 
+    *header_size = ptr - buffer;
     return 0;
 }
 
-int read_superblock(struct Superblock *superblock, FILE *file) {
-    if (fseek(file, BOOT_OFFSET, SEEK_SET)) {
-        fprintf(stderr, "Failed to seek to the beginning of the superblock\n");
+// Reads the fields before the bitmaps with a single call
+static int read_header(struct Device *device, struct Superblock *header, size_t *header_size) {
+    uint8_t buffer[SUPERBLOCK_HEADER_MAX];
+    if (device_read(device, BOOT_OFFSET, buffer, sizeof(buffer))) {
+        fprintf(stderr, "Failed to read the superblock's header\n");
         return 1;
     }
 
-    uint16_t magic;
-    uint32_t total_blocks, total_inodes;
-    uint32_t free_blocks, free_inodes;
-    uint32_t block_size;
+    return parse_header(buffer, header, header_size);
+}
 
-    if (fread(&magic, sizeof(magic), 1, file) != 1) {
-        fprintf(stderr, "Failed to read the magic of the superblock\n");
-        return 1;
-    } else if (magic != MAGIC) {
-        fprintf(stderr, "Invalid magic\n");
+/*
+* The header comes in along with the first SUPERBLOCK_FIRST_READ bytes of the bitmaps, which is all of them
+* for small filesystems, and the rest of the bitmaps (or nothing, when they are mapped) with one more call.
+*/
+int read_superblock(struct Superblock *superblock, struct Device *device) {
+    uint8_t first[SUPERBLOCK_FIRST_READ];
+    size_t first_len;
+    memset(first, 0, SUPERBLOCK_HEADER_MAX);
+    if (device_read_partial(device, BOOT_OFFSET, first, sizeof(first), &first_len)) {
+        fprintf(stderr, "Failed to read the superblock\n");
         return 1;
     }
-    if (fread(&total_blocks, sizeof(total_blocks), 1, file) != 1) {
-        fprintf(stderr, "Failed to read the total_blocks of the superblock\n");
-        return 1;
-    }
-    if (fread(&total_inodes, sizeof(total_inodes), 1, file) != 1) {
-        fprintf(stderr, "Failed to read the total_inodes of the superblock\n");
-        return 1;
-    }
-    if (fread(&free_blocks, sizeof(free_blocks), 1, file) != 1) {
-        fprintf(stderr, "Failed to read the free_blocks of the superblock\n");
-        return 1;
-    }
-    if (fread(&free_inodes, sizeof(free_inodes), 1, file) != 1) {
-        fprintf(stderr, "Failed to read the free_inodes of the superblock\n");
+
+    struct Superblock header;
+    size_t header_size;
+    if (parse_header(first, &header, &header_size))
         return 1;
-    }
-    if (fread(&block_size, sizeof(block_size), 1, file) != 1) {
-        fprintf(stderr, "Failed to read the block_size of the superblock\n");
+    if (first_len < header_size) {
+        fprintf(stderr, "Failed to read the superblock's header\n");
         return 1;
     }
 
-    *superblock = create_superblock(magic, total_blocks, total_inodes, block_size);
+    *superblock = create_superblock(
+        header.magic,
+        header.features,
+        header.total_blocks,
+        header.total_inodes,
+        header.block_size
+    );
     if (superblock->used_blocks_bitmap == NULL) {
         fprintf(stderr, "Failed to allocate memory for the blocks bitmap\n");
+        free_superblock(superblock);
         return 1;
     }
     if (superblock->used_inodes_bitmap == NULL) {
         fprintf(stderr, "Failed to allocate memory for the inodes bitmap\n");
+        free_superblock(superblock);
         return 1;
     }
 
-    superblock->free_blocks = free_blocks;
-    superblock->free_inodes = free_inodes;
+    superblock->free_blocks = header.free_blocks;
+    superblock->free_inodes = header.free_inodes;
+    superblock->state       = header.state;
+    superblock->generation  = header.generation;
+    superblock->dirty_blocks.n = 0;
+    superblock->dirty_inodes.n = 0;
+
+    const size_t offset = BOOT_OFFSET + header_size;
+    uint8_t *mapped_blocks_bitmap = device_pointer(device, offset, superblock->used_blocks_bitmap_len);
+    uint8_t *mapped_inodes_bitmap = device_pointer(
+        device,
+        offset + superblock->used_blocks_bitmap_len,
+        superblock->used_inodes_bitmap_len
+    );
+    if (mapped_blocks_bitmap && mapped_inodes_bitmap) {
+        free_superblock(superblock);
+        superblock->used_blocks_bitmap = mapped_blocks_bitmap;
+        superblock->used_inodes_bitmap = mapped_inodes_bitmap;
+        superblock->bitmaps_mapped = 1;
+        return 0;
+    }
+
+    // The bitmaps are next to each other, what the first read did not get comes in with one call
+    struct iovec iov[] = {
+        { .iov_base = superblock->used_blocks_bitmap, .iov_len = superblock->used_blocks_bitmap_len },
+        { .iov_base = superblock->used_inodes_bitmap, .iov_len = superblock->used_inodes_bitmap_len }
+    };
+    size_t got = first_len - header_size;
+    const uint8_t *from = first + header_size;
+    int i = 0;
+    for (; i < 2 && got >= iov[i].iov_len; ++i) {
+        memcpy(iov[i].iov_base, from, iov[i].iov_len);
+        from += iov[i].iov_len;
+        got  -= iov[i].iov_len;
+    }
+    if (i < 2) {
+        memcpy(iov[i].iov_base, from, got);
+        iov[i].iov_base = (uint8_t*)iov[i].iov_base + got;
+        iov[i].iov_len -= got;
+    }
+
+    if (i < 2 && device_readv(device, offset + (first_len - header_size), iov + i, 2 - i)) {
+        fprintf(stderr, "Failed to read the superblock's bitmaps\n");
+        free_superblock(superblock);
+        return 1;
+    }
 
-    for (size_t offset = 0; offset < superblock->used_blocks_bitmap_len; ++offset) {
-        uint8_t *ptr = superblock->used_blocks_bitmap + offset;
-        if (fread(ptr, sizeof(uint8_t), 1, file) != 1) {
-            fprintf(stderr, "Failed to read the used_blocks_bitmap of the superblock\n");
-            return 1;
-        }
+    return 0;
+}
+
+// Counts the unused ids, the bits past total in the last byte are ignored
+static uint32_t count_unused(const uint8_t *bitmap, const uint32_t total) {
+    uint32_t used = 0;
+    for (size_t i = 0; i < total / 8; ++i)
+        used += __builtin_popcount(bitmap[i]);
+    if (total % 8 != 0)
+        used += __builtin_popcount(bitmap[total / 8] >> (8 - total % 8));
+
+    return total - used;
+}
+
+// The free counts are checked against the bitmaps, so a crash between updating them does not leave them wrong
+static void verify_free_counts(struct Superblock *superblock) {
+    const uint32_t free_blocks = count_unused(superblock->used_blocks_bitmap, superblock->total_blocks);
+    const uint32_t free_inodes = count_unused(superblock->used_inodes_bitmap, superblock->total_inodes);
+
+    if (free_blocks != superblock->free_blocks) {
+        fprintf(stderr, "Fixing the free block count: %u -> %u\n", superblock->free_blocks, free_blocks);
+        superblock->free_blocks = free_blocks;
     }
+    if (free_inodes != superblock->free_inodes) {
+        fprintf(stderr, "Fixing the free inode count: %u -> %u\n", superblock->free_inodes, free_inodes);
+        superblock->free_inodes = free_inodes;
+    }
+}
 
-    for (size_t offset = 0; offset < superblock->used_inodes_bitmap_len; ++offset) {
-        uint8_t *ptr = superblock->used_inodes_bitmap + offset;
-        if (fread(ptr, sizeof(uint8_t), 1, file) != 1) {
-            fprintf(stderr, "Failed to read the used_inodes_bitmap of the superblock\n");
-            return 1;
-        }
+static int write_mount_state(struct Superblock *superblock, struct Device *device, const uint32_t state) {
+    superblock->state = state;
+    if (write_superblock(superblock, device)) {
+        fprintf(stderr, "Failed to write the mount state\n");
+        return 1;
     }
 
     return 0;
 }
 
+/*
+* Reads the superblock and, with FEATURE_MOUNT_STATE, marks the filesystem as mounted.
+* The free counts are only recounted if the filesystem was not unmounted cleanly
+* (or cannot tell whether it was).
+*/
+int mount_superblock(struct Superblock *superblock, struct Device *device) {
+    if (read_superblock(superblock, device))
+        return 1;
+
+    const int tracked = (superblock->features & FEATURE_MOUNT_STATE) != 0;
+    if (tracked && superblock->state == STATE_CLEAN)
+        return write_mount_state(superblock, device, STATE_MOUNTED);
+
+    if (tracked)
+        fprintf(stderr, "The filesystem was not unmounted cleanly\n");
+    verify_free_counts(superblock);
+
+    return tracked ? write_mount_state(superblock, device, STATE_MOUNTED) : 0;
+}
+
+int unmount_superblock(struct Superblock *superblock, struct Device *device) {
+    if (!(superblock->features & FEATURE_MOUNT_STATE))
+        return 0;
+
+    // Everything else has to be in the file before it is marked as clean
+    if (sync_device(device))
+        return 1;
+
+    return write_mount_state(superblock, device, STATE_CLEAN);
+}
+
+/*
+* Brings the superblock up to date between commands. With FEATURE_MOUNT_STATE only the header is read,
+* and the bitmaps are read again only if someone else has written the superblock since (*changed is set then).
+* Without it there is no way to tell, so nothing is read: such images must not be changed by another program
+* while they are mounted.
+*/
+int revalidate_superblock(struct Superblock *superblock, struct Device *device, int *changed) {
+    *changed = 0;
+
+    if (!(superblock->features & FEATURE_MOUNT_STATE))
+        return 0;
+
+    struct Superblock header;
+    size_t header_size;
+    if (read_header(device, &header, &header_size))
+        return 1;
+
+    if (header.features == superblock->features && header.generation == superblock->generation)
+        return 0;
+
+    struct Superblock fresh;
+    if (read_superblock(&fresh, device))
+        return 1;
+
+    // The allocation cursors only live in memory
+    fresh.next_free_block = superblock->next_free_block;
+    fresh.next_free_inode = superblock->next_free_inode;
+
+    free_superblock(superblock);
+    *superblock = fresh;
+    *changed = 1;
+    return 0;
+}
+
 void free_superblock(const struct Superblock *superblock) {
+    if (superblock->bitmaps_mapped)
+        return;
+
     free(superblock->used_blocks_bitmap);
     free(superblock->used_inodes_bitmap);
 }
 
+/*
+* Adds the byte to the range it is close to, or starts a new range for it.
+* When all ranges are taken, the nearest one is extended instead, so a commit never needs more than DIRTY_RANGES writes.
+*/
+static void mark_dirty(struct DirtyRanges *dirty, const size_t byte) {
+    size_t i = 0;
+    while (i < dirty->n && dirty->ranges[i].to + DIRTY_RANGE_GAP < byte)
+        ++i;
+
+    const int fits_next = i < dirty->n && byte + 1 + DIRTY_RANGE_GAP >= dirty->ranges[i].from;
+    if (!fits_next && dirty->n == DIRTY_RANGES) {
+        // The byte lies between the ranges i - 1 and i (or past the last one), the closer one takes it
+        if (i == dirty->n || (i > 0 && byte - dirty->ranges[i - 1].to < dirty->ranges[i].from - byte))
+            --i;
+    } else if (!fits_next) {
+        memmove(dirty->ranges + i + 1, dirty->ranges + i, (dirty->n - i) * sizeof(dirty->ranges[0]));
+        ++dirty->n;
+        dirty->ranges[i].from = byte;
+        dirty->ranges[i].to   = byte + 1;
+        return;
+    }
+
+    if (byte < dirty->ranges[i].from)
+        dirty->ranges[i].from = byte;
+    if (byte + 1 > dirty->ranges[i].to)
+        dirty->ranges[i].to = byte + 1;
+
+    // Growing towards the next range may have closed the gap to it
+    if (i + 1 < dirty->n && dirty->ranges[i].to + DIRTY_RANGE_GAP >= dirty->ranges[i + 1].from) {
+        dirty->ranges[i].to = dirty->ranges[i + 1].to;
+        memmove(dirty->ranges + i + 1, dirty->ranges + i + 2, (dirty->n - i - 2) * sizeof(dirty->ranges[0]));
+        --dirty->n;
+    }
+}
+
 int set_block_use(struct Superblock *superblock, const uint32_t block_id, const int is_used) {
     if (block_id == 0 || block_id > superblock->total_blocks) {
         fprintf(stderr, "Invalid block id\n");
@@ -204,6 +458,9 @@ int set_block_use(struct Superblock *superblock, const uint32_t block_id, const
         *bitmap_uint8 &= ~mask;
     }
 
+    if (was_used != (is_used != 0))
+        mark_dirty(&superblock->dirty_blocks, bitmap_uint8 - superblock->used_blocks_bitmap);
+
     return 0;
 }
 
@@ -239,6 +496,9 @@ int set_inode_use(struct Superblock *superblock, const uint32_t inode_id, const
         *bitmap_uint8 &= ~mask;
     }
 
+    if (was_used != (is_used != 0))
+        mark_dirty(&superblock->dirty_inodes, bitmap_uint8 - superblock->used_inodes_bitmap);
+
     return 0;
 }
 
@@ -270,24 +530,86 @@ int get_inode_use(const struct Superblock *superblock, const uint32_t inode_id)
     return bitmap_uint8 & 1;
 }
 
-int get_unused_blocks(const struct Superblock *superblock, uint32_t *blocks, const size_t n_blocks) {
-    if (n_blocks > superblock->free_blocks) {
-        fprintf(stderr, "Not enough free blocks\n");
-        return 1;
+/*
+* Bit i of the bitmap (counting from the most significant bit of the first byte) is the id i + 1.
+* Loads 64 bits at the given bit offset (a multiple of 64) so that the id order matches the bit order,
+* bytes past the end of the bitmap read as used.
+*/
+static uint64_t load_bitmap_word(const uint8_t *bitmap, const size_t bitmap_len, const size_t word_index) {
+    const size_t first_byte = word_index * sizeof(uint64_t);
+
+    uint64_t word = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+        const size_t byte = first_byte + i;
+        word = (word << 8) | (byte < bitmap_len ? bitmap[byte] : 0xFF);
     }
 
-    size_t offset = 0;
-    for (uint32_t i = 1; i <= superblock->total_blocks && offset < n_blocks; ++i) {
-        int block_use = get_block_use(superblock, i);
-        if (block_use == -1) {
-            return 1;
-        } else if (block_use == 0) {
-            *(blocks + offset) = i;
-            ++offset;
+    return word;
+}
+
+/*
+* Next-fit search for n unused ids starting at *cursor, wrapping around once.
+* Full words are skipped at once, the first zero bit of a word is found with clz
+* (the bitmap is MSB-first, so the lowest id is the leading bit).
+*/
+static size_t find_unused_ids(
+     const uint8_t *bitmap,
+     const size_t bitmap_len,
+     const uint32_t total,
+     uint32_t *cursor,
+     uint32_t *ids,
+     const size_t n_ids
+) {
+    if (*cursor == 0 || *cursor > total)
+        *cursor = 1;
+
+    const size_t n_words = DIV_CEIL(total, 64);
+    const size_t start   = *cursor - 1; // bit index
+
+    size_t found = 0;
+    for (size_t step = 0; step <= n_words && found < n_ids; ++step) {
+        const size_t word_index = (start / 64 + step) % n_words;
+
+        uint64_t unused = ~load_bitmap_word(bitmap, bitmap_len, word_index);
+        if (step == 0)
+            unused &= ~(uint64_t)0 >> (start % 64);           // bits before the cursor
+        else if (step == n_words && start % 64 != 0)
+            unused &= ~(~(uint64_t)0 >> (start % 64));        // the same word, wrapped around
+        else if (step == n_words)
+            break;
+
+        while (unused != 0 && found < n_ids) {
+            const unsigned bit = __builtin_clzll(unused);
+            const uint64_t id  = word_index * 64 + bit + 1;
+            if (id > total)
+                break;
+
+            ids[found++] = id;
+            unused &= ~((uint64_t)1 << (63 - bit));
         }
     }
 
-    if (offset < n_blocks) {
+    if (found > 0)
+        *cursor = ids[found - 1] % total + 1;
+
+    return found;
+}
+
+int get_unused_blocks(struct Superblock *superblock, uint32_t *blocks, const size_t n_blocks) {
+    if (n_blocks > superblock->free_blocks) {
+        fprintf(stderr, "Not enough free blocks\n");
+        return 1;
+    }
+
+    const size_t found = find_unused_ids(
+        superblock->used_blocks_bitmap,
+        superblock->used_blocks_bitmap_len,
+        superblock->total_blocks,
+        &superblock->next_free_block,
+        blocks,
+        n_blocks
+    );
+    if (found < n_blocks) {
         fprintf(stderr, "Failed to fill the blocks pointer\n");
         return 1;
     }
@@ -295,24 +617,21 @@ int get_unused_blocks(const struct Superblock *superblock, uint32_t *blocks, con
     return 0;
 }
 
-int get_unused_inodes(const struct Superblock *superblock, uint32_t *inodes, const size_t n_inodes) {
-    if (n_inodes > superblock->free_blocks) {
+int get_unused_inodes(struct Superblock *superblock, uint32_t *inodes, const size_t n_inodes) {
+    if (n_inodes > superblock->free_inodes) {
         fprintf(stderr, "Not enough inodes\n");
         return 1;
     }
 
-    size_t offset = 0;
-    for (uint32_t i = 1; i <= superblock->total_blocks && offset < n_inodes; ++i) {
-        int inode_use = get_inode_use(superblock, i);
-        if (inode_use == -1) {
-            return 1;
-        } else if (inode_use == 0) {
-            *(inodes + offset) = i;
-            ++offset;
-        }
-    }
-
-    if (offset < n_inodes) {
+    const size_t found = find_unused_ids(
+        superblock->used_inodes_bitmap,
+        superblock->used_inodes_bitmap_len,
+        superblock->total_inodes,
+        &superblock->next_free_inode,
+        inodes,
+        n_inodes
+    );
+    if (found < n_inodes) {
         fprintf(stderr, "Failed to fill the inodes pointer\n");
         return 1;
     }
@@ -5,36 +5,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "device.h"
+
+#define DIRTY_RANGES    8  // dirty ranges kept per bitmap before the closest ones are merged
+#define DIRTY_RANGE_GAP 64 // clean bytes that are cheaper to rewrite than to split a write on
+
+// Byte ranges [from, to) of a bitmap that were changed since the last write_superblock(), sorted and disjoint
+struct DirtyRanges {
+    size_t n;
+    struct {
+        size_t from, to;
+    } ranges[DIRTY_RANGES];
+};
+
 struct Superblock {
     uint16_t magic;
+    uint32_t features; // only stored with MAGIC_FEATURES
     uint32_t total_blocks, total_inodes;
     uint32_t free_blocks, free_inodes;
     uint32_t block_size;
+    uint32_t state, generation; // only stored with FEATURE_MOUNT_STATE
     uint8_t  *used_blocks_bitmap;
     size_t   used_blocks_bitmap_len;
     uint8_t  *used_inodes_bitmap;
     size_t   used_inodes_bitmap_len;
+    int      bitmaps_mapped; // the bitmaps point into the mapped file
+    struct DirtyRanges dirty_blocks, dirty_inodes; // not stored on disk
+    uint32_t next_free_block, next_free_inode; // next-fit allocation cursors, not stored on disk
     size_t   size;
 };
 
 struct Superblock create_superblock(
     const uint16_t magic,
+    const uint32_t features,
     const uint32_t total_blocks,
     const uint32_t total_inodes,
     const uint32_t block_size
 );
 
-int  write_superblock(const struct Superblock *superblock, FILE *file);
-int  read_superblock (struct Superblock *superblock, FILE *file);
+int  write_superblock(struct Superblock *superblock, struct Device *device);
+int  read_superblock (struct Superblock *superblock, struct Device *device);
 void free_superblock (const struct Superblock *superblock);
 
+int mount_superblock     (struct Superblock *superblock, struct Device *device);
+int unmount_superblock   (struct Superblock *superblock, struct Device *device);
+int revalidate_superblock(struct Superblock *superblock, struct Device *device, int *changed);
+
 int set_block_use(struct Superblock *superblock, const uint32_t block_id, const int is_used);
 int set_inode_use(struct Superblock *superblock, const uint32_t inode_id, const int is_used);
 
 int get_block_use(const struct Superblock *superblock, const uint32_t block_id);
 int get_inode_use(const struct Superblock *superblock, const uint32_t inode_id);
 
-int get_unused_blocks(const struct Superblock *superblock, uint32_t *blocks, const size_t n_blocks);
-int get_unused_inodes(const struct Superblock *superblock, uint32_t *inodes, const size_t n_inodes);
+int get_unused_blocks(struct Superblock *superblock, uint32_t *blocks, const size_t n_blocks);
+int get_unused_inodes(struct Superblock *superblock, uint32_t *inodes, const size_t n_inodes);
 
 #endif
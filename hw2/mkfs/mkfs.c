@@ -6,10 +6,12 @@
 
 #include "../filesystem/constants.h"
 #include "../filesystem/directory_entry.h"
+#include "../filesystem/directory_ops.h"
 #include "../filesystem/div_ceil.h"
 #include "../filesystem/inode.h"
 #include "../filesystem/superblock.h"
 #include "../filesystem/block_ops.h"
+#include "../filesystem/device.h"
 
 #include "defaults.h"
 
@@ -17,6 +19,10 @@ void print_usage(const char *launch_name) {
     fprintf(
         stderr,
         "Usage: %s "
+        "[-m] "
+        "[-e] "
+        "[-i] "
+        "[-s] "
         "FILE "
         "[BLOCK_SIZE "
         "TOTAL_BLOCKS "
@@ -25,23 +31,48 @@ void print_usage(const char *launch_name) {
     );
 }
 
-int parse_arguments(int argc, char *argv[], struct Superblock *superblock, char **file) {
+int parse_arguments(
+     int argc,
+     char *argv[],
+     struct Superblock *superblock,
+     char **file,
+     int *backend
+) {
+    uint32_t features     = 0;
     uint32_t block_size   = DEFAULT_BLOCK_SIZE;
     uint32_t total_blocks = DEFAULT_TOTAL_BLOCKS;
     uint32_t total_inodes = DEFAULT_TOTAL_INODES;
 
-    if (argc != 2 && argc != 5) {
+    *backend = DEVICE_BACKEND_STDIO;
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; ++first) {
+        if (strcmp(argv[first], "-m") == 0) {
+            *backend = DEVICE_BACKEND_MMAP;
+        } else if (strcmp(argv[first], "-e") == 0) {
+            features |= FEATURE_EXTENTS;
+        } else if (strcmp(argv[first], "-i") == 0) {
+            features |= FEATURE_DIR_INDEX;
+        } else if (strcmp(argv[first], "-s") == 0) {
+            features |= FEATURE_MOUNT_STATE;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - first != 1 && argc - first != 4) {
         print_usage(argv[0]);
         return 1;
     }
 
-    if (argc == 5) {
+    if (argc - first == 4) {
         uint32_t* args[] = {
             &block_size,
             &total_blocks,
             &total_inodes
         };
-        for (size_t i = 2; i < argc; ++i) {
+        for (int i = first + 1; i < argc; ++i) {
             char *end;
             errno = 0;
             long next = strtol(argv[i], &end, 10);
@@ -54,12 +85,19 @@ int parse_arguments(int argc, char *argv[], struct Superblock *superblock, char
                 return 1;
             }
 
-            *args[i - 2] = next;
+            *args[i - first - 1] = next;
         }
     }
 
-    *file = argv[1];
-    *superblock = create_superblock(MAGIC, total_blocks, total_inodes, block_size);
+    *file = argv[first];
+    // Images without features keep the original superblock layout
+    *superblock = create_superblock(
+        features ? MAGIC_FEATURES : MAGIC,
+        features,
+        total_blocks,
+        total_inodes,
+        block_size
+    );
     if (superblock->used_blocks_bitmap == NULL) {
         fprintf(stderr, "Failed to allocate memory for the blocks bitmap\n");
         return 1;
@@ -72,16 +110,17 @@ int parse_arguments(int argc, char *argv[], struct Superblock *superblock, char
     return 0;
 }
 
-void cleanup(FILE *file, struct Superblock *superblock) {
+void cleanup(struct Device *device, struct Superblock *superblock) {
     free_superblock(superblock);
-    if (fclose(file) == EOF)
+    if (close_device(device))
         fprintf(stderr, "[mkfs] Failed to close the file\n");
 }
 
 int main(int argc, char *argv[]) {
     char *filename;
+    int backend;
     struct Superblock superblock;
-    if (parse_arguments(argc, argv, &superblock, &filename))
+    if (parse_arguments(argc, argv, &superblock, &filename, &backend))
         return EXIT_FAILURE;
 
     printf("[mkfs] Resulting superblock size: %d\n", superblock.size);
@@ -89,10 +128,14 @@ int main(int argc, char *argv[]) {
     printf("[mkfs] BLOCK_SIZE: %d\n", superblock.block_size);
     printf("[mkfs] TOTAL_BLOCKS: %d\n", superblock.total_blocks);
     printf("[mkfs] TOTAL_INODES: %d\n", superblock.total_inodes);
+    printf("[mkfs] Extents: %s\n", superblock.features & FEATURE_EXTENTS ? "yes" : "no");
+    printf("[mkfs] Directory index: %s\n", superblock.features & FEATURE_DIR_INDEX ? "yes" : "no");
+    printf("[mkfs] Mount state: %s\n", superblock.features & FEATURE_MOUNT_STATE ? "yes" : "no");
 
     // Opening the file
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
+    // mkfs only writes a few blocks once, so the block cache is not used
+    struct Device device;
+    if (open_device(filename, "w+b", backend, 0, &device)) {
         fprintf(stderr, "[mkfs] Failed to open the file %s\n", filename);
         free_superblock(&superblock);
         return EXIT_FAILURE;
@@ -100,9 +143,9 @@ int main(int argc, char *argv[]) {
 
     // Padding the file
     const size_t filesize = BOOT_OFFSET + superblock.size + superblock.total_blocks * superblock.block_size;
-    if (fseek(file, filesize  - 1, SEEK_SET) || fputc(0, file) == EOF) {
+    if (resize_device(&device, filesize)) {
         fprintf(stderr, "[mkfs] Failed to pad the file to the correct size\n");
-        cleanup(file, &superblock);
+        cleanup(&device, &superblock);
         return EXIT_FAILURE;
     }
 
@@ -114,7 +157,7 @@ int main(int argc, char *argv[]) {
 
     for (size_t i = 1; i <= inode_table_blocks; ++i) {
         if (set_block_use(&superblock, i, 1)) {
-            cleanup(file, &superblock);
+            cleanup(&device, &superblock);
             return EXIT_FAILURE;
         }
     }
@@ -129,78 +172,45 @@ int main(int argc, char *argv[]) {
         .name     = "."
     };
 
-    const size_t n_root_dot_blocks = DIV_CEIL(DIRECTORY_ENTRY_SIZE, superblock.block_size);
-    uint32_t *block_ids = calloc(n_root_dot_blocks, sizeof(uint32_t));
-    if (block_ids == NULL) {
-        fprintf(stderr, "[mkfs] Failed to allocate memory for block_ids\n");
-        cleanup(file, &superblock);
-        return EXIT_FAILURE;
-    }
-
-    for (size_t i = 0; i < n_root_dot_blocks; ++i) {
-        const uint32_t block_id = inode_table_blocks + 1 + i;
-        block_ids[i] = block_id;
-
-        if (set_block_use(&superblock, block_id, 1)) {
-            cleanup(file, &superblock);
-            return EXIT_FAILURE;
-        }
-    }
+    struct FsFile root = {
+        .inode    = { .links_count = 1 },
+        .inode_id = 1,
+        .filetype = FILETYPE_DIRECTORY
+    };
 
-    if (
-         write_blocks(
-             file,
-             &superblock,
-             block_ids,
-             n_root_dot_blocks,
-             (const uint8_t*)&root_dot,
-             DIRECTORY_ENTRY_SIZE
-         )
-    ) {
-        cleanup(file, &superblock);
+    if (init_directory(&device, &superblock, &root, &root_dot, 1)) {
+        fprintf(stderr, "[mkfs] Failed to write the root directory contents\n");
+        cleanup(&device, &superblock);
         return EXIT_FAILURE;
     }
 
-    free(block_ids);
-
-    printf("[mkfs] Wrote the root directory dot entry (%d blocks)\n", n_root_dot_blocks);
+    printf(
+        "[mkfs] Wrote the root directory dot entry (%d blocks)\n",
+        DIV_CEIL(root.inode.file_size, superblock.block_size)
+    );
 
     // Writing the inode for the root directory
-    uint32_t root_blocks[INODE_BLOCK_COUNT];
-    for (size_t i = 0; i < n_root_dot_blocks; ++i) {
-        const uint32_t block_id = inode_table_blocks + 1 + i;
-        root_blocks[i] = block_id;
-    }
-    for (size_t i = n_root_dot_blocks; i < INODE_BLOCK_COUNT; ++i)
-        root_blocks[i] = 0;
-
-    struct Inode root = {
-        .file_size   = DIRECTORY_ENTRY_SIZE,
-        .links_count = 1
-    };
-    memcpy(root.blocks, root_blocks, sizeof(root.blocks));
-
-    if(write_inode(file, &superblock, &root, 1)) {
-        cleanup(file, &superblock);
+    if(write_inode(&device, &superblock, &root.inode, 1)) {
+        cleanup(&device, &superblock);
         return EXIT_FAILURE;
     }
 
     if(set_inode_use(&superblock, 1, 1)) {
-        cleanup(file, &superblock);
+        cleanup(&device, &superblock);
         return EXIT_FAILURE;
     }
 
     printf("[mkfs] Wrote the root directory inode\n");
 
     // Writing the superblock
-    if (write_superblock(&superblock, file)) {
+    if (write_superblock(&superblock, &device)) {
         fprintf(stderr, "[mkfs] Failed to write the superblock\n");
-        cleanup(file, &superblock);
+        cleanup(&device, &superblock);
         return EXIT_FAILURE;
     }
 
     // Closing the file
-    if (fclose(file) == EOF) {
+    if (close_device(&device)) {
         fprintf(stderr, "[mkfs] Failed to close the file\n");
         free_superblock(&superblock);
         return EXIT_FAILURE;
@@ -1,5 +1,6 @@
 #include "commands.h"
 
+#include <errno.h>
 #include <string.h>
 
 #include "../filesystem/block_ops.h"
@@ -12,21 +13,25 @@
 int help(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     printf(
-        "help           -- show this message\n"
-        "echo MESSAGE   -- print out MESSAGE\n"
-        "ls             -- list all files in the current directory\n"
-        "touch FILENAME -- create a file called FILENAME\n"
-        "mkdir DIRNAME  -- create a directory called DIRNAME\n"
-        "cd DIRNAME     -- change your current directory to DIRNAME\n"
-        "stat FILENAME  -- get information about file/directory FILENAME\n"
-        "edit FILENAME  -- edit the file FILENAME\n"
-        "cat FILENAME   -- print the file FILENAME to stdout\n"
-        "rm FILENAME    -- remove the file/directory FILENAME *in the current directory*\n"
-        "quit           -- quit this pseudo-shell\n"
+        "help                   -- show this message\n"
+        "echo MESSAGE           -- print out MESSAGE\n"
+        "ls                     -- list all files in the current directory\n"
+        "touch FILENAME         -- create a file called FILENAME\n"
+        "mkdir DIRNAME          -- create a directory called DIRNAME\n"
+        "cd DIRNAME             -- change your current directory to DIRNAME\n"
+        "stat FILENAME          -- get information about file/directory FILENAME\n"
+        "edit FILENAME          -- edit the file FILENAME\n"
+        "append FILENAME        -- append a line to the file FILENAME\n"
+        "truncate FILENAME SIZE -- cut or zero-extend the file FILENAME to SIZE bytes\n"
+        "cat FILENAME           -- print the file FILENAME to stdout\n"
+        "rm FILENAME            -- remove the file/directory FILENAME *in the current directory*\n"
+        "sync                   -- write all cached blocks back to the file\n"
+        "cache                  -- show the block and dentry cache statistics\n"
+        "quit                   -- quit this pseudo-shell\n"
     );
 
     return RETURN_SUCCESS;
@@ -35,7 +40,7 @@ int help(
 int echo(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     if (args)
@@ -49,17 +54,17 @@ int echo(
 int ls(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     struct DirectoryEntry *entries;
-    if (load_contents(file, superblock, fsfile, (uint8_t**)&entries)) {
+    size_t n_entries;
+    if (list_entries(device, superblock, fsfile, &entries, &n_entries)) {
         fprintf(stderr, "[openfs] Failed to load directory contents\n");
         return RETURN_ERROR;
     }
 
-    const size_t n_entries = fsfile->inode.file_size / DIRECTORY_ENTRY_SIZE;
-    printf("Total %d\n", n_entries);
+    printf("Total %zu\n", n_entries);
     for (size_t i = 0; i < n_entries; ++i)
         printf("%d\t%s\t%s\n", entries[i].inode_id, filetype_str(entries[i].filetype), entries[i].name);
 
@@ -70,7 +75,7 @@ int ls(
 static int create_file(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args,
      const uint8_t filetype,
      struct FsFile *created
@@ -96,39 +101,21 @@ static int create_file(
     };
     strncpy(entry.name, args, MAX_FILENAME_LEN - 1);
 
-    struct DirectoryEntry *entries;
-    if (load_contents(file, superblock, fsfile, (uint8_t**)&entries)) {
-        fprintf(stderr, "[openfs] Failed to load directory contents\n");
+    struct DirectoryEntry existing;
+    const int found = find_entry(device, superblock, fsfile, entry.name, &existing);
+    if (found == -1) {
+        fprintf(stderr, "[openfs] Failed to look up the filename\n");
+        return RETURN_ERROR;
+    } else if (found) {
+        fprintf(stderr, "[openfs] Cannot create the file -- this filename is already used\n");
         return RETURN_ERROR;
     }
 
-    for (size_t i = 0; i < fsfile->inode.file_size / DIRECTORY_ENTRY_SIZE; ++i) {
-        if (strcmp(entries[i].name, entry.name) == 0) {
-            fprintf(stderr, "[openfs] Cannot create the file -- this filename is already used\n");
-            free(entries);
-            return RETURN_ERROR;
-        }
-    }
-
-    const size_t new_size = fsfile->inode.file_size + DIRECTORY_ENTRY_SIZE;
-    struct DirectoryEntry *temp = realloc(entries, new_size);
-    if (!temp) {
-        fprintf(stderr, "[openfs] Failed to reallocate memory for directory entries\n");
-        free(entries);
-        return 1;
-    }
-
-    entries = temp;
-    entries[fsfile->inode.file_size / DIRECTORY_ENTRY_SIZE] = entry;
-
-    if (write_contents(file, superblock, fsfile, (const uint8_t*)entries, new_size)) {
+    if (add_entry(device, superblock, fsfile, &entry)) {
         fprintf(stderr, "[openfs] Failed to write the new file contents\n");
-        free(entries);
         return 1;
     }
 
-    free(entries);
-
     if (set_inode_use(superblock, inode_id, 1)) {
         fprintf(stderr, "[openfs] Failed to set inode use\n");
         return RETURN_ERROR;
@@ -140,7 +127,7 @@ static int create_file(
         .blocks      = {0}
     };
 
-    if (write_inode(file, superblock, &inode, inode_id)) {
+    if (write_inode(device, superblock, &inode, inode_id)) {
         fprintf(stderr, "[openfs] Failed to write the new file inode");
         return RETURN_ERROR;
     }
@@ -155,14 +142,14 @@ static int create_file(
             return RETURN_ERROR;
     }
 
-    if (write_inode(file, superblock, &fsfile->inode, fsfile->inode_id)) {
+    if (write_inode(device, superblock, &fsfile->inode, fsfile->inode_id)) {
         fprintf(stderr, "[openfs] Failed to write the current directory inode");
         if (created)
             free(created->fullname);
         return RETURN_ERROR;
     }
 
-    if (write_superblock(superblock, file)) {
+    if (write_superblock(superblock, device)) {
         fprintf(stderr, "[openfs] Failed to write the superblock");
         if (created)
             free(created->fullname);
@@ -175,20 +162,20 @@ static int create_file(
 int touch(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
-    return create_file(superblock, fsfile, file, args, FILETYPE_FILE, NULL);
+    return create_file(superblock, fsfile, device, args, FILETYPE_FILE, NULL);
 }
 
 int mkdir(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     struct FsFile dir_fsfile;
-    if (create_file(superblock, fsfile, file, args, FILETYPE_DIRECTORY, &dir_fsfile))
+    if (create_file(superblock, fsfile, device, args, FILETYPE_DIRECTORY, &dir_fsfile))
         return RETURN_ERROR;
 
     struct DirectoryEntry entries[] = {
@@ -206,21 +193,21 @@ int mkdir(
         }
     };
 
-    if (write_contents(file, superblock, &dir_fsfile, (const uint8_t*)entries, DIRECTORY_ENTRY_SIZE * 2)) {
+    if (init_directory(device, superblock, &dir_fsfile, entries, 2)) {
         fprintf(stderr, "[openfs] Failed to create . and .. for the created directory\n");
         free(dir_fsfile.fullname);
         return RETURN_ERROR;
     }
 
     ++dir_fsfile.inode.links_count;
-    if (write_inode(file, superblock, &dir_fsfile.inode, dir_fsfile.inode_id)) {
+    if (write_inode(device, superblock, &dir_fsfile.inode, dir_fsfile.inode_id)) {
         fprintf(stderr, "[openfs] Failed to rewrite the old inode for the created directory\n");
         free(dir_fsfile.fullname);
         return RETURN_ERROR;
     }
 
     ++fsfile->inode.links_count;
-    if (write_inode(file, superblock, &fsfile->inode, fsfile->inode_id)) {
+    if (write_inode(device, superblock, &fsfile->inode, fsfile->inode_id)) {
         fprintf(stderr, "[openfs] Failed to rewrite the old inode for the current directory\n");
         free(dir_fsfile.fullname);
         return RETURN_ERROR;
@@ -228,7 +215,7 @@ int mkdir(
 
     free(dir_fsfile.fullname);
 
-    if (write_superblock(superblock, file)) {
+    if (write_superblock(superblock, device)) {
         fprintf(stderr, "[openfs] Failed to write the superblock\n");
         return RETURN_ERROR;
     }
@@ -239,7 +226,7 @@ int mkdir(
 int cd(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     if (args == NULL) {
@@ -248,7 +235,7 @@ int cd(
     }
 
     struct FsFile found_file;
-    if (find_file(file, superblock, fsfile, args, &found_file))
+    if (find_file(device, superblock, fsfile, args, &found_file))
         return RETURN_ERROR;
 
     if (found_file.filetype != FILETYPE_DIRECTORY) {
@@ -263,7 +250,7 @@ int cd(
 int stat(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     if (args == NULL) {
@@ -272,7 +259,7 @@ int stat(
     }
 
     struct FsFile found_file;
-    if (find_file(file, superblock, fsfile, args, &found_file))
+    if (find_file(device, superblock, fsfile, args, &found_file))
         return RETURN_ERROR;
 
     printf(
@@ -287,6 +274,8 @@ int stat(
         found_file.inode.file_size,
         found_file.inode.links_count
     );
+    if (superblock->features & FEATURE_EXTENTS)
+        printf("Extents: %d\n", found_file.inode.blocks[EXTENT_COUNT]);
 
     return RETURN_SUCCESS;
 }
@@ -294,7 +283,7 @@ int stat(
 int edit(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     if (args == NULL) {
@@ -303,7 +292,7 @@ int edit(
     }
 
     struct FsFile found_file;
-    if (find_file(file, superblock, fsfile, args, &found_file))
+    if (find_file(device, superblock, fsfile, args, &found_file))
         return RETURN_ERROR;
 
     if (found_file.filetype != FILETYPE_FILE) {
@@ -319,17 +308,17 @@ int edit(
         return RETURN_ERROR;
     }
 
-    if (write_contents(file, superblock, &found_file, (const uint8_t*)edit_data, strlen(edit_data) * sizeof(char))) {
+    if (write_contents(device, superblock, &found_file, (const uint8_t*)edit_data, strlen(edit_data) * sizeof(char))) {
         fprintf(stderr, "[openfs] Failed to write the data\n");
         return RETURN_ERROR;
     }
 
-    if (write_inode(file, superblock, &found_file.inode, found_file.inode_id)) {
+    if (write_inode(device, superblock, &found_file.inode, found_file.inode_id)) {
         fprintf(stderr, "[openfs] Failed to write the inode\n");
         return RETURN_ERROR;
     }
 
-    if (write_superblock(superblock, file)) {
+    if (write_superblock(superblock, device)) {
         fprintf(stderr, "[openfs] Failed to write the superblock\n");
         return RETURN_ERROR;
     }
@@ -337,10 +326,10 @@ int edit(
     return 0;
 }
 
-int cat(
+int append(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     if (args == NULL) {
@@ -349,7 +338,7 @@ int cat(
     }
 
     struct FsFile found_file;
-    if (find_file(file, superblock, fsfile, args, &found_file))
+    if (find_file(device, superblock, fsfile, args, &found_file))
         return RETURN_ERROR;
 
     if (found_file.filetype != FILETYPE_FILE) {
@@ -357,14 +346,121 @@ int cat(
         return RETURN_ERROR;
     }
 
-    uint8_t *contents;
-    if (load_contents(file, superblock, &found_file, (uint8_t**)&contents)) {
-        fprintf(stderr, "[openfs] Failed to load the file\n");
+    printf("[openfs] Enter the data to append:\n");
+
+    char append_data[MAX_EDIT_LEN];
+    if(fgets(append_data, MAX_EDIT_LEN, stdin) != append_data) {
+        fprintf(stderr, "[openfs] Failed to read the data\n");
+        return RETURN_ERROR;
+    }
+
+    if (
+         write_range(
+             device,
+             superblock,
+             &found_file,
+             found_file.inode.file_size,
+             (const uint8_t*)append_data,
+             strlen(append_data) * sizeof(char)
+         )
+    ) {
+        fprintf(stderr, "[openfs] Failed to write the data\n");
+        return RETURN_ERROR;
+    }
+
+    if (write_inode(device, superblock, &found_file.inode, found_file.inode_id)) {
+        fprintf(stderr, "[openfs] Failed to write the inode\n");
+        return RETURN_ERROR;
+    }
+
+    if (write_superblock(superblock, device)) {
+        fprintf(stderr, "[openfs] Failed to write the superblock\n");
+        return RETURN_ERROR;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+int truncate(
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     struct Device *device,
+     char* args
+) {
+    char *size_arg = args ? strrchr(args, ' ') : NULL;
+    if (size_arg == NULL) {
+        fprintf(stderr, "[openfs] Usage: truncate FILENAME SIZE\n");
+        return RETURN_ERROR;
+    }
+    *size_arg++ = '\0';
+
+    char *end;
+    errno = 0;
+    const unsigned long long new_size = strtoull(size_arg, &end, 10);
+    if (end == size_arg || *end != '\0' || errno == ERANGE || size_arg[0] == '-' || new_size > UINT32_MAX) {
+        fprintf(stderr, "[openfs] Invalid size %s\n", size_arg);
+        return RETURN_ERROR;
+    }
+
+    struct FsFile found_file;
+    if (find_file(device, superblock, fsfile, args, &found_file))
+        return RETURN_ERROR;
+
+    if (found_file.filetype != FILETYPE_FILE) {
+        fprintf(stderr, "Is not a plain file\n");
+        return RETURN_ERROR;
+    }
+
+    if (truncate_file(device, superblock, &found_file, new_size)) {
+        fprintf(stderr, "[openfs] Failed to truncate the file\n");
+        return RETURN_ERROR;
+    }
+
+    if (write_inode(device, superblock, &found_file.inode, found_file.inode_id)) {
+        fprintf(stderr, "[openfs] Failed to write the inode\n");
         return RETURN_ERROR;
     }
 
-    printf("%s", contents);
-    free(contents);
+    if (write_superblock(superblock, device)) {
+        fprintf(stderr, "[openfs] Failed to write the superblock\n");
+        return RETURN_ERROR;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+int cat(
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     struct Device *device,
+     char* args
+) {
+    if (args == NULL) {
+        fprintf(stderr, "[openfs] Args cannot be NULL for this command\n");
+        return RETURN_ERROR;
+    }
+
+    struct FsFile found_file;
+    if (find_file(device, superblock, fsfile, args, &found_file))
+        return RETURN_ERROR;
+
+    if (found_file.filetype != FILETYPE_FILE) {
+        fprintf(stderr, "Is not a plain file\n");
+        return RETURN_ERROR;
+    }
+
+    // Streaming through a fixed buffer, so that large files do not have to fit in memory
+    uint8_t buffer[CAT_BUFFER_SIZE];
+    size_t offset = 0, read_len;
+    do {
+        if (read_range(device, superblock, &found_file, offset, CAT_BUFFER_SIZE, buffer, &read_len)) {
+            fprintf(stderr, "[openfs] Failed to read the file\n");
+            return RETURN_ERROR;
+        }
+
+        fwrite(buffer, sizeof(uint8_t), read_len, stdout);
+        offset += read_len;
+    } while (read_len == CAT_BUFFER_SIZE);
 
     return RETURN_SUCCESS;
 }
@@ -372,7 +468,7 @@ int cat(
 int rm(
      struct Superblock *superblock,
      struct FsFile *fsfile,
-     FILE *file,
+     struct Device *device,
      char* args
 ) {
     if (args == NULL) {
@@ -383,12 +479,12 @@ int rm(
         return RETURN_ERROR;
     }
 
-    if (remove_file(file, superblock, fsfile, args)) {
+    if (remove_file(device, superblock, fsfile, args)) {
         fprintf(stderr, "[openfs] Failed to remove file\n");
         return RETURN_ERROR;
     }
 
-    if (write_superblock(superblock, file)) {
+    if (write_superblock(superblock, device)) {
         fprintf(stderr, "[openfs] Failed to write the superblock\n");
         return 1;
     }
@@ -396,6 +492,64 @@ int rm(
     return RETURN_SUCCESS;
 }
 
+int sync(
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     struct Device *device,
+     char* args
+) {
+    if (sync_device(device)) {
+        fprintf(stderr, "[openfs] Failed to sync the file\n");
+        return RETURN_ERROR;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+int cache(
+     struct Superblock *superblock,
+     struct FsFile *fsfile,
+     struct Device *device,
+     char* args
+) {
+    const struct BlockCache *block_cache = &device->cache;
+
+    size_t used = 0, dirty = 0;
+    if (block_cache->entries) {
+        for (size_t i = 0; i < block_cache->capacity; ++i) {
+            if (block_cache->entries[i].block_id != 0) {
+                ++used;
+                if (block_cache->entries[i].dirty)
+                    ++dirty;
+            }
+        }
+    }
+
+    printf(
+        "Capacity: %zu blocks\n"
+        "Used: %zu blocks (%zu dirty)\n"
+        "Hits: %zu\n"
+        "Misses: %zu\n"
+        "Writebacks: %zu\n",
+        block_cache->capacity,
+        used,
+        dirty,
+        block_cache->hits,
+        block_cache->misses,
+        block_cache->writebacks
+    );
+
+    const struct DentryCache *dentries = &device->dentries;
+    printf(
+        "Dentry hits: %zu\n"
+        "Dentry misses: %zu\n",
+        dentries->hits,
+        dentries->misses
+    );
+
+    return RETURN_SUCCESS;
+}
+
 const command_func_ptr commands[] = {
     &help,
     &echo,
@@ -405,8 +559,12 @@ const command_func_ptr commands[] = {
     &cd,
     &stat,
     &edit,
+    &append,
+    &truncate,
     &cat,
-    &rm
+    &rm,
+    &sync,
+    &cache
 };
 const char* command_names[] = {
     "help",
@@ -417,7 +575,11 @@ const char* command_names[] = {
     "cd",
     "stat",
     "edit",
+    "append",
+    "truncate",
     "cat",
-    "rm"
+    "rm",
+    "sync",
+    "cache"
 };
 const size_t n_commands = sizeof(command_names) / sizeof(const char*);
@@ -4,11 +4,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "../filesystem/device.h"
 #include "../filesystem/fs_file.h"
 #include "../filesystem/inode.h"
 #include "../filesystem/superblock.h"
 
-typedef int (*command_func_ptr)(struct Superblock*, struct FsFile *fsfile, FILE*, char*);
+typedef int (*command_func_ptr)(struct Superblock*, struct FsFile *fsfile, struct Device*, char*);
 
 extern const command_func_ptr commands[];
 extern const char*            command_names[];
@@ -16,6 +17,9 @@ extern const size_t           n_commands;
 
 #define MAX_COMMAND_LEN 255
 #define MAX_EDIT_LEN    10000
+#define CAT_BUFFER_SIZE 4096
+
+#define DEFAULT_CACHE_BLOCKS 1024
 
 #define RETURN_SUCCESS  0
 #define RETURN_ERROR    1
@@ -1,8 +1,10 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "../filesystem/device.h"
 #include "../filesystem/fs_file.h"
 #include "../filesystem/directory_entry.h"
 #include "../filesystem/inode.h"
@@ -10,13 +12,21 @@
 
 #include "commands.h"
 
-static int update(FILE *file, struct Superblock *superblock, struct FsFile *fsfile) {
-    if (read_superblock(superblock, file)) {
+static int update(struct Device *device, struct Superblock *superblock, struct FsFile *fsfile) {
+    int changed;
+    if (revalidate_superblock(superblock, device, &changed)) {
         fprintf(stderr, "[openfs] Failed to update the superblock\n");
         return 1;
     }
 
-    if (read_inode(file, superblock, &fsfile->inode, fsfile->inode_id)) {
+    // Someone else has written to the file, so nothing that was cached from it can be trusted
+    if (changed) {
+        drop_clean_blocks(&device->cache);
+        clear_dentry_cache(&device->dentries);
+        clear_extent_map(&device->extents);
+    }
+
+    if (read_inode(device, superblock, &fsfile->inode, fsfile->inode_id)) {
         fprintf(stderr, "[openfs] Failed to update the inode\n");
         return 1;
     }
@@ -24,27 +34,60 @@ static int update(FILE *file, struct Superblock *superblock, struct FsFile *fsfi
     return 0;
 }
 
+static void print_usage(const char *launch_name) {
+    fprintf(stderr, "Usage: %s [-m] FILE [CACHE_BLOCKS]\n", launch_name);
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+    int backend = DEVICE_BACKEND_STDIO;
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; ++first) {
+        if (strcmp(argv[first], "-m") == 0) {
+            backend = DEVICE_BACKEND_MMAP;
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - first != 1 && argc - first != 2) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    FILE *file = fopen(argv[1], "r+b");
-    if (!file) {
-        fprintf(stderr, "[openfs] Failed to open the file %s\n", argv[1]);
+    size_t cache_blocks = DEFAULT_CACHE_BLOCKS;
+    if (argc - first == 2) {
+        char *end;
+        errno = 0;
+        long next = strtol(argv[first + 1], &end, 10);
+        if (end == argv[first + 1] || *end != '\0' || errno == ERANGE || next < 0) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        cache_blocks = next;
+    }
+
+    struct Device device;
+    if (open_device(argv[first], "r+b", backend, cache_blocks, &device)) {
+        fprintf(stderr, "[openfs] Failed to open the file %s\n", argv[first]);
         return EXIT_FAILURE;
     }
 
     struct Superblock superblock;
-    if (read_superblock(&superblock, file)) {
-        fprintf(stderr, "[openfs] Failed to read the superblock\n");
+    if (mount_superblock(&superblock, &device)) {
+        fprintf(stderr, "[openfs] Failed to mount the filesystem\n");
+        close_device(&device);
         return EXIT_FAILURE;
     }
 
     struct Inode inode;
-    if (read_inode(file, &superblock, &inode, 1)) {
+    if (read_inode(&device, &superblock, &inode, 1)) {
         fprintf(stderr, "Failed to read the root directory inode\n");
+        unmount_superblock(&superblock, &device);
+        free_superblock(&superblock);
+        close_device(&device);
         return EXIT_FAILURE;
     }
 
@@ -57,7 +100,6 @@ int main(int argc, char* argv[]) {
 
     int running = 1;
     while (running) {
-        update(file, &superblock, &current_dir);
         printf("%s > ", current_dir.fullname);
 
         char command[MAX_COMMAND_LEN];
@@ -66,6 +108,12 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
+        // The file may have changed while waiting for the command, stale bitmaps must not be written back
+        if (update(&device, &superblock, &current_dir)) {
+            fprintf(stderr, "[openfs] Failed to re-read the filesystem, quitting\n");
+            break;
+        }
+
         const size_t newline_index = strcspn(command, "\n");
         if (newline_index < MAX_COMMAND_LEN)
             command[newline_index] = '\0';
@@ -89,7 +137,7 @@ int main(int argc, char* argv[]) {
         int command_recognized = 0;
         for (size_t i = 0; i < n_commands; ++i) {
             if (strcmp(command, command_names[i]) == 0) {
-                int return_code = commands[i](&superblock, &current_dir, file, args);
+                int return_code = commands[i](&superblock, &current_dir, &device, args);
                 if (return_code == RETURN_ERROR) {
                     fprintf(stderr, "[openfs] Command returned the error code RETURN_ERROR\n");
                 } else if (return_code == RETURN_CRITICAL) {
@@ -106,9 +154,12 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "[openfs] Unrecognized command\n");
     }
 
+    if (unmount_superblock(&superblock, &device))
+        fprintf(stderr, "[openfs] Failed to mark the filesystem as unmounted\n");
+
     free_superblock(&superblock);
 
-    if (fclose(file) == EOF) {
+    if (close_device(&device)) {
         fprintf(stderr, "[openfs] Failed to close the file\n");
         return EXIT_FAILURE;
     }
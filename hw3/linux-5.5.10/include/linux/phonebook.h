@@ -0,0 +1,34 @@
+#ifndef __LINUX_PHONEBOOK_H
+#define __LINUX_PHONEBOOK_H
+
+#include <linux/types.h>
+#include <linux/user_data.h>
+
+struct module;
+
+/*
+*  Operations of the Phonebook module, called by the syscalls directly.
+*  All the strings are in the kernel space and NUL-terminated, the errors are negative error codes.
+*/
+
+#define PHONEBOOK_RECORD_SIZE 512 // enough for the strings of any record added through the device
+
+struct phonebook_ops
+{
+    struct module *owner;
+    // Finds the first user with this surname, the strings of the record are packed into the buffer;
+    // called under rcu_read_lock(), so it must not sleep
+    int (*get)(const char *surname, struct user_data *user, char *buffer, size_t size);
+    int (*add)(const struct user_data *user);
+    // Removes the first user with this surname
+    int (*del)(const char *surname);
+    // Packs the users added after the one at the cursor into the buffer (see user_record_size()),
+    // moves the cursor to the last one packed and returns the number of bytes used (0 when there are no more)
+    long (*scan)(u64 *cursor, char *buffer, size_t size);
+};
+
+// Only one set of operations may be registered at a time
+int phonebook_register_ops(const struct phonebook_ops *ops);
+void phonebook_unregister_ops(const struct phonebook_ops *ops);
+
+#endif
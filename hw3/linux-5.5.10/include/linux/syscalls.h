@@ -56,6 +56,7 @@ struct __kernel_timex;
 struct timezone;
 struct tms;
 struct user_data;
+struct user_record;
 struct utimbuf;
 struct mq_attr;
 struct compat_stat;
@@ -1011,6 +1012,24 @@ asmlinkage long sys_get_user(
 );
 asmlinkage long sys_add_user(struct user_data __user *input_data);
 asmlinkage long sys_del_user(const char __user *surname, unsigned int len);
+asmlinkage long sys_get_users(
+	struct user_data __user *users,
+	__s32 __user *statuses,
+	unsigned int count
+);
+asmlinkage long sys_add_users(
+	struct user_data __user *users,
+	__s32 __user *statuses,
+	unsigned int count
+);
+asmlinkage long sys_get_user_packed(
+	const char __user *surname,
+	unsigned int len,
+	struct user_record __user *record,
+	unsigned int size
+);
+asmlinkage long sys_add_user_packed(const struct user_record __user *record, unsigned int size);
+asmlinkage long sys_scan_users(u64 __user *cursor, void __user *buffer, unsigned int size);
 
 /*
  * Architecture-specific system calls
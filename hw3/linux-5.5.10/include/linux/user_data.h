@@ -14,4 +14,29 @@ struct user_data
     long age;
 };
 
+/*
+*  Packed record: the header is followed by the strings, each one terminated with '\0':
+*  "name\0surname\0phone\0email\0". The lengths don't include the terminators.
+*  A whole record goes to and from the kernel with a single copy.
+*/
+
+#define USER_RECORD_MAX 512 // bytes of a buffer passed to add_user_packed, the header included; any record that can be added fits
+#define USER_RECORD_ALIGN 8   // of every record in a scan buffer
+
+struct user_record
+{
+    __s64 age;
+    __u32 name_len, surname_len, phone_len, email_len;
+    char strings[];
+};
+
+// The records of a scan buffer follow each other, so this is where the next one starts
+static inline __u32 user_record_size(const struct user_record *record)
+{
+    __u32 size = sizeof(struct user_record) +
+                 record->name_len + record->surname_len + record->phone_len + record->email_len + 4; // 4 terminators
+
+    return (size + USER_RECORD_ALIGN - 1) & ~(__u32)(USER_RECORD_ALIGN - 1);
+}
+
 #endif
@@ -859,9 +859,19 @@ __SYSCALL(__NR_get_user, sys_get_user)
 __SYSCALL(__NR_add_user, sys_add_user)
 #define __NR_del_user 439
 __SYSCALL(__NR_del_user, sys_del_user)
+#define __NR_get_users 440
+__SYSCALL(__NR_get_users, sys_get_users)
+#define __NR_add_users 441
+__SYSCALL(__NR_add_users, sys_add_users)
+#define __NR_get_user_packed 442
+__SYSCALL(__NR_get_user_packed, sys_get_user_packed)
+#define __NR_add_user_packed 443
+__SYSCALL(__NR_add_user_packed, sys_add_user_packed)
+#define __NR_scan_users 444
+__SYSCALL(__NR_scan_users, sys_scan_users)
 
 #undef __NR_syscalls
-#define __NR_syscalls 440
+#define __NR_syscalls 445
 
 /*
  * 32 bit systems traditionally used different
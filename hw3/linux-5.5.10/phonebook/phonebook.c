@@ -1,99 +1,94 @@
 #include <linux/kernel.h>
 #include <linux/syscalls.h>
 #include <linux/user_data.h>
+#include <linux/phonebook.h>
 
 #include <asm/errno.h>
 #include <asm/uaccess.h>
-#include <linux/err.h>
-#include <linux/fcntl.h>
-#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 
 #include <linux/string.h>
 #include <linux/types.h>
 
-#define DEVICE_FILE "/dev/phonebook_device"
 #define BUFFER_SIZE 256 // Phonebook module buffer size
-#define USER_STRINGS 5
 
-static struct file *open_file(const char *path, int flags)
+static const struct phonebook_ops __rcu *phonebook_ops;
+static DEFINE_MUTEX(phonebook_ops_mutex); // serializes registrations
+
+int phonebook_register_ops(const struct phonebook_ops *ops)
 {
-    struct file *filp = filp_open(path, flags, 0);
-    if (IS_ERR(filp))
-        return NULL;
+    int err = 0;
 
-    return filp;
-}
+    mutex_lock(&phonebook_ops_mutex);
+    if (rcu_access_pointer(phonebook_ops))
+        err = -EBUSY;
+    else
+        rcu_assign_pointer(phonebook_ops, ops);
+    mutex_unlock(&phonebook_ops_mutex);
 
-static void close_file(struct file *filp)
-{
-    filp_close(filp, NULL);
+    return err;
 }
+EXPORT_SYMBOL_GPL(phonebook_register_ops);
 
-static int allocate_user_data(struct user_data *to,
-                              struct user_data *from)
+void phonebook_unregister_ops(const struct phonebook_ops *ops)
 {
-    to->surname = NULL;
-    to->name = NULL;
-    to->phone = NULL;
-    to->email = NULL;
-
-    to->surname = (char *)kmalloc(sizeof(char) * (from->surname_len + 1), GFP_KERNEL);
-    if (!to->surname)
-        return -EFAULT;
+    mutex_lock(&phonebook_ops_mutex);
+    if (rcu_access_pointer(phonebook_ops) == ops)
+        RCU_INIT_POINTER(phonebook_ops, NULL);
+    mutex_unlock(&phonebook_ops_mutex);
 
-    to->name = (char *)kmalloc(sizeof(char) * (from->name_len + 1), GFP_KERNEL);
-    if (!to->name)
-    {
-        kfree(to->surname);
-        to->surname = NULL;
-
-        return -EFAULT;
-    }
-
-    to->phone = (char *)kmalloc(sizeof(char) * (from->phone_len + 1), GFP_KERNEL);
-    if (!to->phone)
-    {
-        kfree(to->surname);
-        to->surname = NULL;
-
-        kfree(to->name);
-        to->name = NULL;
-
-        return -EFAULT;
-    }
-
-    to->email = (char *)kmalloc(sizeof(char) * (from->email_len + 1), GFP_KERNEL);
-    if (!to->email)
-    {
-        kfree(to->surname);
-        to->surname = NULL;
+    synchronize_rcu(); // nobody is between get_ops() and try_module_get() or in get_user_rcu() anymore
+}
+EXPORT_SYMBOL_GPL(phonebook_unregister_ops);
 
-        kfree(to->name);
-        to->name = NULL;
+// The module can't go away until put_ops(), returns NULL if it isn't loaded
+static const struct phonebook_ops *get_ops(void)
+{
+    const struct phonebook_ops *ops;
 
-        kfree(to->phone);
-        to->phone = NULL;
+    rcu_read_lock();
+    ops = rcu_dereference(phonebook_ops);
+    if (ops && !try_module_get(ops->owner))
+        ops = NULL;
+    rcu_read_unlock();
 
-        return -EFAULT;
-    }
+    return ops;
+}
 
-    return 0;
+static void put_ops(const struct phonebook_ops *ops)
+{
+    module_put(ops->owner);
 }
 
-static void deallocate_user_data(struct user_data *user)
+// The lookup doesn't sleep, so it doesn't pin the module: phonebook_unregister_ops() waits for it instead,
+// and concurrent callers share no counter and no state, every result goes straight to its own buffer
+static int get_user_rcu(const char *surname, struct user_data *user, char *buffer, size_t size)
 {
-    kfree(user->surname);
-    kfree(user->name);
-    kfree(user->phone);
-    kfree(user->email);
+    const struct phonebook_ops *ops;
+    int err = -ENOENT;
+
+    rcu_read_lock();
+    ops = rcu_dereference(phonebook_ops);
+    if (ops)
+        err = ops->get(surname, user, buffer, size);
+    rcu_read_unlock();
+
+    return err;
 }
 
+// The strings are packed into the buffer, so nothing has to be allocated
 static int copy_user_data_from_user(struct user_data *to,
-                                    struct user_data __user *from)
+                                    struct user_data __user *from,
+                                    char buffer[],
+                                    size_t size)
 {
-    int err;
     struct user_data kern_from;
+    char __user *user_strings[4];
+    char **strings[4];
+    size_t lengths[4], i;
 
     if (!to || !from)
         return -EFAULT;
@@ -101,17 +96,34 @@ static int copy_user_data_from_user(struct user_data *to,
     if (copy_from_user(&kern_from, from, sizeof(struct user_data)))
         return -EFAULT;
 
-    err = allocate_user_data(to, &kern_from);
-    if (err)
-        return err;
+    user_strings[0] = kern_from.surname;
+    user_strings[1] = kern_from.name;
+    user_strings[2] = kern_from.phone;
+    user_strings[3] = kern_from.email;
+
+    lengths[0] = kern_from.surname_len;
+    lengths[1] = kern_from.name_len;
+    lengths[2] = kern_from.phone_len;
+    lengths[3] = kern_from.email_len;
+
+    strings[0] = &to->surname;
+    strings[1] = &to->name;
+    strings[2] = &to->phone;
+    strings[3] = &to->email;
 
-    if (copy_from_user(to->surname, kern_from.surname, sizeof(char) * kern_from.surname_len) ||
-        copy_from_user(to->name, kern_from.name, sizeof(char) * kern_from.name_len) ||
-        copy_from_user(to->phone, kern_from.phone, sizeof(char) * kern_from.phone_len) ||
-        copy_from_user(to->email, kern_from.email, sizeof(char) * kern_from.email_len))
+    for (i = 0; i < 4; ++i)
     {
-        deallocate_user_data(to);
-        return -EFAULT;
+        if (lengths[i] >= size) // +1 for '\0'
+            return -EOVERFLOW;
+
+        if (copy_from_user(buffer, user_strings[i], sizeof(char) * lengths[i]))
+            return -EFAULT;
+
+        buffer[lengths[i]] = '\0';
+        *strings[i] = buffer;
+
+        buffer += lengths[i] + 1;
+        size -= lengths[i] + 1;
     }
 
     to->surname_len = kern_from.surname_len;
@@ -120,238 +132,412 @@ static int copy_user_data_from_user(struct user_data *to,
     to->email_len = kern_from.email_len;
     to->age = kern_from.age;
 
-    to->surname[kern_from.surname_len] = '\0';
-    to->name[kern_from.name_len] = '\0';
-    to->phone[kern_from.phone_len] = '\0';
-    to->email[kern_from.email_len] = '\0';
-
     return 0;
 }
 
+// user_ptrs is the copy of the header at to, it is needed to extract the C-string pointers from user space
 static int copy_user_data_to_user(struct user_data __user *to,
+                                  struct user_data *user_ptrs,
                                   struct user_data *from)
 {
-    struct user_data user_ptrs; // needed to extract the C-string pointers from user space
-
     if (!to || !from)
         return -EFAULT;
 
-    if (copy_from_user(&user_ptrs, to, sizeof(struct user_data)))
-        return -EFAULT;
-
     // All pointers are in the user space, despite user_ptrs being in the kernel space!
     // +1 for '\0'
-    if (copy_to_user(user_ptrs.surname, from->surname, sizeof(char) * (from->surname_len + 1)) ||
-        copy_to_user(user_ptrs.name, from->name, sizeof(char) * (from->name_len + 1)) ||
-        copy_to_user(user_ptrs.phone, from->phone, sizeof(char) * (from->phone_len + 1)) ||
-        copy_to_user(user_ptrs.email, from->email, sizeof(char) * (from->email_len + 1)))
+    if (copy_to_user(user_ptrs->surname, from->surname, sizeof(char) * (from->surname_len + 1)) ||
+        copy_to_user(user_ptrs->name, from->name, sizeof(char) * (from->name_len + 1)) ||
+        copy_to_user(user_ptrs->phone, from->phone, sizeof(char) * (from->phone_len + 1)) ||
+        copy_to_user(user_ptrs->email, from->email, sizeof(char) * (from->email_len + 1)))
         return -EFAULT;
 
-    if (put_user(from->surname_len, &to->surname_len) ||
-        put_user(from->name_len, &to->name_len) ||
-        put_user(from->phone_len, &to->phone_len) ||
-        put_user(from->email_len, &to->email_len) ||
-        put_user(from->age, &to->age))
+    // The header goes back at once, with the user space pointers intact
+    user_ptrs->surname_len = from->surname_len;
+    user_ptrs->name_len = from->name_len;
+    user_ptrs->phone_len = from->phone_len;
+    user_ptrs->email_len = from->email_len;
+    user_ptrs->age = from->age;
+
+    if (copy_to_user(to, user_ptrs, sizeof(struct user_data)))
         return -EFAULT;
 
     return 0;
 }
 
-static int fill_add_message(struct user_data *user, char output_string[], size_t *output_len)
+// Only the records that every lookup and deletion accepts are added: the module answers a record as one line
+// "name surname phone email age\n" of BUFFER_SIZE - 1 chars at most, so no field may be longer than that either,
+// and such strings always fit into the PHONEBOOK_RECORD_SIZE buffer of get_user
+static int check_user_size(const struct user_data *user)
 {
-    char age_string[BUFFER_SIZE];
-    size_t lengths[USER_STRINGS];
-    size_t i;
-
-    // Overflow checking
-    lengths[0] = user->surname_len;
-    lengths[1] = user->name_len;
-    lengths[2] = user->phone_len;
-    lengths[3] = user->email_len;
-    lengths[4] = snprintf(age_string, BUFFER_SIZE, "%ld", user->age);
-
-    *output_len = lengths[0];
-    for (i = 1; i < USER_STRINGS; ++i)
-    {
-        if (lengths[i] > (BUFFER_SIZE - 1) - *output_len)
-            return -EOVERFLOW;
+    size_t line_len = snprintf(NULL, 0, "%ld", user->age) + 5; // 4 spaces and '\n'
 
-        *output_len += lengths[i] + 1; // +1 for the space character
-    }
+    if (user->name_len > BUFFER_SIZE - 1 || user->surname_len > BUFFER_SIZE - 1 ||
+        user->phone_len > BUFFER_SIZE - 1 || user->email_len > BUFFER_SIZE - 1)
+        return -EOVERFLOW;
 
-    // Command ("a ", '\n' -- 3 chars)
-    if (*output_len > (BUFFER_SIZE - 1) - 3)
+    line_len += user->name_len + user->surname_len + user->phone_len + user->email_len;
+    if (line_len > BUFFER_SIZE - 1)
         return -EOVERFLOW;
 
-    *output_len += 3;
+    return 0;
+}
+
+static int copy_surname_from_user(char surname[],
+                                  const char __user *user_surname,
+                                  unsigned int len)
+{
+    // +1 for '\0'
+    if (len > BUFFER_SIZE - 1)
+        return -EOVERFLOW;
 
-    snprintf(output_string,
-             BUFFER_SIZE,
-             "a %s %s %s %s %s\n",
-             user->name,
-             user->surname,
-             user->phone,
-             user->email,
-             age_string);
+    if (copy_from_user(surname, user_surname, len))
+        return -EFAULT;
 
+    surname[len] = '\0';
     return 0;
 }
 
-static int send_surname_message(const char command,
-                                const char __user *surname,
-                                unsigned int len)
+SYSCALL_DEFINE0(hello_world)
 {
-    char ker_space_surname[BUFFER_SIZE], message[BUFFER_SIZE];
-    struct file *filp;
+    printk(KERN_INFO "Hello, world!");
+    return 0;
+}
+
+SYSCALL_DEFINE3(get_user,
+                const char __user *, surname,
+                unsigned int, len,
+                struct __user user_data *, output_data)
+{
+    char kern_surname[BUFFER_SIZE], strings[PHONEBOOK_RECORD_SIZE];
+    struct user_data user, user_ptrs;
     int err;
 
-    // command char, space, '\n' -- 3 chars
-    if (len > (BUFFER_SIZE - 1) - 3)
-        return -EOVERFLOW;
+    err = copy_surname_from_user(kern_surname, surname, len);
+    if (err)
+        return err;
 
-    if (copy_from_user(&ker_space_surname, surname, len))
+    if (!output_data || copy_from_user(&user_ptrs, output_data, sizeof(struct user_data)))
         return -EFAULT;
 
-    ker_space_surname[len] = '\0';
+    err = get_user_rcu(kern_surname, &user, strings, sizeof(strings));
+    if (err)
+        return err;
 
-    snprintf(message, BUFFER_SIZE, "%c %s\n", command, ker_space_surname);
+    return copy_user_data_to_user(output_data, &user_ptrs, &user);
+}
 
-    filp = open_file(DEVICE_FILE, O_WRONLY);
-    if (!filp)
+SYSCALL_DEFINE1(add_user,
+                struct __user user_data *, input_data)
+{
+    char strings[PHONEBOOK_RECORD_SIZE];
+    const struct phonebook_ops *ops;
+    struct user_data user;
+    int err;
+
+    err = copy_user_data_from_user(&user, input_data, strings, sizeof(strings));
+    if (!err)
+        err = check_user_size(&user);
+    if (err)
+        return err;
+
+    ops = get_ops();
+    if (!ops)
         return -ENOENT;
 
-    err = kernel_write(filp, message, sizeof(char) * (len + 3), &filp->f_pos);
-    close_file(filp);
+    err = ops->add(&user);
+    put_ops(ops);
+
+    return err;
+}
+
+SYSCALL_DEFINE2(del_user,
+                const char __user *, surname,
+                unsigned int, len)
+{
+    char kern_surname[BUFFER_SIZE];
+    const struct phonebook_ops *ops;
+    int err;
 
-    if (err < 0)
+    err = copy_surname_from_user(kern_surname, surname, len);
+    if (err)
         return err;
 
-    return 0;
+    ops = get_ops();
+    if (!ops)
+        return -ENOENT;
+
+    err = ops->del(kern_surname);
+    put_ops(ops);
+
+    return err;
 }
 
-static int parse_find_output(char message[], const size_t len, struct user_data *user)
+// The surname of the entry is the key, and the found record is written back over it
+static int get_users_entry(struct user_data __user *entry,
+                           char kern_surname[],
+                           char strings[],
+                           size_t size)
 {
-    char *age_str = NULL;
+    struct user_data user, user_ptrs;
+    int err;
 
-    user->name = NULL;
-    user->surname = NULL;
-    user->phone = NULL;
-    user->email = NULL;
-    user->age = 0;
+    if (copy_from_user(&user_ptrs, entry, sizeof(struct user_data)))
+        return -EFAULT;
 
-    user->name = strsep(&message, " ");
-    if (!user->name)
-        return -EINVAL;
-    else
-        user->name_len = strnlen(user->name, BUFFER_SIZE);
+    if (user_ptrs.surname_len > UINT_MAX)
+        return -EOVERFLOW;
 
-    user->surname = strsep(&message, " ");
-    if (!user->surname)
-        return -EINVAL;
-    else
-        user->surname_len = strnlen(user->surname, BUFFER_SIZE);
+    err = copy_surname_from_user(kern_surname, user_ptrs.surname, user_ptrs.surname_len);
+    if (err)
+        return err;
 
-    user->phone = strsep(&message, " ");
-    if (!user->phone)
-        return -EINVAL;
-    else
-        user->phone_len = strnlen(user->phone, BUFFER_SIZE);
+    err = get_user_rcu(kern_surname, &user, strings, size);
+    if (err)
+        return err;
 
-    user->email = strsep(&message, " ");
-    if (!user->email)
-        return -EINVAL;
-    else
-        user->email_len = strnlen(user->email, BUFFER_SIZE);
+    return copy_user_data_to_user(entry, &user_ptrs, &user);
+}
 
-    age_str = strsep(&message, " ");
-    if (!age_str)
-        return -EINVAL;
+/*
+*  Batches: every entry of users is a separate request, and its result goes to the same index of statuses
+*  (0 or a negative error code). Returns the number of the successful entries,
+*  or an error if the statuses can't be written.
+*  The entries hold pointers and native longs, so the batches are only wired up for the 64-bit ABI.
+*/
+
+SYSCALL_DEFINE3(get_users,
+                struct __user user_data *, users,
+                __s32 __user *, statuses,
+                unsigned int, count)
+{
+    char kern_surname[BUFFER_SIZE], strings[PHONEBOOK_RECORD_SIZE];
+    unsigned int i, done = 0;
+    int status;
 
-    if (kstrtol(age_str, 10, &user->age))
-        return -EINVAL;
+    // Every lookup is under RCU on its own, just like get_user, so the module isn't pinned for the batch
+    if (!rcu_access_pointer(phonebook_ops))
+        return -ENOENT;
 
-    return 0;
+    for (i = 0; i < count; ++i)
+    {
+        status = get_users_entry(users + i, kern_surname, strings, sizeof(strings));
+        if (put_user(status, statuses + i))
+            return -EFAULT;
+
+        if (!status)
+            ++done;
+        cond_resched();
+    }
+
+    return done;
 }
 
-SYSCALL_DEFINE0(hello_world)
+SYSCALL_DEFINE3(add_users,
+                struct __user user_data *, users,
+                __s32 __user *, statuses,
+                unsigned int, count)
 {
-    printk(KERN_INFO "Hello, world!");
-    return 0;
+    char strings[PHONEBOOK_RECORD_SIZE];
+    const struct phonebook_ops *ops;
+    struct user_data user;
+    unsigned int i, done = 0;
+    int status;
+
+    ops = get_ops();
+    if (!ops)
+        return -ENOENT;
+
+    for (i = 0; i < count; ++i)
+    {
+        status = copy_user_data_from_user(&user, users + i, strings, sizeof(strings));
+        if (!status)
+            status = check_user_size(&user);
+        if (!status)
+            status = ops->add(&user);
+
+        if (put_user(status, statuses + i))
+        {
+            put_ops(ops);
+            return -EFAULT;
+        }
+
+        if (!status)
+            ++done;
+        cond_resched();
+    }
+
+    put_ops(ops);
+    return done;
 }
 
-SYSCALL_DEFINE3(get_user,
-                const char __user *, surname,
-                unsigned int, len,
-                struct __user user_data *, output_data)
+/*
+*  Packed records (see struct user_record) are copied into buffers on the stack: a record that can be added
+*  has less than BUFFER_SIZE bytes of strings, so add_user_packed takes buffers of up to USER_RECORD_MAX only.
+*/
+
+#define SMALL_RECORD_SIZE (sizeof(struct user_record) + PHONEBOOK_RECORD_SIZE)
+
+// Returns the size of the record, or an error code
+static long fill_record(const char *surname, struct user_record *record, size_t size)
 {
-    char user_message[BUFFER_SIZE];
-    int err, message_len;
-    struct file *filp;
     struct user_data user;
+    int err;
 
-    err = send_surname_message('f', surname, len);
+    err = get_user_rcu(surname, &user, record->strings, size - sizeof(struct user_record));
     if (err)
         return err;
 
-    filp = open_file(DEVICE_FILE, O_RDONLY);
-    if (!filp)
-        return -ENOENT;
+    // The strings are packed right after the header already
+    record->age = user.age;
+    record->name_len = user.name_len;
+    record->surname_len = user.surname_len;
+    record->phone_len = user.phone_len;
+    record->email_len = user.email_len;
 
-    message_len = kernel_read(filp, user_message, BUFFER_SIZE, &filp->f_pos);
-    close_file(filp);
+    return sizeof(struct user_record) +
+           user.name_len + user.surname_len + user.phone_len + user.email_len + 4; // 4 terminators
+}
 
-    if (message_len < 0)
-        return message_len;
+SYSCALL_DEFINE4(get_user_packed,
+                const char __user *, surname,
+                unsigned int, len,
+                struct user_record __user *, record,
+                unsigned int, size)
+{
+    u64 small[DIV_ROUND_UP(SMALL_RECORD_SIZE, sizeof(u64))];
+    char kern_surname[BUFFER_SIZE];
+    struct user_record *kern_record = (struct user_record *)small;
+    long result;
+    int err;
 
-    user_message[message_len - 1] = '\0'; // change '\n' to '\0'
+    if (size < sizeof(struct user_record))
+        return -EOVERFLOW;
 
-    err = parse_find_output(user_message, message_len, &user);
+    err = copy_surname_from_user(kern_surname, surname, len);
     if (err)
         return err;
 
-    err = copy_user_data_to_user(output_data, &user);
-    if (err)
-        return err;
+    result = fill_record(kern_surname, kern_record, sizeof(small));
+    if (result > 0)
+    {
+        if (result > size)
+            result = -EOVERFLOW;
+        else if (copy_to_user(record, kern_record, result))
+            result = -EFAULT;
+    }
+
+    return result;
+}
+
+// Checks that every string of the copied record is in place and terminated, and points the user at them
+static int unpack_record(struct user_record *record, size_t size, struct user_data *user)
+{
+    char *strings[4];
+    size_t lengths[4], i;
+    char *string = record->strings;
+
+    size -= sizeof(struct user_record);
+
+    lengths[0] = record->name_len;
+    lengths[1] = record->surname_len;
+    lengths[2] = record->phone_len;
+    lengths[3] = record->email_len;
+
+    for (i = 0; i < 4; ++i)
+    {
+        if (lengths[i] >= size || string[lengths[i]] != '\0' || strnlen(string, lengths[i]) != lengths[i])
+            return -EINVAL;
+
+        strings[i] = string;
+        string += lengths[i] + 1;
+        size -= lengths[i] + 1;
+    }
+
+    user->name = strings[0];
+    user->surname = strings[1];
+    user->phone = strings[2];
+    user->email = strings[3];
+
+    user->name_len = lengths[0];
+    user->surname_len = lengths[1];
+    user->phone_len = lengths[2];
+    user->email_len = lengths[3];
+    user->age = record->age;
 
     return 0;
 }
 
-SYSCALL_DEFINE1(add_user,
-                struct __user user_data *, input_data)
+SYSCALL_DEFINE2(add_user_packed,
+                const struct user_record __user *, record,
+                unsigned int, size)
 {
+    u64 small[DIV_ROUND_UP(USER_RECORD_MAX, sizeof(u64))];
+    struct user_record *kern_record = (struct user_record *)small;
+    const struct phonebook_ops *ops;
     struct user_data user;
-
     int err;
-    char add_message[BUFFER_SIZE];
-    size_t add_message_len;
 
-    struct file *filp;
+    if (size < sizeof(struct user_record))
+        return -EINVAL;
+    if (size > USER_RECORD_MAX)
+        return -EOVERFLOW;
 
-    err = copy_user_data_from_user(&user, input_data);
-    if (err)
-        return err;
+    if (copy_from_user(kern_record, record, size))
+        return -EFAULT;
 
-    err = fill_add_message(&user, add_message, &add_message_len);
-    deallocate_user_data(&user);
+    err = unpack_record(kern_record, size, &user);
+    if (!err)
+        err = check_user_size(&user);
     if (err)
         return err;
 
-    filp = open_file(DEVICE_FILE, O_WRONLY);
-    if (!filp)
+    ops = get_ops();
+    if (!ops)
         return -ENOENT;
 
-    err = kernel_write(filp, add_message, sizeof(char) * add_message_len, &filp->f_pos);
-    close_file(filp);
-
-    if (err < 0)
-        return err;
-
-    return 0;
+    err = ops->add(&user);
+    put_ops(ops);
+    return err;
 }
 
-SYSCALL_DEFINE2(del_user,
-                const char __user *, surname,
-                unsigned int, len)
+#define SCAN_BUFFER_MAX (64 * 1024) // bytes packed by a single scan at most
+
+/*
+*  Packs as many users added after the cursor as fit into the buffer, in the order of adding,
+*  and stores the cursor of the next scan. The cursor starts from 0 and is opaque otherwise.
+*  Returns the number of bytes used (0 when there are no more users).
+*/
+SYSCALL_DEFINE3(scan_users,
+                u64 __user *, cursor,
+                void __user *, buffer,
+                unsigned int, size)
 {
-    return send_surname_message('d', surname, len);
+    const struct phonebook_ops *ops;
+    u64 kern_cursor;
+    char *records;
+    long result;
+
+    if (get_user(kern_cursor, cursor))
+        return -EFAULT;
+
+    size = min_t(unsigned int, size, SCAN_BUFFER_MAX);
+    records = kvmalloc(size, GFP_KERNEL);
+    if (!records)
+        return -ENOMEM;
+
+    ops = get_ops();
+    if (!ops)
+    {
+        kvfree(records);
+        return -ENOENT;
+    }
+
+    result = ops->scan(&kern_cursor, records, size);
+    put_ops(ops);
+
+    if (result > 0 && (copy_to_user(buffer, records, result) || put_user(kern_cursor, cursor)))
+        result = -EFAULT;
+
+    kvfree(records);
+    return result;
 }